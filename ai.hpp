@@ -0,0 +1,350 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "game.hpp"
+
+// Computer player for any Game variant.
+//
+// Iterative deepening negamax with alpha-beta. Each iteration searches the
+// best root move of the previous one first, alone, to get a bound; the
+// remaining root moves are then shared out between threads, which search
+// them with a null window against the best score so far. All threads share
+// one lock-free transposition table, which also carries move ordering from
+// one iteration (and one turn) to the next.
+//
+// The helper threads are started once, in the constructor, and sleep
+// between iterations; thread start-up would otherwise dominate a search
+// on a small board, which runs many short iterations per move.
+//
+// choose() stops at its time budget and returns the best move of the
+// deepest iteration that finished.
+class Ai {
+public:
+    explicit Ai(int threads = (int)std::max(1u, std::thread::hardware_concurrency()),
+                int time_ms = 1000, size_t tt_entries = size_t(1) << 20)
+        : threads_(std::max(1, threads)), time_ms_(std::max(1, time_ms)) {
+        size_t n = 1;
+        while (n < tt_entries) n <<= 1;
+        tt_.reset(new TTEntry[n]);
+        tt_mask_ = n - 1;
+        for (int t = 1; t < threads_; ++t) pool_.emplace_back([this, t]{ helper_loop(t); });
+    }
+
+    ~Ai() {
+        {
+            std::lock_guard<std::mutex> g(pool_m_);
+            quit_ = true;
+        }
+        pool_cv_.notify_all();
+        for (auto &t : pool_) t.join();
+    }
+
+    Ai(const Ai &) = delete;
+    Ai &operator=(const Ai &) = delete;
+
+    // Best move for the side to move; -1 if the game is over.
+    int choose(const Game &g) {
+        if (g.outcome() != ONGOING) return -1;
+        deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_ms_);
+        stop_ = false;
+        nodes_ = 0;
+        Game root = g;
+        std::vector<int> moves = ordered_moves(root, -1);
+        int best = moves[0];
+        last_depth_ = 0;
+        last_score_ = 0;
+        if (moves.size() == 1) return best;
+
+        int empties = root.cells() - root.moves();
+        for (int depth = 1; depth <= empties; ++depth) {
+            std::iter_swap(moves.begin(), std::find(moves.begin(), moves.end(), best));
+            Game first = root;
+            uint64_t first_nodes = 0;
+            int score = -child_score(first, moves[0], depth, -INF, INF, first_nodes);
+            nodes_ += first_nodes;
+            if (stop_) break;
+            std::atomic<int> alpha{score};
+            int iter_best = moves[0];
+            std::mutex m;
+            std::atomic<size_t> next{1};
+            auto work = [&]{
+                Game c = root;
+                uint64_t nodes = 0;
+                size_t i;
+                while ((i = next++) < moves.size() && !stop_) {
+                    int a = alpha.load();
+                    int s = -child_score(c, moves[i], depth, -a - 1, -a, nodes);
+                    if (s > a && !stop_) s = -child_score(c, moves[i], depth, -INF, -a, nodes);
+                    if (stop_) break;
+                    std::lock_guard<std::mutex> g(m);
+                    if (s > alpha.load()) {
+                        alpha = s;
+                        iter_best = moves[i];
+                    }
+                }
+                nodes_ += nodes;
+            };
+            run_parallel(work, std::min(threads_, (int)moves.size() - 1));
+            if (stop_) break;
+            best = iter_best;
+            last_depth_ = depth;
+            last_score_ = alpha;
+            // A forced result will not change with more depth.
+            if (std::abs(last_score_) >= WIN - MAX_PLY) break;
+        }
+        return best;
+    }
+
+    int last_depth() const { return last_depth_; }
+    int last_score() const { return last_score_; }
+    uint64_t last_nodes() const { return nodes_; }
+
+private:
+    static const int INF = 1 << 30;
+    static const int WIN = 1 << 28;
+    static const int MAX_PLY = 1024;
+    enum Bound : uint8_t { EXACT, LOWER, UPPER };
+
+    // Lockless entry: key is stored xor'ed with data, so a torn read of a
+    // concurrently written entry fails the key check instead of returning
+    // a mixed-up move.
+    struct TTEntry {
+        std::atomic<uint64_t> key{0};
+        std::atomic<uint64_t> data{0};
+    };
+
+    struct Hit {
+        int score;
+        int depth;
+        Bound bound;
+        int move;
+    };
+
+    bool probe(uint64_t h, Hit &hit) const {
+        const TTEntry &e = tt_[h & tt_mask_];
+        uint64_t d = e.data.load(std::memory_order_relaxed);
+        uint64_t k = e.key.load(std::memory_order_relaxed);
+        if ((k ^ d) != h || d == 0) return false;
+        hit.score = (int32_t)(uint32_t)d;
+        hit.depth = (int)((d >> 32) & 0xFF);
+        hit.bound = (Bound)((d >> 40) & 0x3);
+        hit.move = (int)(d >> 48) - 1;
+        return true;
+    }
+
+    void store(uint64_t h, int score, int depth, Bound bound, int move) {
+        uint64_t d = (uint64_t)(uint32_t)score | ((uint64_t)std::min(depth, 255) << 32) |
+                     ((uint64_t)bound << 40) | ((uint64_t)(move + 1) << 48);
+        TTEntry &e = tt_[h & tt_mask_];
+        e.key.store(h ^ d, std::memory_order_relaxed);
+        e.data.store(d, std::memory_order_relaxed);
+    }
+
+    // Win scores are stored relative to the node so they stay valid when
+    // the same position is reached at another ply.
+    static int to_tt(int s, int ply) { return s >= WIN - MAX_PLY ? s + ply : s <= -WIN + MAX_PLY ? s - ply : s; }
+    static int from_tt(int s, int ply) { return s >= WIN - MAX_PLY ? s - ply : s <= -WIN + MAX_PLY ? s + ply : s; }
+
+    // Runs job on the calling thread and on the first width - 1 helpers,
+    // and returns once all of them are done with it.
+    void run_parallel(const std::function<void()> &job, int width) {
+        {
+            std::lock_guard<std::mutex> g(pool_m_);
+            job_ = &job;
+            width_ = width;
+            busy_ = (int)pool_.size();
+            ++gen_;
+        }
+        pool_cv_.notify_all();
+        job();
+        std::unique_lock<std::mutex> lk(pool_m_);
+        done_cv_.wait(lk, [&]{ return busy_ == 0; });
+        job_ = nullptr;
+    }
+
+    // Helper t runs every job posted while it is within the job's width.
+    void helper_loop(int t) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lk(pool_m_);
+        for (;;) {
+            pool_cv_.wait(lk, [&]{ return quit_ || gen_ != seen; });
+            if (quit_) return;
+            seen = gen_;
+            if (t < width_) {
+                const std::function<void()> *job = job_;
+                lk.unlock();
+                (*job)();
+                lk.lock();
+            }
+            if (--busy_ == 0) done_cv_.notify_one();
+        }
+    }
+
+    // Plays m, scores the position for the side that moved into it, undoes.
+    int child_score(Game &g, int m, int depth, int alpha, int beta, uint64_t &nodes) {
+        Outcome o = g.play(m);
+        int s;
+        if (o == DRAW) s = 0;
+        else if (o != ONGOING) s = -(WIN - 1);
+        else s = search(g, depth - 1, alpha, beta, 1, nodes);
+        g.undo(m);
+        return s;
+    }
+
+    // nodes is the calling thread's own counter, so threads do not share
+    // a hot cache line.
+    int search(Game &g, int depth, int alpha, int beta, int ply, uint64_t &nodes) {
+        if ((++nodes & 255) == 0 && std::chrono::steady_clock::now() >= deadline_) stop_ = true;
+        if (stop_) return 0;
+        if (depth <= 0) return evaluate(g);
+
+        int alpha0 = alpha;
+        int tt_move = -1;
+        Hit hit;
+        if (probe(g.hash(), hit)) {
+            tt_move = hit.move;
+            if (hit.depth >= depth) {
+                int s = from_tt(hit.score, ply);
+                if (hit.bound == EXACT) return s;
+                if (hit.bound == LOWER && s >= beta) return s;
+                if (hit.bound == UPPER && s <= alpha) return s;
+            }
+        }
+
+        int best = -INF, best_move = -1;
+        for (int m : ordered_moves(g, tt_move)) {
+            Outcome o = g.play(m);
+            int s;
+            if (o == DRAW) s = 0;
+            else if (o != ONGOING) s = WIN - ply - 1;
+            else s = -search(g, depth - 1, -beta, -alpha, ply + 1, nodes);
+            g.undo(m);
+            if (stop_) return 0;
+            if (s > best) { best = s; best_move = m; }
+            if (s > alpha) alpha = s;
+            if (alpha >= beta) break;
+        }
+        Bound b = best <= alpha0 ? UPPER : best >= beta ? LOWER : EXACT;
+        store(g.hash(), to_tt(best, ply), depth, b, best_move);
+        return best;
+    }
+
+    // Weight of a line holding c stones of one side and none of the other.
+    static int line_weight(int c, int k) {
+        if (c <= 0) return 0;
+        if (c >= k) return WIN / 4;
+        int w = 1;
+        for (int i = 1; i < c && w < (1 << 20); ++i) w *= 8;
+        return w;
+    }
+
+    // Score of the position for the side to move: open lines for us minus
+    // open lines for them.
+    static int evaluate(const Game &g) {
+        const Rules &r = g.rules();
+        Cell me = g.to_move(), them = me == X ? O : X;
+        const Bits &mine = g.stones(me), &theirs = g.stones(them);
+        int64_t s = 0;
+        for (auto &line : r.lines) {
+            int a = mine.count_and(line), b = theirs.count_and(line);
+            if (a && !b) s += line_weight(a, r.k);
+            else if (b && !a) s -= line_weight(b, r.k);
+        }
+        return (int)std::max<int64_t>(-WIN / 2, std::min<int64_t>(WIN / 2, s));
+    }
+
+    // Cells worth trying, best-looking first. On boards bigger than 4x4
+    // only cells near existing stones are considered.
+    std::vector<int> ordered_moves(const Game &g, int first) {
+        const Rules &r = g.rules();
+        Bits occ;
+        for (int k = 0; k < Bits::WORDS; ++k) occ.w[k] = g.stones(X).w[k] | g.stones(O).w[k];
+        Bits cand;
+        if (r.n <= 4) {
+            for (int i = 0; i < g.cells(); ++i) cand.set(i);
+        } else if (g.moves() == 0) {
+            cand.set((r.n / 2) * r.n + r.n / 2);
+        } else {
+            const std::vector<Bits> &near = near_masks(r);
+            for (int k = 0; k < Bits::WORDS; ++k) {
+                uint64_t w = occ.w[k];
+                while (w) {
+                    int i = k * 64 + __builtin_ctzll(w);
+                    w &= w - 1;
+                    for (int j = 0; j < Bits::WORDS; ++j) cand.w[j] |= near[i].w[j];
+                }
+            }
+        }
+        Cell me = g.to_move(), them = me == X ? O : X;
+        const Bits &mine = g.stones(me), &theirs = g.stones(them);
+        std::vector<std::pair<int64_t,int>> scored;
+        for (int i = 0; i < g.cells(); ++i) {
+            if (!cand.test(i) || occ.test(i)) continue;
+            int64_t s = i == first ? INF : 0;
+            if (i != first) {
+                for (uint32_t j = r.offset[i]; j < r.offset[i + 1]; ++j) {
+                    const Bits &line = r.lines[r.through[j]];
+                    int a = mine.count_and(line), b = theirs.count_and(line);
+                    // Extending our line counts a little more than blocking theirs.
+                    if (!b) s += 2 * line_weight(a + 1, r.k);
+                    if (!a) s += line_weight(b + 1, r.k);
+                }
+            }
+            scored.push_back({-s, i});
+        }
+        std::sort(scored.begin(), scored.end());
+        std::vector<int> out;
+        out.reserve(scored.size());
+        for (auto &p : scored) out.push_back(p.second);
+        return out;
+    }
+
+    // For each cell, the cells within two steps of it.
+    const std::vector<Bits> &near_masks(const Rules &r) {
+        std::lock_guard<std::mutex> g(near_m_);
+        auto &v = near_[&r];
+        if (v.empty()) {
+            v.resize(r.n * r.n);
+            for (int i = 0; i < r.n * r.n; ++i) {
+                int row = i / r.n, col = i % r.n;
+                for (int dr = -2; dr <= 2; ++dr) {
+                    for (int dc = -2; dc <= 2; ++dc) {
+                        int rr = row + dr, cc = col + dc;
+                        if (rr >= 0 && rr < r.n && cc >= 0 && cc < r.n) v[i].set(rr * r.n + cc);
+                    }
+                }
+            }
+        }
+        return v;
+    }
+
+    int threads_;
+    int time_ms_;
+    std::unique_ptr<TTEntry[]> tt_;
+    size_t tt_mask_ = 0;
+    std::chrono::steady_clock::time_point deadline_;
+    std::atomic<bool> stop_{false};
+    std::atomic<uint64_t> nodes_{0};
+    int last_depth_ = 0;
+    int last_score_ = 0;
+    std::mutex near_m_;
+    std::map<const Rules*, std::vector<Bits>> near_;
+    std::vector<std::thread> pool_;
+    std::mutex pool_m_;
+    std::condition_variable pool_cv_, done_cv_;
+    const std::function<void()> *job_ = nullptr;
+    int width_ = 0;
+    int busy_ = 0;
+    uint64_t gen_ = 0;
+    bool quit_ = false;
+};
@@ -0,0 +1,869 @@
+// Benchmarks for the lobby's hot paths. Every result is printed as one JSON
+// object per line so runs can be diffed or loaded into a spreadsheet.
+//
+//   ./bench                 run every suite
+//   ./bench store wire      run only the named suites
+//   --duration-ms N         time per measurement (default 1000)
+//   --max-threads N         upper bound for thread sweeps (default 32)
+//   --users N,N,...         account counts for the startup and layout suites
+//                           (default 1000000,10000000)
+//   --snapshot-users N,...  account counts for the snapshot, sweep and
+//                           leaderboard suites
+//                           (default 10000,100000,1000000)
+//   --loss P                drop this fraction of game channel datagrams in
+//                           the transport suite (default 0)
+//
+// Suites: store, wire, frames, snapshot, startup, layout, game, sweep,
+// transport, leaderboard.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "json.hpp"
+#include "frame_reader.hpp"
+#include "game.hpp"
+#include "game_channel.hpp"
+#include "game_sync.hpp"
+#include "histogram.hpp"
+#include "leaderboard.hpp"
+#include "presence.hpp"
+#include "timer_wheel.hpp"
+#include "user_file.hpp"
+#include "user_store.hpp"
+#include "wire.hpp"
+
+using json = nlohmann::json;
+using namespace std;
+
+int duration_ms = 1000;
+int max_threads = 32;
+vector<long> big_users = {1000000, 10000000};
+vector<long> snapshot_users = {10000, 100000, 1000000};
+double loss = 0;
+
+// Keeps lookup results alive so the compiler cannot drop them.
+atomic<bool> sink_flag{false};
+
+void report(const json &j) { cout << j.dump() << endl; }
+
+// A presence entry as a node map holds it: key and strings owned by the
+// node, every field next to the others.
+struct NodePresence {
+    bool online = false;
+    atomic<int64_t> last_seen{steady_ticks()};
+    bool armed = false;
+    string game;
+    string ip;
+    int port = 0;
+    uint64_t token = 0;
+    atomic<int> xp{0};
+    atomic<int64_t> xp_at{0};
+    uint64_t match = 0;
+    bool reported = false;
+};
+
+// Presence as the lobby kept it before it was sharded: one map behind one
+// mutex.
+struct GlobalTable {
+    mutex m;
+    unordered_map<string, NodePresence> map;
+
+    void add(const string &name) { lock_guard<mutex> g(m); map[name].online = true; }
+    bool online(const string &name) {
+        lock_guard<mutex> g(m);
+        auto it = map.find(name);
+        return it != map.end() && it->second.online;
+    }
+    void touch(const string &name) {
+        lock_guard<mutex> g(m);
+        auto it = map.find(name);
+        if (it != map.end()) it->second.last_seen = steady_ticks();
+    }
+    void flip(const string &name) {
+        lock_guard<mutex> g(m);
+        auto it = map.find(name);
+        if (it != map.end()) it->second.online = !it->second.online;
+    }
+};
+
+struct ShardedTable {
+    PresenceTable table;
+
+    void add(const string &name) { table.upsert(name, [](PresenceTable::Ref p){ p.online = true; }); }
+    bool online(const string &name) {
+        bool on = false;
+        table.read(name, [&](PresenceTable::View p){ on = p.online; });
+        return on;
+    }
+    void touch(const string &name) {
+        table.read(name, [](PresenceTable::View p){ p.last_seen = steady_ticks(); });
+    }
+    void flip(const string &name) {
+        table.update(name, [](PresenceTable::Ref p){ p.online = !p.online; });
+    }
+};
+
+// Lobby-like mix per thread: 80% ONLINE_STATUS, 18% STATUS heartbeats,
+// 2% LOGIN/LOGOUT style writes, over uniformly random users.
+template <class Table>
+double run_mix(Table &t, const vector<string> &names, int threads) {
+    atomic<bool> stop{false};
+    vector<uint64_t> ops(threads * 8, 0);
+    vector<thread> pool;
+    for (int i = 0; i < threads; ++i) {
+        pool.emplace_back([&, i]{
+            mt19937_64 rng(i + 1);
+            uint64_t n = 0;
+            bool sink = false;
+            while (!stop.load(memory_order_relaxed)) {
+                for (int k = 0; k < 64; ++k) {
+                    const string &name = names[rng() % names.size()];
+                    unsigned r = rng() % 100;
+                    if (r < 80) sink ^= t.online(name);
+                    else if (r < 98) t.touch(name);
+                    else t.flip(name);
+                }
+                n += 64;
+            }
+            ops[i * 8] = n;
+            sink_flag = sink;
+        });
+    }
+    this_thread::sleep_for(chrono::milliseconds(duration_ms));
+    stop = true;
+    for (auto &th : pool) th.join();
+    uint64_t total = 0;
+    for (int i = 0; i < threads; ++i) total += ops[i * 8];
+    return total * 1000.0 / duration_ms;
+}
+
+void bench_store() {
+    const int N = 100000;
+    vector<string> names;
+    names.reserve(N);
+    for (int i = 0; i < N; ++i) names.push_back("user" + to_string(i));
+    GlobalTable global;
+    ShardedTable sharded;
+    for (auto &n : names) {
+        global.add(n);
+        sharded.add(n);
+    }
+    for (int th = 1; th <= max_threads; th *= 2) {
+        report({{"bench","user_store"},{"impl","global_mutex"},{"threads",th},{"users",N},
+                {"ops_per_sec", run_mix(global, names, th)}});
+        report({{"bench","user_store"},{"impl","sharded"},{"threads",th},{"users",N},
+                {"ops_per_sec", run_mix(sharded, names, th)}});
+    }
+}
+
+// Runs fn in batches for a quarter of --duration-ms and returns ns per call.
+template <class F>
+double ns_per_op(F &&fn) {
+    using clk = chrono::steady_clock;
+    auto budget = chrono::milliseconds(max(1, duration_ms / 4));
+    uint64_t n = 0;
+    auto start = clk::now();
+    auto now = start;
+    do {
+        for (int i = 0; i < 256; ++i) fn();
+        n += 256;
+        now = clk::now();
+    } while (now - start < budget);
+    return chrono::duration<double, nano>(now - start).count() / n;
+}
+
+// A PLAYERS reply listing 20 available players.
+json players_reply() {
+    json players = json::array();
+    for (int i = 0; i < 20; ++i) {
+        players.push_back({{"username","player_" + to_string(1000 + i)},{"ip","140.113.17.12"},{"port",15000 + i}});
+    }
+    return {{"status","OK"},{"players",players},{"id",7}};
+}
+
+// Bytes on the wire and encode/decode cost of real lobby and game messages
+// in each wire format.
+void bench_wire() {
+    vector<string> board = {"X","","O","","X","","","","O"};
+    vector<pair<string, json>> msgs = {
+        {"status_req", {{"cmd","STATUS"},{"username","player_0001"},{"id",12345}}},
+        {"status_reply", {{"status","OK"},{"detail","STATUS_UPDATED"},{"experience",420},{"id",12345}}},
+        {"login_reply", {{"status","OK"},{"detail","LOGIN_SUCCESS"},{"login_count",17},{"experience",420},
+                         {"heartbeat_ms",5000},{"heartbeat_port",12000},{"token",0x8a3f10c2d9e4b715ull},{"id",2}}},
+        {"players_reply", players_reply()},
+        {"move_req", {{"type","MOVE_REQ"},{"board",board}}},
+        {"game_end", {{"type","GAME_END"},{"result","WIN"},{"board",board}}},
+    };
+    for (auto &[name, msg] : msgs) {
+        for (WireFormat f : {WireFormat::Json, WireFormat::Cbor, WireFormat::MsgPack}) {
+            string frame = encode_frame(msg, f);
+            string payload = f == WireFormat::Json ? frame.substr(0, frame.size() - 1) : frame.substr(4);
+            double enc = ns_per_op([&]{ sink_flag = encode_frame(msg, f).size() & 1; });
+            double dec = ns_per_op([&]{ sink_flag = decode_payload(payload, f).is_object(); });
+            report({{"bench","wire"},{"message",name},{"format",wire_name(f)},
+                    {"frame_bytes",frame.size()},{"encode_ns",enc},{"decode_ns",dec}});
+        }
+    }
+}
+
+// One message through a socketpair per call: encode_frame and send on one
+// end, FrameReader and decode on the other, the way lobby and players
+// exchange them (this replaced send_json/recv_line).
+void bench_frames() {
+    vector<pair<string, json>> msgs = {
+        {"status_req", {{"cmd","STATUS"},{"username","player_0001"},{"id",12345}}},
+        {"players_reply", players_reply()},
+    };
+    for (auto &[name, msg] : msgs) {
+        for (WireFormat f : {WireFormat::Json, WireFormat::Cbor, WireFormat::MsgPack}) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); return; }
+            FrameReader rd(sv[1]);
+            rd.set_length_prefixed(f != WireFormat::Json);
+            string frame;
+            bool ok = true;
+            double ns = ns_per_op([&]{
+                string out = encode_frame(msg, f);
+                ok &= send(sv[0], out.data(), out.size(), 0) == (ssize_t)out.size();
+                ok &= rd.read_frame(frame) > 0 && decode_payload(frame, f).is_object();
+            });
+            close(sv[0]);
+            close(sv[1]);
+            if (!ok) { cerr << "frames: round trip failed\n"; return; }
+            report({{"bench","frames"},{"message",name},{"format",wire_name(f)},{"round_trip_ns",ns}});
+        }
+    }
+}
+
+// Runs fn in a forked child so its memory use is measured on its own, and
+// returns the JSON it produced with the child's peak RSS added.
+json in_child(const function<json()> &fn) {
+    int p[2];
+    if (pipe(p) < 0) { perror("pipe"); return json::object(); }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(p[0]);
+        string out = fn().dump();
+        if (write(p[1], out.data(), out.size()) < 0) perror("write");
+        _exit(0);
+    }
+    close(p[1]);
+    string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(p[0], buf, sizeof(buf))) > 0) out.append(buf, n);
+    close(p[0]);
+    int status = 0;
+    rusage ru{};
+    wait4(pid, &status, 0, &ru);
+    json r = out.empty() ? json::object() : json::parse(out);
+    r["peak_rss_mb"] = ru.ru_maxrss / 1024.0;
+    return r;
+}
+
+double seconds_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// Lobby startup from users.json (parse into a DOM, copy into UserStore, as
+// load_db() does) against mapping a users.db written by UserFile.
+void bench_startup() {
+    char dir[] = "/tmp/npbench.XXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return; }
+    string json_path = string(dir) + "/users.json", bin_path = string(dir) + "/users.db";
+    for (long n : big_users) {
+        auto name_of = [](long i) { return "player_" + to_string(i); };
+        json files = in_child([&]{
+            vector<pair<string, User>> snap(n);
+            ofstream out(json_path);
+            out << "{\"format\":2,\"seq\":0,\"users\":{";
+            for (long i = 0; i < n; ++i) {
+                snap[i].first = name_of(i);
+                User &u = snap[i].second;
+                u.password = "pw" + to_string(i * 7919);
+                u.login_count = i % 100;
+                u.experience = i % 5000;
+                json rec = {{"password", u.password}, {"login_count", u.login_count},
+                            {"experience", u.experience}};
+                out << (i ? "," : "") << json(snap[i].first).dump() << ":" << rec.dump();
+            }
+            out << "}}\n";
+            out.close();
+            UserFile::write(bin_path, snap, 0);
+            ifstream j(json_path, ios::ate), b(bin_path, ios::ate);
+            return json{{"json_bytes", (uint64_t)j.tellg()}, {"bin_bytes", (uint64_t)b.tellg()}};
+        });
+
+        json from_json = in_child([&]{
+            auto t0 = chrono::steady_clock::now();
+            UserStore store;
+            ifstream in(json_path);
+            json j;
+            in >> j;
+            for (auto it = j["users"].begin(); it != j["users"].end(); ++it) {
+                User u;
+                u.password = it.value().value("password", "");
+                u.login_count = it.value().value("login_count", 0);
+                u.experience = it.value().value("experience", 0);
+                store.put(it.key(), u);
+            }
+            double ready = seconds_since(t0);
+            return json{{"ready_sec", ready}, {"users", store.size()}};
+        });
+        report({{"bench","startup"},{"store","json"},{"users",n},{"file_bytes",files["json_bytes"]},
+                {"ready_sec",from_json["ready_sec"]},{"peak_rss_mb",from_json["peak_rss_mb"]}});
+
+        json from_bin = in_child([&]{
+            auto t0 = chrono::steady_clock::now();
+            UserFile file;
+            UserStore store;
+            if (!file.open(bin_path)) return json::object();
+            store.set_base(&file);
+            bool found = store.read(name_of(n / 2), [](UserView){});
+            double ready = seconds_since(t0);
+            // First lookups of random users fault their index and record
+            // pages in from the page cache.
+            mt19937_64 rng(1);
+            const int lookups = 100000;
+            auto t1 = chrono::steady_clock::now();
+            for (int i = 0; i < lookups; ++i) {
+                found &= store.read(name_of(rng() % n), [](UserView){});
+            }
+            double lookup_ns = seconds_since(t1) * 1e9 / lookups;
+            sink_flag = found;
+            return json{{"ready_sec", ready}, {"first_lookup_ns", lookup_ns}};
+        });
+        report({{"bench","startup"},{"store","mmap"},{"users",n},{"file_bytes",files["bin_bytes"]},
+                {"ready_sec",from_bin["ready_sec"]},{"first_lookup_ns",from_bin["first_lookup_ns"]},
+                {"peak_rss_mb",from_bin["peak_rss_mb"]}});
+    }
+    unlink(json_path.c_str());
+    unlink(bin_path.c_str());
+    rmdir(dir);
+}
+
+// Writes a snapshot the way save_db() does for --store json: one JSON
+// document, written to a temp name, synced and renamed.
+bool save_json_snapshot(const string &path, const vector<pair<string, User>> &snap) {
+    json j_users = json::object();
+    for (auto &[k,v] : snap) {
+        j_users[k] = {{"password", v.password}, {"login_count", v.login_count}, {"experience", v.experience}};
+    }
+    string out = json{{"format", 2}, {"seq", 0}, {"users", j_users}}.dump();
+    out.push_back('\n');
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, out.data(), out.size()) == (ssize_t)out.size() && fsync(fd) == 0;
+    close(fd);
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// save_db() and load_db() for both stores at the sizes a lobby actually
+// runs at. Loading users.json is parsing it into UserStore; loading
+// users.db is mapping it and one lookup.
+void bench_snapshot() {
+    char dir[] = "/tmp/npbench.XXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return; }
+    string json_path = string(dir) + "/users.json", bin_path = string(dir) + "/users.db";
+    for (long n : snapshot_users) {
+        vector<pair<string, User>> snap(n);
+        for (long i = 0; i < n; ++i) {
+            snap[i].first = "player_" + to_string(i);
+            snap[i].second.password = "pw" + to_string(i * 7919);
+            snap[i].second.login_count = i % 100;
+            snap[i].second.experience = i % 5000;
+        }
+        for (const char *store : {"json", "mmap"}) {
+            bool is_json = string(store) == "json";
+            const string &path = is_json ? json_path : bin_path;
+            auto t0 = chrono::steady_clock::now();
+            bool ok = is_json ? save_json_snapshot(path, snap) : UserFile::write(path, snap, 0);
+            double save_sec = seconds_since(t0);
+            ifstream f(path, ios::ate);
+            uint64_t bytes = f.tellg();
+
+            t0 = chrono::steady_clock::now();
+            UserFile file;
+            UserStore users;
+            if (is_json) {
+                ifstream in(path);
+                json j;
+                in >> j;
+                for (auto it = j["users"].begin(); it != j["users"].end(); ++it) {
+                    User u;
+                    u.password = it.value().value("password", "");
+                    u.login_count = it.value().value("login_count", 0);
+                    u.experience = it.value().value("experience", 0);
+                    users.put(it.key(), u);
+                }
+            } else {
+                ok &= file.open(path);
+                users.set_base(&file);
+            }
+            ok &= users.read(snap[n / 2].first, [](UserView){});
+            double load_sec = seconds_since(t0);
+            if (!ok) { cerr << "snapshot: " << store << " round trip failed\n"; continue; }
+            report({{"bench","snapshot"},{"store",store},{"users",n},{"file_bytes",bytes},
+                    {"save_sec",save_sec},{"load_sec",load_sec}});
+        }
+    }
+    unlink(json_path.c_str());
+    unlink(bin_path.c_str());
+    rmdir(dir);
+}
+
+size_t rss_bytes() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Memory per user and random lookups for the node map the lobby used to
+// keep against UserStore's flat shards.
+template <class Fill, class Lookup>
+json measure_layout(long n, Fill &&fill, Lookup &&lookup) {
+    vector<string> probe(1 << 20);
+    mt19937_64 rng(7);
+    for (auto &p : probe) p = "player_" + to_string(rng() % n);
+    size_t before = rss_bytes();
+    auto t0 = chrono::steady_clock::now();
+    for (long i = 0; i < n; ++i) {
+        User u;
+        u.password = "pw" + to_string(i * 7919);
+        u.login_count = i % 100;
+        u.experience = i % 5000;
+        fill("player_" + to_string(i), u);
+    }
+    double fill_sec = seconds_since(t0);
+    size_t bytes = rss_bytes() - before;
+    uint64_t hits = 0;
+    t0 = chrono::steady_clock::now();
+    for (int round = 0; round < 4; ++round) {
+        for (auto &p : probe) hits += lookup(p);
+    }
+    double lookup_sec = seconds_since(t0);
+    sink_flag = hits & 1;
+    return {{"bytes_per_user", (double)bytes / n}, {"fill_sec", fill_sec},
+            {"lookups_per_sec", probe.size() * 4 / lookup_sec}};
+}
+
+// Memory per user and a full presence sweep, with one user in ten online,
+// for a node map of presence entries against PresenceTable.
+template <class Fill, class Sweep>
+json measure_presence(long n, Fill &&fill, Sweep &&sweep) {
+    size_t before = rss_bytes();
+    auto t0 = chrono::steady_clock::now();
+    for (long i = 0; i < n; ++i) fill("player_" + to_string(i), i % 10 == 0);
+    double fill_sec = seconds_since(t0);
+    size_t bytes = rss_bytes() - before;
+    t0 = chrono::steady_clock::now();
+    uint64_t stale = sweep(steady_ticks());
+    double sweep_sec = seconds_since(t0);
+    sink_flag = stale & 1;
+    return {{"bytes_per_user", (double)bytes / n}, {"fill_sec", fill_sec},
+            {"sweep_users_per_sec", n / sweep_sec}};
+}
+
+void bench_layout() {
+    for (long n : big_users) {
+        json node = in_child([&]{
+            unordered_map<string, User> map;
+            return measure_layout(n,
+                [&](const string &name, const User &u){ map.emplace(name, u); },
+                [&](const string &name){ return map.count(name) != 0; });
+        });
+        node["bench"] = "layout"; node["impl"] = "node_map"; node["users"] = n;
+        report(node);
+
+        json flat = in_child([&]{
+            UserStore store;
+            return measure_layout(n,
+                [&](const string &name, const User &u){ store.put(name, u); },
+                [&](const string &name){ return store.read(name, [](UserView){}); });
+        });
+        flat["bench"] = "layout"; flat["impl"] = "flat_store"; flat["users"] = n;
+        report(flat);
+
+        json node_presence = in_child([&]{
+            unordered_map<string, NodePresence> map;
+            return measure_presence(n,
+                [&](const string &name, bool on){ map[name].online = on; },
+                [&](int64_t cutoff){
+                    uint64_t stale = 0;
+                    for (auto &kv : map) stale += kv.second.online && kv.second.last_seen < cutoff;
+                    return stale;
+                });
+        });
+        node_presence["bench"] = "layout_presence"; node_presence["impl"] = "node_map"; node_presence["users"] = n;
+        report(node_presence);
+
+        json flat_presence = in_child([&]{
+            PresenceTable table;
+            return measure_presence(n,
+                [&](const string &name, bool on){ table.upsert(name, [&](PresenceTable::Ref p){ p.online = on; }); },
+                [&](int64_t cutoff){
+                    uint64_t stale = 0;
+                    table.scan([&](const PresenceTable::Liveness &l){
+                        stale += l.online && l.last_seen < cutoff;
+                        return false;
+                    }, [](string_view, PresenceTable::View){});
+                    return stale;
+                });
+        });
+        flat_presence["bench"] = "layout_presence"; flat_presence["impl"] = "presence_table"; flat_presence["users"] = n;
+        report(flat_presence);
+    }
+}
+
+// Move and result checking (what check_tictactoe did) over random
+// playouts, plus loading a board from its wire form, per board variant.
+void bench_game() {
+    for (auto [n, k] : vector<pair<int,int>>{{3, 3}, {7, 5}, {15, 5}}) {
+        mt19937_64 rng(n * 131 + k);
+        vector<int> order(n * n);
+        for (int i = 0; i < n * n; ++i) order[i] = i;
+        vector<vector<int>> orders(64);
+        for (auto &o : orders) {
+            shuffle(order.begin(), order.end(), rng);
+            o = order;
+        }
+        uint64_t moves = 0, playouts = 0;
+        double playout_ns = ns_per_op([&]{
+            Game g(n, k);
+            for (int cell : orders[playouts++ % orders.size()]) {
+                ++moves;
+                if (g.play(cell) != ONGOING) break;
+            }
+        });
+        Game mid(n, k);
+        shuffle(order.begin(), order.end(), rng);
+        for (int i = 0; i < n * n / 2 && mid.outcome() == ONGOING; ++i) mid.play(order[i]);
+        vector<string> board = mid.to_strings();
+        Game loaded(n, k);
+        double load_ns = ns_per_op([&]{ sink_flag = loaded.load(board); });
+        report({{"bench","game"},{"size",n},{"k",k},{"playout_ns",playout_ns},
+                {"moves_per_playout",(double)moves / playouts},{"load_ns",load_ns}});
+    }
+}
+
+// The presence sweeper at the lobby's defaults (1 s tick, 10 s timeout)
+// with every user online and heartbeating: one tick of the timer wheel,
+// which only visits the users due that tick, against one full scan of
+// the presence table, which is what the sweeper used to do every tick.
+// A deadline partway through a tick must expire on the next tick, not a
+// revolution later. Exits on failure.
+void check_wheel() {
+    const int64_t tick = 1000, deadline = 10500;
+    TimerWheel wheel(tick, 11, 0);
+    wheel.schedule("player", deadline);
+    vector<TimerWheel::Entry> due;
+    int64_t now = 0;
+    while (due.empty() && now < 100 * tick) wheel.advance(now += 100, due);
+    report({{"bench","sweep_check"},{"deadline",deadline},{"expired_at",now}});
+    if (now < deadline || now > deadline + tick) {
+        cerr << "TimerWheel expired a deadline of " << deadline << " at " << now << "\n";
+        exit(1);
+    }
+}
+
+void bench_sweep() {
+    check_wheel();
+    const int64_t tick = ticks_of(chrono::seconds(1)), timeout = ticks_of(chrono::seconds(10));
+    for (long n : snapshot_users) {
+        PresenceTable table;
+        int64_t now = steady_ticks();
+        TimerWheel wheel(tick, timeout / tick + 1, now);
+        for (long i = 0; i < n; ++i) {
+            string name = "player_" + to_string(i);
+            table.upsert(name, [&](PresenceTable::Ref p){
+                p.online = p.armed = true;
+                p.last_seen = now - (i % 10) * tick;
+                wheel.schedule(name, p.last_seen + timeout);
+            });
+        }
+        const int ticks = 20;
+        vector<TimerWheel::Entry> due;
+        uint64_t visited = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (int t = 0; t < ticks; ++t) {
+            now += tick;
+            due.clear();
+            wheel.advance(now, due);
+            visited += due.size();
+            for (auto &e : due) {
+                // Everyone has sent a heartbeat since, so each entry is
+                // pushed back, as expire_presence() does.
+                table.update(e.first, [&](PresenceTable::Ref p){
+                    p.last_seen = now;
+                    wheel.schedule(e.first, now + timeout);
+                });
+            }
+        }
+        double wheel_ns = seconds_since(t0) * 1e9 / ticks;
+
+        uint64_t stale = 0;
+        t0 = chrono::steady_clock::now();
+        for (int t = 0; t < 3; ++t) {
+            table.scan([&](const PresenceTable::Liveness &l){
+                stale += l.online && l.last_seen < now - timeout;
+                return false;
+            }, [](string_view, PresenceTable::View){});
+        }
+        double scan_ns = seconds_since(t0) * 1e9 / 3;
+        sink_flag = stale & 1;
+        report({{"bench","sweep"},{"users",n},{"wheel_tick_ns",wheel_ns},
+                {"wheel_users_per_tick",(double)visited / ticks},{"scan_ns",scan_ns}});
+    }
+}
+
+// A UDP socket on an ephemeral loopback port, like a player's invite socket.
+int loopback_udp(sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, len) < 0 || getsockname(fd, (sockaddr*)&addr, &len) < 0) {
+        perror("udp");
+        exit(1);
+    }
+    return fd;
+}
+
+// player_b's side of one game: wait for CONNECT_INFO, then answer every
+// MOVE_REQ with a MOVE until GAME_END.
+bool transport_peer(int udp) {
+    pollfd pfd{udp, POLLIN, 0};
+    if (poll(&pfd, 1, 2000) <= 0) return false;
+    char buf[GameChannel::HEADER + GameChannel::MAX_PAYLOAD];
+    sockaddr_in from{};
+    socklen_t fl = sizeof(from);
+    ssize_t n = recvfrom(udp, buf, sizeof(buf), 0, (sockaddr*)&from, &fl);
+    if (n <= 0) return false;
+    string first(buf, n);
+    unique_ptr<GameChannel> chan;
+    if (GameChannel::is_channel(buf, n)) {
+        chan.reset(new GameChannel(udp, from));
+        chan->set_drop(loss);
+        chan->deliver(buf, n, from);
+        if (!chan->recv(first, 2000)) return false;
+    }
+    json info = json::parse(first);
+    int conn = -1;
+    FrameReader rd(-1);
+    if (!chan) {
+        conn = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in a = from;
+        a.sin_port = htons(info.value("port", 0));
+        int one = 1;
+        if (connect(conn, (sockaddr*)&a, sizeof(a)) < 0) { close(conn); return false; }
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        rd.reset(conn);
+    }
+    string frame;
+    bool ok = false;
+    while (chan ? chan->recv(frame, 5000) : rd.read_frame(frame) > 0) {
+        json m = json::parse(frame);
+        string t = m.value("type", "");
+        if (t == "GAME_END") { ok = true; break; }
+        if (t != "MOVE_REQ") continue;
+        json mv = {{"type","MOVE"},{"pos",m.value("last", 0) + 1},{"seq",m.value("seq", 0) + 1}};
+        if (chan) chan->send(mv.dump());
+        else write_frame(conn, encode_frame(mv, WireFormat::Json));
+    }
+    if (chan) chan->linger();
+    else close(conn);
+    return ok;
+}
+
+// The game connection between player_a and player_b: time from sending
+// CONNECT_INFO to the first MOVE, and MOVE_REQ to MOVE round trips, over a
+// TCP connection opened as the players do and over GameChannel on the
+// invite sockets. --loss drops channel datagrams in-process, which leaves
+// TCP untouched; to put both under the same loss run with netem instead,
+// e.g. tc qdisc add dev lo root netem loss 5%.
+void bench_transport() {
+    const int games = 200, moves = 20;
+    for (string transport : {"tcp", "udp"}) {
+        Histogram first_move, rtt;
+        uint64_t resends = 0;
+        int failed = 0;
+        for (int g = 0; g < games; ++g) {
+            sockaddr_in a_addr, b_addr;
+            int ua = loopback_udp(a_addr), ub = loopback_udp(b_addr);
+            bool peer_ok = false;
+            thread peer([&]{ peer_ok = transport_peer(ub); });
+            auto t0 = chrono::steady_clock::now();
+            unique_ptr<GameChannel> chan;
+            int tcps = -1, conn = -1;
+            FrameReader rd(-1);
+            bool ok = true;
+            if (transport == "udp") {
+                chan.reset(new GameChannel(ua, b_addr));
+                chan->set_drop(loss);
+                chan->send(json{{"type","CONNECT_INFO"},{"transport","udp"},{"format","json"}}.dump());
+            } else {
+                tcps = socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in t = a_addr;
+                t.sin_port = 0;
+                socklen_t tl = sizeof(t);
+                bind(tcps, (sockaddr*)&t, tl);
+                listen(tcps, 1);
+                getsockname(tcps, (sockaddr*)&t, &tl);
+                string info = json{{"type","CONNECT_INFO"},{"port",ntohs(t.sin_port)},{"format","json"}}.dump();
+                sendto(ua, info.data(), info.size(), 0, (sockaddr*)&b_addr, sizeof(b_addr));
+                pollfd pfd{tcps, POLLIN, 0};
+                ok = poll(&pfd, 1, 2000) > 0 && (conn = accept(tcps, nullptr, nullptr)) >= 0;
+                int one = 1;
+                if (ok) setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                rd.reset(conn);
+            }
+            auto send_msg = [&](const json &j){
+                return chan ? chan->send(j.dump()) : write_frame(conn, encode_frame(j, WireFormat::Json));
+            };
+            string frame;
+            Game game(15, 5);
+            ok = ok && send_msg(json{{"type","GAME_START"},{"you","O"},{"board",game.to_strings()},{"size",15},{"k",5},{"delta",true}});
+            for (int m = 0; ok && m < moves; ++m) {
+                auto t1 = chrono::steady_clock::now();
+                json req = {{"type","MOVE_REQ"}};
+                add_delta(req, game, 2 * m);
+                ok = send_msg(req) && (chan ? chan->recv(frame, 5000) : rd.read_frame(frame) > 0);
+                auto t2 = chrono::steady_clock::now();
+                if (!ok) break;
+                if (m == 0) first_move.record(chrono::duration_cast<chrono::nanoseconds>(t2 - t0).count());
+                rtt.record(chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count());
+            }
+            if (ok) send_msg(json{{"type","GAME_END"},{"result","DRAW"}});
+            if (chan) {
+                chan->flush(500);
+                resends += chan->resends();
+            }
+            peer.join();
+            if (!ok || !peer_ok) ++failed;
+            if (conn >= 0) close(conn);
+            if (tcps >= 0) close(tcps);
+            close(ua);
+            close(ub);
+        }
+        report({{"bench","transport"},{"transport",transport},{"loss",transport == "udp" ? loss : 0.0},
+                {"games",games},{"failed",failed},
+                {"first_move_p50_us",first_move.percentile(0.50) / 1e3},{"first_move_p99_us",first_move.percentile(0.99) / 1e3},
+                {"move_rtt_p50_us",rtt.percentile(0.50) / 1e3},{"move_rtt_p99_us",rtt.percentile(0.99) / 1e3},
+                {"resends",resends}});
+    }
+}
+
+// The leaderboard index against answering RANK and LEADERBOARD from the
+// user table alone: counting everyone with more xp, and sorting a copy for
+// the top ten.
+void bench_leaderboard() {
+    for (long n : snapshot_users) {
+        UserStore store;
+        Leaderboard board;
+        mt19937_64 rng(11);
+        vector<string> names(n);
+        for (long i = 0; i < n; ++i) {
+            names[i] = "player_" + to_string(i);
+            User u;
+            u.password = "pw";
+            u.experience = rng() % 5000;
+            store.put(names[i], u);
+            board.set(names[i], u.experience);
+        }
+        double set_ns = ns_per_op([&]{
+            const string &name = names[rng() % n];
+            store.update(name, [&](UserRef u){
+                u.experience += 1 + rng() % 10;
+                board.set(name, u.experience);
+            });
+        });
+        double rank_ns = ns_per_op([&]{ sink_flag = board.above(rng() % 5000) & 1; });
+        double top_ns = ns_per_op([&]{ sink_flag = board.range(0, 10).size() & 1; });
+
+        const int reps = 3;
+        uint64_t above = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            int xp = rng() % 5000;
+            store.for_each([&](string_view, UserView u){ above += u.experience > xp; });
+        }
+        double scan_ns = seconds_since(t0) * 1e9 / reps;
+        t0 = chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            vector<pair<int, string>> all;
+            all.reserve(n);
+            store.for_each([&](string_view name, UserView u){ all.emplace_back(-u.experience, string(name)); });
+            partial_sort(all.begin(), all.begin() + min<long>(10, n), all.end());
+            above += all.size();
+        }
+        double sort_ns = seconds_since(t0) * 1e9 / reps;
+        sink_flag = above & 1;
+        report({{"bench","leaderboard"},{"users",n},{"ranked",board.size()},{"set_ns",set_ns},
+                {"rank_ns",rank_ns},{"top10_ns",top_ns},{"scan_rank_ns",scan_ns},{"sort_top10_ns",sort_ns}});
+    }
+}
+
+int main(int argc, char** argv) {
+    map<string, function<void()>> suites = {
+        {"store", bench_store},
+        {"wire", bench_wire},
+        {"frames", bench_frames},
+        {"snapshot", bench_snapshot},
+        {"startup", bench_startup},
+        {"layout", bench_layout},
+        {"game", bench_game},
+        {"sweep", bench_sweep},
+        {"transport", bench_transport},
+        {"leaderboard", bench_leaderboard},
+    };
+    vector<string> picked;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--duration-ms" && i + 1 < argc) duration_ms = atoi(argv[++i]);
+        else if (a == "--max-threads" && i + 1 < argc) max_threads = atoi(argv[++i]);
+        else if (a == "--users" && i + 1 < argc) {
+            big_users.clear();
+            for (char *tok = strtok(argv[++i], ","); tok; tok = strtok(nullptr, ",")) big_users.push_back(atol(tok));
+        }
+        else if (a == "--snapshot-users" && i + 1 < argc) {
+            snapshot_users.clear();
+            for (char *tok = strtok(argv[++i], ","); tok; tok = strtok(nullptr, ",")) snapshot_users.push_back(atol(tok));
+        }
+        else if (a == "--loss" && i + 1 < argc) loss = atof(argv[++i]);
+        else if (suites.count(a)) picked.push_back(a);
+        else {
+            cerr << "Unknown argument " << a << "\n";
+            return 1;
+        }
+    }
+    if (picked.empty()) for (auto &kv : suites) picked.push_back(kv.first);
+    for (auto &name : picked) suites[name]();
+    return 0;
+}
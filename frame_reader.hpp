@@ -0,0 +1,140 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Per-connection receive buffer that splits a TCP byte stream into frames.
+// The socket is read in large chunks, so a typical request costs one
+// recv(); whatever follows the current frame stays buffered for the next
+// call.
+//
+// Frames are '\n'-terminated lines by default. After a connection has
+// negotiated a binary format, set_length_prefixed(true) switches to frames
+// made of a 4-byte big-endian length followed by the payload.
+//
+// Blocking sockets use read_frame(). Non-blocking sockets call fill() when
+// epoll reports readable data and then drain frames with next_frame().
+// io_uring receives into recv_area() and reports the bytes with commit().
+class FrameReader {
+public:
+    static const size_t DEFAULT_MAX_FRAME = 64 * 1024;
+
+    explicit FrameReader(int fd = -1, size_t max_frame = DEFAULT_MAX_FRAME)
+        : fd_(fd), max_frame_(max_frame), buf_(4096) {}
+
+    int fd() const { return fd_; }
+
+    // Rebinds the reader to a new socket and drops any buffered bytes.
+    void reset(int fd) {
+        fd_ = fd;
+        head_ = tail_ = scan_ = 0;
+    }
+
+    void set_length_prefixed(bool on) {
+        length_prefixed_ = on;
+        scan_ = 0;
+    }
+
+    // Reads one frame's payload. Returns 1 on success, 0 when the peer
+    // closed the connection and -1 on socket error or oversized frame.
+    int read_frame(std::string &out) {
+        while (true) {
+            if (next_frame(out)) return 1;
+            if (overflowed()) return -1;
+            ssize_t n = fill();
+            if (n > 0) continue;
+            if (n == 0) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+    }
+
+    // Pulls whatever the socket has into the buffer with a single recv().
+    // Returns the byte count, 0 on EOF, or -1 with errno set (EAGAIN once a
+    // non-blocking socket is drained).
+    ssize_t fill() {
+        size_t len;
+        char *p = recv_area(len);
+        ssize_t n = recv(fd_, p, len, 0);
+        if (n > 0) commit(n);
+        return n;
+    }
+
+    // For callers that receive on their own (io_uring): where the next
+    // bytes should land and how many fit. Call commit(n) once n bytes have
+    // arrived there, and do not pop frames while a receive is in flight.
+    char *recv_area(size_t &len) {
+        if (tail_ == buf_.size()) make_room();
+        len = buf_.size() - tail_;
+        return buf_.data() + tail_;
+    }
+
+    void commit(size_t n) { tail_ += n; }
+
+    // Pops one complete frame out of the buffer if there is one.
+    bool next_frame(std::string &out) {
+        return length_prefixed_ ? next_prefixed(out) : next_line(out);
+    }
+
+    // Pops one '\n'-terminated frame regardless of the current mode.
+    bool next_line(std::string &out) {
+        const char* base = buf_.data() + head_;
+        size_t avail = tail_ - head_;
+        const void* nl = memchr(base + scan_, '\n', avail - scan_);
+        if (!nl) {
+            scan_ = avail;
+            return false;
+        }
+        size_t len = (const char*)nl - base;
+        out.assign(base, len);
+        head_ += len + 1;
+        scan_ = 0;
+        if (head_ == tail_) head_ = tail_ = 0;
+        return true;
+    }
+
+    // True when a partial frame has outgrown the limit; the caller should
+    // drop the connection.
+    bool overflowed() const {
+        if (length_prefixed_ && tail_ - head_ >= 4) return prefix_length() > max_frame_;
+        return tail_ - head_ > max_frame_;
+    }
+
+    size_t buffered() const { return tail_ - head_; }
+
+private:
+    bool next_prefixed(std::string &out) {
+        if (tail_ - head_ < 4) return false;
+        size_t len = prefix_length();
+        if (len > max_frame_ || tail_ - head_ < 4 + len) return false;
+        out.assign(buf_.data() + head_ + 4, len);
+        head_ += 4 + len;
+        if (head_ == tail_) head_ = tail_ = 0;
+        return true;
+    }
+
+    size_t prefix_length() const {
+        const unsigned char* p = (const unsigned char*)buf_.data() + head_;
+        return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    }
+
+    void make_room() {
+        if (head_ > 0) {
+            memmove(buf_.data(), buf_.data() + head_, tail_ - head_);
+            tail_ -= head_;
+            head_ = 0;
+        }
+        if (tail_ == buf_.size()) buf_.resize(buf_.size() * 2);
+    }
+
+    int fd_;
+    size_t max_frame_;
+    std::vector<char> buf_;
+    size_t head_ = 0;  // first unconsumed byte
+    size_t tail_ = 0;  // end of received data
+    size_t scan_ = 0;  // bytes past head_ already known to hold no '\n'
+    bool length_prefixed_ = false;
+};
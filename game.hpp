@@ -0,0 +1,217 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// N x N board where K in a row (across, down or diagonal) wins; 3/3 is
+// tic-tac-toe. Cells are numbered row by row, 0 .. N*N-1.
+//
+// Each side's stones are one bitboard. Every winning line is precomputed
+// as a mask, and each cell keeps the masks of the lines through it, so
+// checking a move is a handful of AND/compare against only those lines.
+
+// Fixed 256-bit set, enough for boards up to 16 x 16.
+struct Bits {
+    static const int WORDS = 4;
+    uint64_t w[WORDS] = {};
+
+    bool test(int i) const { return (w[i >> 6] >> (i & 63)) & 1; }
+    void set(int i) { w[i >> 6] |= uint64_t(1) << (i & 63); }
+    void clear(int i) { w[i >> 6] &= ~(uint64_t(1) << (i & 63)); }
+
+    // True if every bit of m is also set here.
+    bool covers(const Bits &m) const {
+        for (int k = 0; k < WORDS; ++k) {
+            if ((w[k] & m.w[k]) != m.w[k]) return false;
+        }
+        return true;
+    }
+
+    int count_and(const Bits &m) const {
+        int c = 0;
+        for (int k = 0; k < WORDS; ++k) c += __builtin_popcountll(w[k] & m.w[k]);
+        return c;
+    }
+
+    bool intersects(const Bits &m) const {
+        for (int k = 0; k < WORDS; ++k) {
+            if (w[k] & m.w[k]) return true;
+        }
+        return false;
+    }
+};
+
+enum Cell : uint8_t { EMPTY = 0, X = 1, O = 2 };
+
+// Same codes check_tictactoe used to return.
+enum Outcome { ONGOING = 0, X_WINS = 1, O_WINS = 2, DRAW = 3 };
+
+inline const char* cell_name(Cell c) { return c == X ? "X" : c == O ? "O" : ""; }
+
+// Win masks and hashing keys for one board variant. Built once per (N, K)
+// and shared by every game of that variant.
+struct Rules {
+    int n, k;
+    std::vector<Bits> lines;        // every K-long line on the board
+    std::vector<uint32_t> through;  // line indexes through each cell ...
+    std::vector<uint32_t> offset;   // ... cell i owns through[offset[i] .. offset[i+1])
+    std::vector<uint64_t> zobrist;  // 2 keys per cell, one per side
+
+    static const int MAX_N = 16;
+
+    // Returns the shared rules for an N x N, K-in-a-row board, or nullptr
+    // if the variant is not supported.
+    static const Rules* get(int n, int k) {
+        if (n < 1 || n > MAX_N || k < 1 || k > n) return nullptr;
+        static std::mutex m;
+        static std::map<std::pair<int,int>, std::unique_ptr<Rules>> cache;
+        std::lock_guard<std::mutex> g(m);
+        auto &slot = cache[{n, k}];
+        if (!slot) slot.reset(new Rules(n, k));
+        return slot.get();
+    }
+
+private:
+    Rules(int n, int k) : n(n), k(k) {
+        const int dirs[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+        std::vector<std::vector<uint32_t>> per_cell(n * n);
+        for (int r = 0; r < n; ++r) {
+            for (int c = 0; c < n; ++c) {
+                for (auto &d : dirs) {
+                    int er = r + d[0] * (k - 1), ec = c + d[1] * (k - 1);
+                    if (er < 0 || er >= n || ec < 0 || ec >= n) continue;
+                    Bits line;
+                    for (int i = 0; i < k; ++i) {
+                        int cell = (r + d[0] * i) * n + (c + d[1] * i);
+                        line.set(cell);
+                        per_cell[cell].push_back(lines.size());
+                    }
+                    lines.push_back(line);
+                }
+            }
+        }
+        offset.push_back(0);
+        for (auto &v : per_cell) {
+            through.insert(through.end(), v.begin(), v.end());
+            offset.push_back(through.size());
+        }
+        // splitmix64 with a fixed seed, so hashes agree across processes.
+        uint64_t s = 0x9E3779B97F4A7C15ull * (n * 31 + k);
+        zobrist.resize(2 * n * n);
+        for (auto &z : zobrist) {
+            uint64_t x = (s += 0x9E3779B97F4A7C15ull);
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+            z = x ^ (x >> 31);
+        }
+    }
+};
+
+class Game {
+public:
+    explicit Game(int n = 3, int k = 3) : rules_(Rules::get(n, k)) {
+        if (!rules_) rules_ = Rules::get(3, 3);
+    }
+
+    // Rebuilds a game from the wire's "X"/"O"/"" board. False if the board
+    // does not fit the variant or the stone counts are impossible.
+    bool load(const std::vector<std::string> &b) {
+        if ((int)b.size() != cells()) return false;
+        *this = Game(size(), win_length());
+        int xs = 0, os = 0;
+        for (int i = 0; i < cells(); ++i) {
+            if (b[i] == "X") { place(i, X); ++xs; }
+            else if (b[i] == "O") { place(i, O); ++os; }
+            else if (!b[i].empty()) return false;
+        }
+        if (xs - os != 0 && xs - os != 1) return false;
+        to_move_ = xs > os ? O : X;
+        for (auto &line : rules_->lines) {
+            if (stones_[0].covers(line)) outcome_ = X_WINS;
+            else if (stones_[1].covers(line)) outcome_ = O_WINS;
+        }
+        if (outcome_ == ONGOING && moves_ == cells()) outcome_ = DRAW;
+        return true;
+    }
+
+    int size() const { return rules_->n; }
+    int win_length() const { return rules_->k; }
+    int cells() const { return rules_->n * rules_->n; }
+    const Rules &rules() const { return *rules_; }
+
+    Cell at(int i) const { return stones_[0].test(i) ? X : stones_[1].test(i) ? O : EMPTY; }
+    bool legal(int i) const { return outcome_ == ONGOING && i >= 0 && i < cells() && at(i) == EMPTY; }
+    Cell to_move() const { return to_move_; }
+    Outcome outcome() const { return outcome_; }
+    int moves() const { return moves_; }
+    uint64_t hash() const { return hash_; }
+    const Bits &stones(Cell side) const { return stones_[side - 1]; }
+
+    // Plays the side to move at i (which must be legal) and returns the
+    // outcome. Only the lines through i are checked.
+    Outcome play(int i) {
+        Cell side = to_move_;
+        place(i, side);
+        to_move_ = side == X ? O : X;
+        if (wins_through(i, side)) outcome_ = side == X ? X_WINS : O_WINS;
+        else if (moves_ == cells()) outcome_ = DRAW;
+        return outcome_;
+    }
+
+    // Takes back the last move, which was at i.
+    void undo(int i) {
+        Cell side = at(i);
+        stones_[side - 1].clear(i);
+        hash_ ^= rules_->zobrist[2 * i + side - 1];
+        --moves_;
+        to_move_ = side;
+        outcome_ = ONGOING;
+    }
+
+    // True if side has K in a row on some line through cell i.
+    bool wins_through(int i, Cell side) const {
+        const Bits &mine = stones_[side - 1];
+        for (uint32_t j = rules_->offset[i]; j < rules_->offset[i + 1]; ++j) {
+            if (mine.covers(rules_->lines[rules_->through[j]])) return true;
+        }
+        return false;
+    }
+
+    std::vector<std::string> to_strings() const {
+        std::vector<std::string> b(cells());
+        for (int i = 0; i < cells(); ++i) b[i] = cell_name(at(i));
+        return b;
+    }
+
+    void print(std::ostream &os) const {
+        int n = size();
+        os << "\nBoard:\n";
+        for (int r = 0; r < n; ++r) {
+            for (int c = 0; c < n; ++c) {
+                Cell v = at(r * n + c);
+                os << (v == EMPTY ? "." : cell_name(v)) << (c < n - 1 ? " " : "");
+            }
+            if (n > 3) os << "   " << r * n << "-" << r * n + n - 1;
+            os << "\n";
+        }
+    }
+
+private:
+    void place(int i, Cell side) {
+        stones_[side - 1].set(i);
+        hash_ ^= rules_->zobrist[2 * i + side - 1];
+        ++moves_;
+    }
+
+    const Rules *rules_;
+    Bits stones_[2];
+    Cell to_move_ = X;
+    Outcome outcome_ = ONGOING;
+    int moves_ = 0;
+    uint64_t hash_ = 0;
+};
@@ -0,0 +1,242 @@
+#pragma once
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+
+// Reliable, ordered game channel over the UDP socket the players already
+// use for CHECK/INVITE, as an alternative to the TCP game connection:
+//
+//   'G' 'C'  kind (1 byte)  0  seq (4 bytes, big endian)  ack (4 bytes, big endian)  payload
+//
+// Each DATA datagram carries one game message, numbered from 0. Every
+// datagram carries ack, the next seq its sender expects, which acknowledges
+// everything before it. DATA is acked at once; unacked DATA is resent after
+// a timeout computed from the measured RTT as in RFC 6298 (no samples from
+// resent datagrams, doubling on every resend). The receiver delivers in
+// order, holds DATA that arrives early and drops duplicates.
+//
+// One thread owns a channel. It only reads the socket inside send(),
+// recv(), flush() and linger(), and ignores datagrams that are not from
+// the peer or not channel datagrams, so stray CHECKs are simply dropped.
+class GameChannel {
+public:
+    static constexpr uint8_t DATA = 0;
+    static constexpr uint8_t ACK = 1;
+    static constexpr size_t HEADER = 12;
+    static constexpr size_t MAX_PAYLOAD = 8192;
+
+    GameChannel(int fd, const sockaddr_in &peer) : fd_(fd), peer_(peer), heard_(now_us()) {}
+
+    static bool is_channel(const char *buf, size_t len) {
+        return len >= HEADER && buf[0] == 'G' && buf[1] == 'C';
+    }
+
+    // Queues payload and sends it. False if it is too large or the peer is
+    // already gone; acks that came in meanwhile are read by the next recv().
+    bool send(const std::string &payload) {
+        if (dead_ || payload.size() > MAX_PAYLOAD) return false;
+        std::string pkt = header(DATA, next_seq_) + payload;
+        Pending &p = unacked_[next_seq_++];
+        p.pkt = std::move(pkt);
+        transmit(p);
+        return true;
+    }
+
+    // Next message in order. Keeps acking and resending while it waits up
+    // to timeout_ms (-1 for no limit). False on timeout or once the peer
+    // stopped acking.
+    bool recv(std::string &out, int timeout_ms = -1) {
+        int64_t until = timeout_ms < 0 ? -1 : now_us() + (int64_t)timeout_ms * 1000;
+        while (ready_.empty() && !dead_) {
+            if (until >= 0 && now_us() >= until) break;
+            pump(until);
+        }
+        if (ready_.empty()) return false;
+        out = std::move(ready_.front());
+        ready_.pop_front();
+        return true;
+    }
+
+    // Waits until everything sent so far is acked, e.g. after GAME_END.
+    bool flush(int timeout_ms) {
+        int64_t until = now_us() + (int64_t)timeout_ms * 1000;
+        while (!unacked_.empty() && !dead_ && now_us() < until) pump(until);
+        return unacked_.empty();
+    }
+
+    // Stays around for two resend timeouts to ack the peer's resends, for
+    // the side that received the last message and whose ack may have been
+    // lost.
+    void linger() {
+        int64_t until = now_us() + 2 * rto_us_;
+        while (now_us() < until) pump(until);
+    }
+
+    // Handles a datagram the caller already read from the socket, such as
+    // the first one, which told it the peer chose this channel.
+    void deliver(const char *buf, size_t len, const sockaddr_in &from) {
+        if (same_peer(from)) handle(buf, len);
+    }
+
+    // True once the peer left a message unacked for give_up_ms, or said
+    // nothing at all for idle_ms.
+    bool dead() const { return dead_; }
+    void set_give_up_ms(int ms) { give_up_us_ = (int64_t)ms * 1000; }
+    void set_idle_ms(int ms) { idle_us_ = (int64_t)ms * 1000; }
+
+    // Drops this fraction of outgoing datagrams, to measure the channel
+    // under loss where netem is not available.
+    void set_drop(double p) {
+        drop_ = p;
+        rng_.seed(std::random_device{}());
+    }
+
+    uint64_t resends() const { return resends_; }
+    int64_t srtt_us() const { return srtt_us_; }
+    int64_t rto_us() const { return rto_us_; }
+
+private:
+    struct Pending {
+        std::string pkt;
+        // First send, for giving up; last send, for RTT samples and timers.
+        int64_t first_us = 0;
+        int64_t sent_us = 0;
+        int64_t due_us = 0;
+        int tries = 0;
+    };
+
+    static int64_t now_us() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::string header(uint8_t kind, uint32_t seq) const {
+        char h[HEADER] = {'G', 'C', (char)kind, 0};
+        for (int i = 0; i < 4; ++i) {
+            h[4 + i] = (char)(seq >> (24 - 8 * i));
+            h[8 + i] = (char)(expect_ >> (24 - 8 * i));
+        }
+        return std::string(h, HEADER);
+    }
+
+    static uint32_t be32(const char *p) {
+        return (uint32_t)(unsigned char)p[0] << 24 | (uint32_t)(unsigned char)p[1] << 16 |
+               (uint32_t)(unsigned char)p[2] << 8 | (uint32_t)(unsigned char)p[3];
+    }
+
+    bool same_peer(const sockaddr_in &a) const {
+        return a.sin_addr.s_addr == peer_.sin_addr.s_addr && a.sin_port == peer_.sin_port;
+    }
+
+    void raw_send(const std::string &pkt) {
+        if (drop_ > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < drop_) return;
+        sendto(fd_, pkt.data(), pkt.size(), 0, (const sockaddr*)&peer_, sizeof(peer_));
+    }
+
+    void transmit(Pending &p) {
+        // The ack field is refreshed on every resend.
+        for (int i = 0; i < 4; ++i) p.pkt[8 + i] = (char)(expect_ >> (24 - 8 * i));
+        int64_t now = now_us();
+        if (p.tries++) ++resends_;
+        else p.first_us = now;
+        p.sent_us = now;
+        p.due_us = now + (rto_us_ << std::min(p.tries - 1, 6));
+        raw_send(p.pkt);
+    }
+
+    void on_rtt(int64_t r) {
+        if (srtt_us_ < 0) {
+            srtt_us_ = r;
+            rttvar_us_ = r / 2;
+        } else {
+            int64_t err = r > srtt_us_ ? r - srtt_us_ : srtt_us_ - r;
+            rttvar_us_ = (3 * rttvar_us_ + err) / 4;
+            srtt_us_ = (7 * srtt_us_ + r) / 8;
+        }
+        rto_us_ = std::clamp<int64_t>(srtt_us_ + std::max<int64_t>(4 * rttvar_us_, 1000), MIN_RTO_US, MAX_RTO_US);
+    }
+
+    void handle(const char *buf, size_t len) {
+        if (!is_channel(buf, len)) return;
+        heard_ = now_us();
+        uint8_t kind = (uint8_t)buf[2];
+        uint32_t seq = be32(buf + 4), ack = be32(buf + 8);
+        // Everything below ack has arrived. Only datagrams sent once give an
+        // RTT sample.
+        int64_t sample = -1;
+        while (!unacked_.empty() && (int32_t)(unacked_.begin()->first - ack) < 0) {
+            const Pending &p = unacked_.begin()->second;
+            if (p.tries == 1) sample = heard_ - p.sent_us;
+            unacked_.erase(unacked_.begin());
+        }
+        if (sample >= 0) on_rtt(sample);
+        if (kind != DATA) return;
+        int32_t ahead = (int32_t)(seq - expect_);
+        if (ahead == 0) {
+            ready_.emplace_back(buf + HEADER, len - HEADER);
+            ++expect_;
+            for (auto it = early_.find(expect_); it != early_.end(); it = early_.find(expect_)) {
+                ready_.push_back(std::move(it->second));
+                early_.erase(it);
+                ++expect_;
+            }
+        } else if (ahead > 0 && ahead < MAX_EARLY) {
+            early_.emplace(seq, std::string(buf + HEADER, len - HEADER));
+        }
+        // Duplicates are acked again: the first ack may be what got lost.
+        raw_send(header(ACK, 0));
+    }
+
+    // Waits for one datagram until the next resend is due or until (-1 for
+    // no limit), then resends what is due. One poll() and one recvfrom()
+    // per datagram; callers loop.
+    void pump(int64_t until) {
+        int64_t now = now_us();
+        int64_t wake = until < 0 ? now + idle_us_ : until;
+        for (auto &kv : unacked_) wake = std::min(wake, kv.second.due_us);
+        int ms = (int)std::max<int64_t>(0, (wake - now + 999) / 1000);
+        pollfd pfd{fd_, POLLIN, 0};
+        if (poll(&pfd, 1, ms) > 0) {
+            char buf[HEADER + MAX_PAYLOAD];
+            sockaddr_in from{};
+            socklen_t fl = sizeof(from);
+            ssize_t n = recvfrom(fd_, buf, sizeof(buf), MSG_DONTWAIT, (sockaddr*)&from, &fl);
+            if (n >= 0 && same_peer(from)) handle(buf, n);
+        }
+        now = now_us();
+        for (auto &kv : unacked_) {
+            Pending &p = kv.second;
+            if (now - p.first_us > give_up_us_ && now - heard_ > give_up_us_) dead_ = true;
+            else if (now >= p.due_us) transmit(p);
+        }
+        if (now - heard_ > idle_us_) dead_ = true;
+    }
+
+    static constexpr int64_t MIN_RTO_US = 20000;
+    static constexpr int64_t MAX_RTO_US = 2000000;
+    static constexpr int32_t MAX_EARLY = 256;
+
+    int fd_;
+    sockaddr_in peer_;
+    uint32_t next_seq_ = 0;
+    uint32_t expect_ = 0;
+    std::map<uint32_t, Pending> unacked_;
+    std::map<uint32_t, std::string> early_;
+    std::deque<std::string> ready_;
+    int64_t heard_;
+    int64_t srtt_us_ = -1, rttvar_us_ = 0;
+    int64_t rto_us_ = 200000;
+    int64_t give_up_us_ = 10000000;
+    int64_t idle_us_ = 300000000;
+    bool dead_ = false;
+    uint64_t resends_ = 0;
+    double drop_ = 0;
+    std::mt19937_64 rng_;
+};
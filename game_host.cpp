@@ -0,0 +1,1046 @@
+// Dedicated game host: runs many matches at once on a few event-loop
+// threads, with the host as referee.
+//
+// Both players connect to the host and send one JSON line
+//   {"type":"JOIN","match":ID,"role":"X"|"O","name":NAME,
+//    "size":N,"k":K,"format":"json"|"cbor"|"msgpack","delta":true}
+// where ID is agreed out of band (player_a puts it in CONNECT_INFO) and X's
+// size/k pick the variant. Once both have joined, the match runs on the
+// usual GAME_START / MOVE_REQ / MOVE / GAME_END messages, framed in the
+// format each player asked for, with move deltas for players that asked
+// for them (see game_sync.hpp). Illegal moves are asked for again; a
+// player who disconnects loses.
+//
+// Anyone can watch a match that exists with
+//   {"type":"JOIN","match":ID,"role":"S","format":...}
+// and then gets a SPECTATE frame with the whole board after every move:
+//   {"type":"SPECTATE","match":ID,"x":NAME,"o":NAME,"size":N,"k":K,
+//    "started":B,"seq":MOVES,"last":CELL,"board":[...]}
+// The last one also has "result" ("X", "O", "DRAW" or "CANCELLED") and
+// maybe "reason", and the host closes the connection after it. Watching
+// a match that does not exist gets one frame with "error":"NO_MATCH".
+// Spectators that read too slowly skip boards; one that accepts nothing
+// for SPECTATOR_STALL_MS is dropped. Neither ever delays the players.
+//
+//   ./game_host [--port N] [--workers N]
+//   ./game_host --bench [--matches N] [--duration-ms N] [--size N --win K] [--delta]
+//                       [--spectators N [--pace-ms N]]
+//
+// --bench starts the host in-process, drives --matches concurrent bot
+// matches against it over loopback and prints matches per second, per
+// host CPU-second and bytes the host sent per move as JSON lines; --delta
+// makes the bots ask for move deltas. --spectators adds a 15x15 match
+// whose bots move every --pace-ms (default 20) with N spectators watching
+// it, and reports that match's move latency and the fan-out counters.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "json.hpp"
+#include "frame_reader.hpp"
+#include "histogram.hpp"
+#include "wire.hpp"
+#include "game.hpp"
+#include "game_sync.hpp"
+
+using json = nlohmann::json;
+using namespace std;
+
+int HOST_PORT = 21000;
+// A match whose second player has not joined by then is dropped.
+const int JOIN_TIMEOUT_MS = 30000;
+// A spectator whose socket has taken nothing for this long is dropped.
+const int SPECTATOR_STALL_MS = 5000;
+// Time spent writing to spectators per event-loop pass, so a large
+// audience is served between player messages rather than ahead of them.
+const int64_t FANOUT_SLICE_US = 200;
+
+atomic<uint64_t> matches_finished{0};
+atomic<uint64_t> moves_played{0};
+atomic<uint64_t> bytes_sent{0};
+atomic<uint64_t> spectator_frames{0};
+atomic<uint64_t> frames_coalesced{0};
+atomic<uint64_t> spectators_dropped{0};
+
+int64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int make_listener() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) { perror("socket"); return -1; }
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        close(sock);
+        return -1;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(HOST_PORT);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(sock); return -1; }
+    if (listen(sock, 1024) < 0) { perror("listen"); close(sock); return -1; }
+    return sock;
+}
+
+// One SPECTATE frame, encoded once in each format some spectator asked
+// for and shared by every spectator socket it goes to.
+struct Snapshot {
+    string frame[3];  // indexed by WireFormat; empty if nobody asked
+    bool final = false;
+};
+
+const int SPECTATOR = 2;
+
+struct Conn {
+    int fd;
+    FrameReader in;
+    string out;
+    size_t out_off = 0;
+    bool want_write = false;
+    WireFormat format = WireFormat::Json;
+    string match;  // empty until JOIN
+    int side = -1;  // 0 = X, 1 = O, SPECTATOR
+    bool delta = false;
+    // Spectators only: the frame being written (out_off into it) and the
+    // newest one after it. A newer frame replaces the waiting one, so a
+    // slow spectator skips boards instead of queueing them.
+    shared_ptr<const Snapshot> sending, waiting;
+    int64_t stalled_since = 0;
+    bool queued = false;   // in the worker's fan-out queue
+    bool closing = false;  // close once the final frame is out
+};
+
+class HostWorker;
+
+struct Match {
+    Game game;
+    int fd[2] = {-1, -1};
+    string name[2];
+    int64_t created = 0;
+    bool started = false;
+    int last = -1;
+    // Workers with spectators of this match, and the formats they want.
+    unordered_map<HostWorker*, unsigned> watchers;
+};
+
+// One event loop with its own SO_REUSEPORT listener. A match lives on the
+// worker its ID hashes to; a JOIN that arrives elsewhere hands the
+// connection over through the owner's mailbox.
+class HostWorker {
+public:
+    explicit HostWorker(int id) : id_(id) {}
+
+    static vector<unique_ptr<HostWorker>> &all() {
+        static vector<unique_ptr<HostWorker>> workers;
+        return workers;
+    }
+
+    // Takes over a connection whose JOIN another worker has read. Safe to
+    // call from any thread, as are the two below.
+    void adopt(int fd, const json &join) {
+        Mail m;
+        m.kind = Mail::ADOPT;
+        m.fd = fd;
+        m.join = join;
+        post(move(m));
+    }
+
+    // On the match's owner: from now on send snapshots of match in these
+    // formats to from, starting with the current one.
+    void watch(const string &match, HostWorker *from, unsigned formats) {
+        Mail m;
+        m.kind = Mail::WATCH;
+        m.match = match;
+        m.from = from;
+        m.formats = formats;
+        post(move(m));
+    }
+
+    // On a worker with spectators: a new snapshot of match.
+    void publish(const string &match, shared_ptr<const Snapshot> snap) {
+        Mail m;
+        m.kind = Mail::PUBLISH;
+        m.match = match;
+        m.snap = move(snap);
+        post(move(m));
+    }
+
+    double cpu_seconds() const { return cpu_ns_.load() / 1e9; }
+
+    void run() {
+        listen_fd_ = make_listener();
+        if (listen_fd_ < 0) {
+            cerr << "[ERROR] Host worker " << id_ << " has no listener\n";
+            return;
+        }
+        ep_ = epoll_create1(EPOLL_CLOEXEC);
+        if (ep_ < 0) { perror("epoll_create1"); return; }
+        watch(listen_fd_, EPOLLIN);
+        watch(wake_fd_, EPOLLIN);
+
+        vector<epoll_event> evs(256);
+        int64_t next_sweep = now_ms() + 1000;
+        while (true) {
+            int n = epoll_wait(ep_, evs.data(), (int)evs.size(), fanout_.empty() ? 1000 : 0);
+            if (n < 0 && errno != EINTR) { perror("epoll_wait"); return; }
+            for (int i = 0; i < n; ++i) {
+                int fd = evs[i].data.fd;
+                if (fd == listen_fd_) { accept_all(); continue; }
+                if (fd == wake_fd_) { take_mail(); continue; }
+                auto it = conns_.find(fd);
+                if (it == conns_.end()) continue;
+                bool ok = true;
+                if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = on_readable(it->second);
+                if (ok && (evs[i].events & EPOLLOUT)) {
+                    auto ci = conns_.find(fd);
+                    if (ci != conns_.end()) ok = ci->second.side == SPECTATOR ? flush_spectator(ci->second) : flush(ci->second);
+                }
+                if (!ok) drop(fd);
+            }
+            fan_out();
+            if (now_ms() >= next_sweep) {
+                sweep();
+                next_sweep = now_ms() + 1000;
+            }
+            timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            cpu_ns_ = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+    }
+
+private:
+    struct Mail {
+        enum Kind { ADOPT, WATCH, PUBLISH } kind;
+        int fd = -1;
+        json join;
+        string match;
+        HostWorker *from = nullptr;
+        unsigned formats = 0;
+        shared_ptr<const Snapshot> snap;
+    };
+
+    void post(Mail &&m) {
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail_.push_back(move(m));
+        }
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+    }
+
+    void watch(int fd, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(ep_, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void accept_all() {
+        while (true) {
+            int c = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (c < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+                return;
+            }
+            int one = 1;
+            setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            add_conn(c);
+        }
+    }
+
+    Conn &add_conn(int fd) {
+        watch(fd, EPOLLIN | EPOLLRDHUP);
+        Conn &c = conns_[fd];
+        c.fd = fd;
+        c.in.reset(fd);
+        return c;
+    }
+
+    void take_mail() {
+        uint64_t n;
+        if (read(wake_fd_, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+        vector<Mail> mail;
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail.swap(mail_);
+        }
+        for (auto &m : mail) {
+            if (m.kind == Mail::WATCH) {
+                on_watch(m.match, m.from, m.formats);
+            } else if (m.kind == Mail::PUBLISH) {
+                on_publish(m.match, m.snap);
+            } else {
+                add_conn(m.fd);
+                if (!join(m.fd, m.join)) drop(m.fd);
+            }
+        }
+    }
+
+    bool on_readable(Conn &c) {
+        int fd = c.fd;
+        while (true) {
+            ssize_t n = c.in.fill();
+            if (n == 0) return false;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                return false;
+            }
+            string frame;
+            while (c.in.next_frame(frame)) {
+                json msg;
+                try { msg = decode_payload(frame, c.format); } catch (...) { continue; }
+                if (!msg.is_object()) continue;
+                if (c.side == SPECTATOR) continue;
+                if (c.match.empty()) {
+                    if (msg.value("type", "") != "JOIN") continue;
+                    // Spectators stay on the worker that accepted them, so
+                    // a large audience is spread over all workers.
+                    if (msg.value("role", "") == "S") {
+                        // Checked as after MOVE, in case sending the first
+                        // frame ever drops the spectator.
+                        if (!spectate(c, msg)) return false;
+                        if (conns_.find(fd) == conns_.end()) return true;
+                        continue;
+                    }
+                    HostWorker *owner = owner_of(msg.value("match", ""));
+                    if (owner != this) {
+                        // Hand over; the client sends nothing more before
+                        // GAME_START, so no buffered bytes are lost.
+                        epoll_ctl(ep_, EPOLL_CTL_DEL, fd, nullptr);
+                        conns_.erase(fd);
+                        owner->adopt(fd, msg);
+                        return true;
+                    }
+                    // Starting the match can drop this connection.
+                    if (!join(fd, msg)) return false;
+                    if (conns_.find(fd) == conns_.end()) return true;
+                    continue;
+                }
+                string type = msg.value("type", "");
+                if (type == "MOVE") on_move(c, msg.value("pos", -1), msg.value("seq", -1));
+                else if (type == "RESYNC") on_resync(c);
+                auto it = conns_.find(fd);
+                if (it == conns_.end()) return true;
+            }
+            if (c.in.overflowed()) return false;
+        }
+    }
+
+    static HostWorker *owner_of(const string &match) {
+        auto &w = all();
+        return w[hash<string>{}(match) % w.size()].get();
+    }
+
+    bool join(int fd, const json &msg) {
+        Conn &c = conns_.at(fd);
+        string id = msg.value("match", "");
+        string role = msg.value("role", "");
+        if (id.empty() || (role != "X" && role != "O")) return false;
+        int side = role == "X" ? 0 : 1;
+        auto [it, added] = matches_.try_emplace(id);
+        Match &m = it->second;
+        if (added) m.created = now_ms();
+        if (m.fd[side] >= 0 || m.started) return false;
+        if (side == 0) m.game = Game(msg.value("size", 3), msg.value("k", 3));
+        m.fd[side] = fd;
+        m.name[side] = msg.value("name", role);
+        c.match = id;
+        c.side = side;
+        wire_from_name(msg.value("format", "json"), c.format);
+        c.delta = msg.value("delta", false);
+        c.in.set_length_prefixed(c.format != WireFormat::Json);
+        if (m.fd[0] >= 0 && m.fd[1] >= 0) start(id);
+        return true;
+    }
+
+    bool spectate(Conn &c, const json &msg) {
+        string id = msg.value("match", "");
+        if (id.empty()) return false;
+        wire_from_name(msg.value("format", "json"), c.format);
+        c.in.set_length_prefixed(c.format != WireFormat::Json);
+        c.match = id;
+        c.side = SPECTATOR;
+        Watch &w = watching_[id];
+        w.fds.insert(c.fd);
+        if (w.latest) enqueue(c, w.latest);
+        unsigned bit = 1u << (int)c.format;
+        if (!(w.formats & bit)) {
+            w.formats |= bit;
+            owner_of(id)->watch(id, this, w.formats);
+        }
+        return true;
+    }
+
+    // The SPECTATE frame for m; result is set for the last one.
+    static json spectate_frame(const string &id, const Match &m, const char *result, const string &reason) {
+        json j = {{"type","SPECTATE"},{"match",id},{"x",m.name[0]},{"o",m.name[1]},
+                  {"size",m.game.size()},{"k",m.game.win_length()},{"started",m.started},
+                  {"seq",m.game.moves()},{"last",m.last},{"board",m.game.to_strings()}};
+        if (result) j["result"] = result;
+        if (!reason.empty()) j["reason"] = reason;
+        return j;
+    }
+
+    static shared_ptr<const Snapshot> encode_snapshot(const json &j, unsigned formats, bool final) {
+        auto snap = make_shared<Snapshot>();
+        for (int f = 0; f < 3; ++f) {
+            if (formats >> f & 1) snap->frame[f] = encode_frame(j, (WireFormat)f);
+        }
+        snap->final = final;
+        return snap;
+    }
+
+    void on_watch(const string &id, HostWorker *from, unsigned formats) {
+        auto it = matches_.find(id);
+        if (it == matches_.end()) {
+            from->publish(id, encode_snapshot({{"type","SPECTATE"},{"match",id},{"error","NO_MATCH"}}, formats, true));
+            return;
+        }
+        it->second.watchers[from] |= formats;
+        from->publish(id, encode_snapshot(spectate_frame(id, it->second, nullptr, ""), formats, false));
+    }
+
+    // Encodes the board once and hands it to every worker with spectators.
+    // Called after the players have been sent their part.
+    void publish_match(const string &id, const Match &m, const char *result = nullptr, const string &reason = "") {
+        if (m.watchers.empty()) return;
+        unsigned formats = 0;
+        for (auto &w : m.watchers) formats |= w.second;
+        auto snap = encode_snapshot(spectate_frame(id, m, result, reason), formats, result != nullptr);
+        for (auto &w : m.watchers) w.first->publish(id, snap);
+    }
+
+    void on_publish(const string &id, const shared_ptr<const Snapshot> &snap) {
+        auto it = watching_.find(id);
+        if (it == watching_.end()) return;
+        Watch &w = it->second;
+        w.latest = snap;
+        for (int fd : w.fds) {
+            auto ci = conns_.find(fd);
+            if (ci == conns_.end()) continue;
+            enqueue(ci->second, snap);
+            if (snap->final) {
+                ci->second.closing = true;
+                ci->second.match.clear();
+            }
+        }
+        if (snap->final) watching_.erase(it);
+    }
+
+    void enqueue(Conn &c, const shared_ptr<const Snapshot> &snap) {
+        if (c.waiting) frames_coalesced.fetch_add(1, memory_order_relaxed);
+        c.waiting = snap;
+        if (!c.queued) {
+            c.queued = true;
+            fanout_.push_back(c.fd);
+        }
+    }
+
+    // Writes to queued spectators for about FANOUT_SLICE_US.
+    void fan_out() {
+        auto until = chrono::steady_clock::now() + chrono::microseconds(FANOUT_SLICE_US);
+        for (size_t i = 0; !fanout_.empty(); ++i) {
+            if (i % 16 == 15 && chrono::steady_clock::now() >= until) break;
+            int fd = fanout_.front();
+            fanout_.pop_front();
+            // The fd may have been closed and reused since it was queued.
+            auto ci = conns_.find(fd);
+            if (ci == conns_.end() || ci->second.side != SPECTATOR) continue;
+            ci->second.queued = false;
+            if (!flush_spectator(ci->second)) drop(fd);
+        }
+    }
+
+    // Writes straight from the shared frames; false once the spectator is
+    // to be closed.
+    bool flush_spectator(Conn &c) {
+        while (c.sending || c.waiting) {
+            if (!c.sending) {
+                c.sending = move(c.waiting);
+                c.out_off = 0;
+            }
+            const string &f = c.sending->frame[(int)c.format];
+            while (c.out_off < f.size()) {
+                ssize_t n = send(c.fd, f.data() + c.out_off, f.size() - c.out_off, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                    if (!c.stalled_since) c.stalled_since = now_ms();
+                    want_write(c, true);
+                    return true;
+                }
+                c.out_off += n;
+                c.stalled_since = 0;
+            }
+            if (!f.empty()) spectator_frames.fetch_add(1, memory_order_relaxed);
+            c.sending.reset();
+            c.out_off = 0;
+        }
+        want_write(c, false);
+        return !c.closing;
+    }
+
+    void send_to(int fd, const json &j) {
+        auto it = conns_.find(fd);
+        if (it == conns_.end()) return;
+        Conn &c = it->second;
+        string out = encode_frame(j, c.format);
+        bytes_sent.fetch_add(out.size(), memory_order_relaxed);
+        c.out += out;
+        if (!flush(c)) drop(fd);
+    }
+
+    // Adds the board to a MOVE_REQ or GAME_END for c: the move at last as a
+    // delta if c asked for those, the whole board otherwise.
+    static void add_board(json &msg, const Conn &c, const Game &g, int last) {
+        if (c.delta) add_delta(msg, g, last);
+        else msg["board"] = g.to_strings();
+    }
+
+    void send_move_req(int fd, const Game &g, int last) {
+        auto it = conns_.find(fd);
+        if (it == conns_.end()) return;
+        json req = {{"type","MOVE_REQ"}};
+        add_board(req, it->second, g, last);
+        send_to(fd, req);
+    }
+
+    // A failed send drops that player, which finishes and erases the
+    // match, so it is looked up again after every send.
+    void start(const string &id) {
+        matches_.at(id).started = true;
+        for (int s = 0; s < 2; ++s) {
+            auto it = matches_.find(id);
+            if (it == matches_.end()) return;
+            Match &m = it->second;
+            json start = {{"type","GAME_START"},{"you", s == 0 ? "X" : "O"},{"opponent",m.name[1 - s]},
+                          {"board",m.game.to_strings()},{"first_turn","X"},{"size",m.game.size()},
+                          {"k",m.game.win_length()}};
+            auto ci = conns_.find(m.fd[s]);
+            if (ci != conns_.end() && ci->second.delta) start["delta"] = true;
+            send_to(m.fd[s], start);
+        }
+        auto it = matches_.find(id);
+        if (it == matches_.end()) return;
+        send_move_req(it->second.fd[0], it->second.game, -1);
+        it = matches_.find(id);
+        if (it != matches_.end()) publish_match(id, it->second);
+    }
+
+    void on_move(Conn &c, int pos, int seq) {
+        auto it = matches_.find(c.match);
+        if (it == matches_.end()) return;
+        Match &m = it->second;
+        if (!m.started || m.game.to_move() != (c.side == 0 ? X : O)) return;
+        // A MOVE for a turn that is already over is a late duplicate.
+        if (seq >= 0 && seq != m.game.moves() + 1) return;
+        if (!m.game.legal(pos)) {
+            send_move_req(c.fd, m.game, -1);
+            return;
+        }
+        Outcome o = m.game.play(pos);
+        m.last = pos;
+        moves_played.fetch_add(1, memory_order_relaxed);
+        if (o == ONGOING) {
+            string id = it->first;
+            send_move_req(m.fd[1 - c.side], m.game, pos);
+            // Same as in start(): the send may have ended the match.
+            it = matches_.find(id);
+            if (it != matches_.end()) publish_match(id, it->second);
+            return;
+        }
+        int winner = o == X_WINS ? 0 : o == O_WINS ? 1 : -1;
+        finish(it, winner, "", pos);
+    }
+
+    // The player's copy of the board went wrong: ask again with all of it.
+    void on_resync(Conn &c) {
+        auto it = matches_.find(c.match);
+        if (it == matches_.end()) return;
+        Match &m = it->second;
+        if (!m.started || m.game.to_move() != (c.side == 0 ? X : O)) return;
+        json req = {{"type","MOVE_REQ"},{"board",m.game.to_strings()}};
+        add_delta(req, m.game, -1);
+        send_to(c.fd, req);
+    }
+
+    // Sends GAME_END to whoever is still connected and forgets the match.
+    // winner is 0 (X), 1 (O) or -1 for a draw; last is the final move.
+    void finish(unordered_map<string, Match>::iterator it, int winner, const string &reason, int last = -1) {
+        Match &m = it->second;
+        int fds[2] = {m.fd[0], m.fd[1]};
+        for (int s = 0; s < 2; ++s) {
+            auto ci = conns_.find(fds[s]);
+            if (ci == conns_.end()) continue;
+            ci->second.match.clear();
+            if (!m.started) continue;
+            json end = {{"type","GAME_END"},{"result", winner < 0 ? "DRAW" : winner == s ? "WIN" : "LOSE"}};
+            add_board(end, ci->second, m.game, last);
+            if (!reason.empty()) end["reason"] = reason;
+            send_to(fds[s], end);
+        }
+        if (m.started) matches_finished.fetch_add(1, memory_order_relaxed);
+        const char *result = !m.started ? "CANCELLED" : winner < 0 ? "DRAW" : winner == 0 ? "X" : "O";
+        publish_match(it->first, m, result, reason);
+        matches_.erase(it);
+    }
+
+    void sweep() {
+        int64_t stalled = now_ms() - SPECTATOR_STALL_MS;
+        vector<int> slow;
+        for (auto &kv : conns_) {
+            const Conn &c = kv.second;
+            if (c.side == SPECTATOR && c.stalled_since && c.stalled_since < stalled) slow.push_back(kv.first);
+        }
+        for (int fd : slow) {
+            spectators_dropped.fetch_add(1, memory_order_relaxed);
+            drop(fd);
+        }
+        int64_t cutoff = now_ms() - JOIN_TIMEOUT_MS;
+        vector<string> stale;
+        for (auto &kv : matches_) {
+            if (!kv.second.started && kv.second.created < cutoff) stale.push_back(kv.first);
+        }
+        for (auto &id : stale) {
+            Match &m = matches_[id];
+            int fds[2] = {m.fd[0], m.fd[1]};
+            finish(matches_.find(id), -1, "");
+            for (int fd : fds) if (fd >= 0) drop(fd);
+        }
+    }
+
+    bool flush(Conn &c) {
+        while (c.out_off < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c.out_off += n;
+        }
+        if (c.out_off == c.out.size()) {
+            c.out.clear();
+            c.out_off = 0;
+        }
+        want_write(c, !c.out.empty());
+        return true;
+    }
+
+    void want_write(Conn &c, bool need) {
+        if (need == c.want_write) return;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | (need ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = c.fd;
+        epoll_ctl(ep_, EPOLL_CTL_MOD, c.fd, &ev);
+        c.want_write = need;
+    }
+
+    // Closes a connection; if it was in a running match the opponent wins.
+    void drop(int fd) {
+        auto ci = conns_.find(fd);
+        if (ci == conns_.end()) return;
+        string match = ci->second.match;
+        int side = ci->second.side;
+        epoll_ctl(ep_, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns_.erase(ci);
+        if (match.empty()) return;
+        if (side == SPECTATOR) {
+            // The owner keeps publishing to this worker until the match
+            // ends; with nobody left those frames are simply dropped.
+            auto wi = watching_.find(match);
+            if (wi != watching_.end()) wi->second.fds.erase(fd);
+            return;
+        }
+        auto it = matches_.find(match);
+        if (it == matches_.end()) return;
+        it->second.fd[side] = -1;
+        if (it->second.started) finish(it, 1 - side, "OPPONENT_LEFT");
+    }
+
+    // This worker's spectators of one match, wherever the match runs.
+    struct Watch {
+        unordered_set<int> fds;
+        unsigned formats = 0;  // asked of the owner so far
+        shared_ptr<const Snapshot> latest;
+    };
+
+    int id_;
+    int listen_fd_ = -1;
+    int ep_ = -1;
+    int wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mutex mail_m_;
+    vector<Mail> mail_;
+    unordered_map<int, Conn> conns_;
+    unordered_map<string, Match> matches_;
+    unordered_map<string, Watch> watching_;
+    deque<int> fanout_;
+    atomic<uint64_t> cpu_ns_{0};
+};
+
+// Bot clients for --bench: each slot plays one match at a time with random
+// legal moves and starts a new one as soon as both sides have seen
+// GAME_END.
+class BenchDriver {
+public:
+    BenchDriver(int id, int slots, int size, int k, bool delta)
+        : id_(id), size_(size), k_(k), delta_(delta), rng_(id + 1) {
+        slots_.resize(slots);
+    }
+
+    void run(const atomic<bool> &stop) {
+        ep_ = epoll_create1(EPOLL_CLOEXEC);
+        for (size_t i = 0; i < slots_.size(); ++i) begin(i);
+        vector<epoll_event> evs(256);
+        while (!stop) {
+            int n = epoll_wait(ep_, evs.data(), (int)evs.size(), 100);
+            for (int i = 0; i < n; ++i) {
+                uint64_t tag = evs[i].data.u64;
+                size_t slot = tag >> 1;
+                int side = tag & 1;
+                if (!on_readable(slots_[slot].bot[side])) end_bot(slot, side);
+                if (slots_[slot].done == 2) begin(slot);
+            }
+        }
+        for (auto &s : slots_) {
+            for (auto &b : s.bot) if (b.fd >= 0) close(b.fd);
+        }
+        close(ep_);
+    }
+
+private:
+    struct Bot {
+        int fd = -1;
+        FrameReader in;
+        Game game;
+    };
+    struct Slot {
+        Bot bot[2];
+        int done = 0;
+        uint64_t gen = 0;
+    };
+
+    int connect_host() {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(HOST_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
+        return s;
+    }
+
+    void begin(size_t slot) {
+        Slot &s = slots_[slot];
+        s.done = 0;
+        string id = "bench" + to_string(id_) + "_" + to_string(slot) + "_" + to_string(s.gen++);
+        for (int side = 0; side < 2; ++side) {
+            Bot &b = s.bot[side];
+            if (b.fd >= 0) close(b.fd);
+            b.fd = connect_host();
+            if (b.fd < 0) { perror("[ERROR] connect"); s.done = 2; return; }
+            b.in.reset(b.fd);
+            json join = {{"type","JOIN"},{"match",id},{"role", side == 0 ? "X" : "O"},{"size",size_},{"k",k_},
+                         {"delta",delta_}};
+            string line = join.dump() + "\n";
+            if (send(b.fd, line.data(), line.size(), MSG_NOSIGNAL) < 0) perror("[ERROR] send");
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = (slot << 1) | side;
+            epoll_ctl(ep_, EPOLL_CTL_ADD, b.fd, &ev);
+        }
+    }
+
+    void end_bot(size_t slot, int side) {
+        Bot &b = slots_[slot].bot[side];
+        if (b.fd < 0) return;
+        epoll_ctl(ep_, EPOLL_CTL_DEL, b.fd, nullptr);
+        close(b.fd);
+        b.fd = -1;
+        ++slots_[slot].done;
+    }
+
+    bool on_readable(Bot &b) {
+        ssize_t n = b.in.fill();
+        if (n <= 0) return n < 0 && (errno == EAGAIN || errno == EINTR);
+        string line;
+        while (b.in.next_frame(line)) {
+            json m = json::parse(line, nullptr, false);
+            string t = m.is_object() ? m.value("type", "") : "";
+            if (t == "GAME_END") return false;
+            if (t == "GAME_START") b.game = Game(size_, k_);
+            if (t != "MOVE_REQ") continue;
+            if (!sync_game(b.game, m)) {
+                if (!write_frame(b.fd, "{\"type\":\"RESYNC\"}\n")) return false;
+                continue;
+            }
+            int pos;
+            do pos = (int)(rng_() % b.game.cells()); while (!b.game.legal(pos));
+            b.game.play(pos);
+            string out = json{{"type","MOVE"},{"pos",pos},{"seq",b.game.moves()}}.dump() + "\n";
+            if (!write_frame(b.fd, out)) return false;
+        }
+        return true;
+    }
+
+    int id_;
+    int size_, k_;
+    bool delta_;
+    mt19937_64 rng_;
+    int ep_ = -1;
+    vector<Slot> slots_;
+};
+
+// Bench for spectators: one 15x15 match, "featured", whose bots move every
+// pace_ms, watched by n spectator connections. The bots time each MOVE
+// until the opponent's MOVE_REQ arrives, which is the latency a player
+// sees; every 100th spectator never reads, to exercise coalescing and the
+// stall drop.
+class SpectatorBench {
+public:
+    SpectatorBench(int n, int pace_ms) : n_(n), pace_ms_(pace_ms) {}
+
+    void run(const atomic<bool> &stop) {
+        thread audience([&]{ watch(stop); });
+        play(stop);
+        audience.join();
+    }
+
+    json report() const {
+        return {{"bench","game_host_spectators"},{"spectators",n_},{"joined",joined_.load()},{"pace_ms",pace_ms_},
+                {"featured_moves",latency_.count()},
+                {"move_latency_p50_us",latency_.percentile(0.50) / 1e3},{"move_latency_p99_us",latency_.percentile(0.99) / 1e3},
+                {"move_latency_max_us",latency_.max() / 1e3},{"frames_received",frames_received_.load()}};
+    }
+
+private:
+    static int connect_host(bool nonblock) {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(HOST_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
+        if (nonblock) fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        return s;
+    }
+
+    void play(const atomic<bool> &stop) {
+        int fd[2];
+        FrameReader in[2];
+        Game game[2] = {Game(15, 5), Game(15, 5)};
+        mt19937_64 rng(7);
+        for (int side = 0; side < 2; ++side) {
+            fd[side] = connect_host(true);
+            if (fd[side] < 0) { perror("[ERROR] connect"); return; }
+            in[side].reset(fd[side]);
+            json join = {{"type","JOIN"},{"match","featured"},{"role", side == 0 ? "X" : "O"},{"size",15},{"k",5},
+                         {"delta",true}};
+            write_frame(fd[side], join.dump() + "\n");
+        }
+        while (!ready_ && !stop) this_thread::sleep_for(chrono::milliseconds(10));
+        chrono::steady_clock::time_point sent;
+        bool timing = false, over = false;
+        while (!stop && !over) {
+            pollfd pfd[2] = {{fd[0], POLLIN, 0}, {fd[1], POLLIN, 0}};
+            if (poll(pfd, 2, 100) <= 0) continue;
+            for (int side = 0; side < 2 && !over; ++side) {
+                if (!(pfd[side].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                ssize_t n = in[side].fill();
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) { over = true; break; }
+                string frame;
+                while (in[side].next_frame(frame)) {
+                    json m = json::parse(frame, nullptr, false);
+                    string t = m.is_object() ? m.value("type", "") : "";
+                    if (t == "GAME_END") { over = true; break; }
+                    if (t != "MOVE_REQ") continue;
+                    if (timing) latency_.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sent).count());
+                    if (!sync_game(game[side], m)) {
+                        write_frame(fd[side], "{\"type\":\"RESYNC\"}\n");
+                        timing = false;
+                        continue;
+                    }
+                    this_thread::sleep_for(chrono::milliseconds(pace_ms_));
+                    // Avoid winning moves, so the match lasts as long as
+                    // the board does.
+                    int pos = -1;
+                    for (int tries = 0; tries < 64; ++tries) {
+                        int p = (int)(rng() % game[side].cells());
+                        if (!game[side].legal(p)) continue;
+                        pos = p;
+                        Game g = game[side];
+                        if (g.play(p) == ONGOING) break;
+                    }
+                    if (pos < 0) for (pos = 0; !game[side].legal(pos); ++pos) {}
+                    game[side].play(pos);
+                    sent = chrono::steady_clock::now();
+                    timing = true;
+                    write_frame(fd[side], json{{"type","MOVE"},{"pos",pos},{"seq",game[side].moves()}}.dump() + "\n");
+                }
+            }
+        }
+        close(fd[0]);
+        close(fd[1]);
+    }
+
+    void watch(const atomic<bool> &stop) {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        vector<int> fds;
+        string join = json{{"type","JOIN"},{"match","featured"},{"role","S"}}.dump() + "\n";
+        // The bots' JOINs must be in before anyone asks to watch.
+        this_thread::sleep_for(chrono::milliseconds(100));
+        for (int i = 0; i < n_ && !stop; ++i) {
+            int s = connect_host(true);
+            if (s < 0) break;
+            write_frame(s, join);
+            fds.push_back(s);
+            ++joined_;
+            if (i % 100 == 99) continue;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = s;
+            epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+        }
+        ready_ = true;
+        vector<epoll_event> evs(1024);
+        vector<char> buf(64 * 1024);
+        while (!stop) {
+            int n = epoll_wait(ep, evs.data(), (int)evs.size(), 100);
+            for (int i = 0; i < n; ++i) {
+                int s = evs[i].data.fd;
+                ssize_t got;
+                while ((got = recv(s, buf.data(), buf.size(), 0)) > 0) {
+                    frames_received_ += count(buf.begin(), buf.begin() + got, '\n');
+                }
+                if (got == 0) epoll_ctl(ep, EPOLL_CTL_DEL, s, nullptr);
+            }
+        }
+        for (int s : fds) close(s);
+        close(ep);
+    }
+
+    int n_, pace_ms_;
+    atomic<bool> ready_{false};
+    atomic<int> joined_{0};
+    atomic<uint64_t> frames_received_{0};
+    Histogram latency_;
+};
+
+void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    int workers = max(1u, thread::hardware_concurrency());
+    bool bench = false, delta = false;
+    int bench_matches = 1000, duration_ms = 5000, size = 3, k = 3;
+    int spectators = -1, pace_ms = 20;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        bool has = i + 1 < argc;
+        if (a == "--port" && has) HOST_PORT = atoi(argv[++i]);
+        else if (a == "--workers" && has) workers = max(1, atoi(argv[++i]));
+        else if (a == "--bench") bench = true;
+        else if (a == "--delta") delta = true;
+        else if (a == "--matches" && has) bench_matches = max(1, atoi(argv[++i]));
+        else if (a == "--duration-ms" && has) duration_ms = max(1, atoi(argv[++i]));
+        else if (a == "--size" && has) size = atoi(argv[++i]);
+        else if (a == "--win" && has) k = atoi(argv[++i]);
+        else if (a == "--spectators" && has) spectators = max(0, atoi(argv[++i]));
+        else if (a == "--pace-ms" && has) pace_ms = max(0, atoi(argv[++i]));
+        else {
+            cerr << "Unknown argument " << a << "\n";
+            return 1;
+        }
+    }
+    if (!Rules::get(size, k)) {
+        cerr << "Unsupported board " << size << "x" << size << " with " << k << " in a row\n";
+        return 1;
+    }
+    raise_fd_limit();
+
+    auto &hosts = HostWorker::all();
+    for (int i = 0; i < workers; ++i) hosts.emplace_back(new HostWorker(i));
+    for (auto &w : hosts) thread([w = w.get()]{ w->run(); }).detach();
+    cout << "[INFO] Game host listening on port " << HOST_PORT << " (" << workers << " workers)" << endl;
+    if (!bench) {
+        while (true) this_thread::sleep_for(chrono::hours(1));
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(100));
+    int drivers = workers;
+    vector<unique_ptr<BenchDriver>> bots;
+    for (int i = 0; i < drivers; ++i) {
+        int slots = bench_matches / drivers + (i < bench_matches % drivers ? 1 : 0);
+        bots.emplace_back(new BenchDriver(i, slots, size, k, delta));
+    }
+    atomic<bool> stop{false};
+    double cpu0 = 0;
+    for (auto &w : hosts) cpu0 += w->cpu_seconds();
+    uint64_t done0 = matches_finished.load(), moves0 = moves_played.load(), bytes0 = bytes_sent.load();
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (auto &b : bots) pool.emplace_back([&, b = b.get()]{ b->run(stop); });
+    unique_ptr<SpectatorBench> audience;
+    if (spectators >= 0) {
+        audience.reset(new SpectatorBench(spectators, pace_ms));
+        pool.emplace_back([&]{ audience->run(stop); });
+    }
+    this_thread::sleep_for(chrono::milliseconds(duration_ms));
+    uint64_t done = matches_finished.load() - done0, moves = moves_played.load() - moves0;
+    uint64_t bytes = bytes_sent.load() - bytes0;
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    double cpu = -cpu0;
+    for (auto &w : hosts) cpu += w->cpu_seconds();
+    stop = true;
+    for (auto &t : pool) t.join();
+    cout << json{{"bench","game_host"},{"workers",workers},{"concurrent_matches",bench_matches},
+                 {"size",size},{"k",k},{"delta",delta},{"matches",done},
+                 {"bytes_per_move", moves ? (double)bytes / moves : 0.0},{"matches_per_sec",done / secs},{"moves_per_sec",moves / secs},
+                 {"host_cpu_sec",cpu},{"matches_per_core_sec", cpu > 0 ? done / cpu : 0.0}}.dump() << endl;
+    if (audience) {
+        json r = audience->report();
+        r["frames_sent"] = spectator_frames.load();
+        r["frames_coalesced"] = frames_coalesced.load();
+        r["spectators_dropped"] = spectators_dropped.load();
+        cout << r.dump() << endl;
+    }
+    return 0;
+}
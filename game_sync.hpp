@@ -0,0 +1,58 @@
+#pragma once
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "json.hpp"
+#include "game.hpp"
+
+// Delta mode for the game connection. GAME_START carries the full board as
+// always, but after that MOVE_REQ and GAME_END only carry
+//   "seq"   moves played so far, including the one in "last"
+//   "last"  the cell just played, -1 when nothing new was played
+//   "hash"  Game::hash() of the board after it
+// and the receiver plays "last" on its own copy of the game. MOVE echoes
+// the seq of the move it makes, so the referee can drop a stale one. If
+// seq skips a move or the hash disagrees, the receiver answers
+// {"type":"RESYNC"} and the referee repeats the MOVE_REQ with "board".
+//
+// A player asks for it with "delta":true in its JOIN or INVITE_RESPONSE,
+// and the referee confirms with "delta":true in GAME_START. Players that
+// never ask keep getting the full board every turn.
+
+// Adds the delta fields for the move at last (-1 for none) to a MOVE_REQ
+// or GAME_END.
+inline void add_delta(nlohmann::json &msg, const Game &g, int last) {
+    msg["seq"] = g.moves();
+    msg["last"] = last;
+    msg["hash"] = g.hash();
+}
+
+// Brings g up to date from a MOVE_REQ or GAME_END, with or without the
+// full board. False if it cannot, in which case the caller sends RESYNC.
+inline bool sync_game(Game &g, const nlohmann::json &msg) {
+    if (msg.contains("board")) {
+        if (!g.load(msg.value("board", std::vector<std::string>()))) return false;
+    } else if (msg.contains("seq")) {
+        int seq = msg.value("seq", -1), last = msg.value("last", -1);
+        if (seq == g.moves() + 1 && g.legal(last)) g.play(last);
+        else if (seq != g.moves()) return false;
+    } else {
+        return false;
+    }
+    return !msg.contains("hash") || msg.value("hash", (uint64_t)0) == g.hash();
+}
+
+// Writes a whole frame, retrying short writes, so a frame never goes out
+// in pieces that a reader has to wait for.
+inline bool write_frame(int fd, const std::string &frame) {
+    size_t off = 0;
+    while (off < frame.size()) {
+        ssize_t n = send(fd, frame.data() + off, frame.size() - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
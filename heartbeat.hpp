@@ -0,0 +1,106 @@
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Heartbeat datagrams for the lobby's UDP port. A player that logged in
+// gets a session token and sends one of these every heartbeat interval
+// instead of a STATUS request:
+//
+//   'H' 'B'  kind (1 byte)  name length (1 byte)  token (8 bytes, big endian)  name
+//
+// kind is HB_BEAT from the player. The lobby answers only when the token
+// is no longer valid (the player timed out, logged out or the lobby
+// restarted), with the same datagram and kind HB_STALE; the player then
+// falls back to a STATUS request, whose reply carries a fresh token.
+const uint8_t HB_BEAT = 0;
+const uint8_t HB_STALE = 1;
+const size_t HB_HEADER = 12;
+const size_t HB_MAX = HB_HEADER + 255;
+
+// Encodes into out, which needs HB_MAX bytes. Returns the length, or 0 if
+// the name does not fit.
+inline size_t hb_encode(char *out, uint8_t kind, const std::string &name, uint64_t token) {
+    if (name.size() > 255) return 0;
+    out[0] = 'H';
+    out[1] = 'B';
+    out[2] = (char)kind;
+    out[3] = (char)name.size();
+    for (int i = 0; i < 8; ++i) out[4 + i] = (char)(token >> (56 - 8 * i));
+    memcpy(out + HB_HEADER, name.data(), name.size());
+    return HB_HEADER + name.size();
+}
+
+// False if buf is not a well-formed heartbeat datagram.
+inline bool hb_decode(const char *buf, size_t len, uint8_t &kind, std::string &name, uint64_t &token) {
+    if (len < HB_HEADER || buf[0] != 'H' || buf[1] != 'B') return false;
+    size_t n = (unsigned char)buf[3];
+    if (len != HB_HEADER + n) return false;
+    kind = (uint8_t)buf[2];
+    token = 0;
+    for (int i = 0; i < 8; ++i) token = token << 8 | (unsigned char)buf[4 + i];
+    name.assign(buf + HB_HEADER, n);
+    return true;
+}
+
+// A player's side of the heartbeat port: one connected UDP socket. Not
+// thread-safe; the status thread owns it.
+class HeartbeatSocket {
+public:
+    HeartbeatSocket() = default;
+    ~HeartbeatSocket() { close(); }
+    HeartbeatSocket(const HeartbeatSocket &) = delete;
+    HeartbeatSocket &operator=(const HeartbeatSocket &) = delete;
+
+    // Connects to the lobby's heartbeat port. False leaves the socket closed
+    // and the caller on STATUS requests.
+    bool open(const std::string &host, int port) {
+        close();
+        fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd_ < 0) return false;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+            connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+
+    bool is_open() const { return fd_ >= 0; }
+
+    bool beat(const std::string &name, uint64_t token) {
+        char buf[HB_MAX];
+        size_t n = hb_encode(buf, HB_BEAT, name, token);
+        return n && send(fd_, buf, n, 0) == (ssize_t)n;
+    }
+
+    // True if the lobby has said since the last call that token is stale.
+    // Never blocks.
+    bool stale(uint64_t token) {
+        char buf[HB_MAX];
+        bool out = false;
+        ssize_t n;
+        while ((n = recv(fd_, buf, sizeof(buf), 0)) >= 0) {
+            uint8_t kind;
+            std::string name;
+            uint64_t t;
+            if (hb_decode(buf, n, kind, name, t) && kind == HB_STALE && t == token) out = true;
+        }
+        return out;
+    }
+
+private:
+    int fd_ = -1;
+};
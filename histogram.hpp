@@ -0,0 +1,74 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram of non-negative integers (latencies in ns, sizes in
+// bytes). Each power of two is split into 2^SUB_BITS linear sub-buckets, so
+// a reported percentile is within 1/64 of the true value across the whole
+// 64-bit range. Recording is a few shifts and one increment; histograms
+// from different threads are combined with merge().
+class Histogram {
+public:
+    static const int SUB_BITS = 6;
+    static const size_t SUB = size_t(1) << SUB_BITS;
+    static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    Histogram() : counts_(BUCKETS, 0) {}
+
+    void record(uint64_t v) {
+        ++counts_[index_of(v)];
+        ++count_;
+        sum_ += v;
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const Histogram &o) {
+        for (size_t i = 0; i < BUCKETS; ++i) counts_[i] += o.counts_[i];
+        count_ += o.count_;
+        sum_ += o.sum_;
+        max_ = std::max(max_, o.max_);
+    }
+
+    void reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = sum_ = max_ = 0;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    uint64_t sum() const { return sum_; }
+    double mean() const { return count_ ? (double)sum_ / count_ : 0.0; }
+
+    // Smallest bucket bound that covers fraction q (0..1) of the values.
+    uint64_t percentile(double q) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = (uint64_t)(q * count_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(upper_of(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static size_t index_of(uint64_t v) {
+        if (v < SUB) return v;
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return ((size_t)(shift + 1) << SUB_BITS) + ((v >> shift) & (SUB - 1));
+    }
+
+    static uint64_t upper_of(size_t i) {
+        if (i < SUB) return i;
+        int shift = (int)(i >> SUB_BITS) - 1;
+        uint64_t low = (uint64_t)(SUB + (i & (SUB - 1))) << shift;
+        return low + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
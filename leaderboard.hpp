@@ -0,0 +1,194 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Users ordered by experience, for LEADERBOARD and RANK, kept up to date
+// one change at a time instead of sorting the user table per query.
+//
+// A skip list ordered by score, highest first, then by name. Like the one
+// behind Redis sorted sets, every link also stores how many entries it
+// jumps over, so summing spans along a search path counts the entries
+// before a point in O(log n): that is both a rank and the way to find the
+// start of a page, which is then read off the bottom level.
+//
+// Only scores above zero are listed. Every account starts at 0, so the
+// list stays as large as the set of players who ever earned xp, and the
+// rest all share the rank below its last entry.
+class Leaderboard {
+public:
+    struct Entry {
+        std::string name;
+        int score;
+        size_t rank;
+    };
+
+    Leaderboard() : head_(new Node(std::string(), 0, MAX_LEVEL)) {}
+    ~Leaderboard() {
+        for (Node *x = head_; x;) {
+            Node *next = x->level[0].next;
+            delete x;
+            x = next;
+        }
+    }
+    Leaderboard(const Leaderboard &) = delete;
+    Leaderboard &operator=(const Leaderboard &) = delete;
+
+    // Moves name to score. A score of 0 or less takes it off the list.
+    void set(std::string_view name, int score) {
+        std::unique_lock<std::shared_mutex> g(m_);
+        auto it = index_.find(name);
+        if (it != index_.end()) {
+            if (it->second->score == score) return;
+            Node *x = it->second;
+            index_.erase(it);
+            unlink(x);
+        }
+        if (score > 0) link(name, score);
+    }
+
+    // How many listed users have more than score; a user with score s is
+    // ranked above(s) + 1, so ties share a rank.
+    size_t above(int score) const {
+        std::shared_lock<std::shared_mutex> g(m_);
+        return count_above(score);
+    }
+
+    // Up to count entries starting at 0-based position offset, best first,
+    // with their ranks.
+    std::vector<Entry> range(size_t offset, size_t count) const {
+        std::shared_lock<std::shared_mutex> g(m_);
+        std::vector<Entry> out;
+        if (offset >= size_ || !count) return out;
+        // Walk to the entry just before position offset, by span.
+        size_t passed = 0;
+        const Node *x = head_;
+        for (int i = levels_ - 1; i >= 0; --i) {
+            while (x->level[i].next && passed + x->level[i].span <= offset) {
+                passed += x->level[i].span;
+                x = x->level[i].next;
+            }
+        }
+        out.reserve(std::min(count, size_ - offset));
+        for (x = x->level[0].next; x && out.size() < count; x = x->level[0].next) {
+            // The first entry may tie with entries before the page, so its
+            // rank takes one more descent; ties after it copy the rank.
+            size_t rank = offset + out.size() + 1;
+            if (out.empty()) rank = count_above(x->score) + 1;
+            else if (out.back().score == x->score) rank = out.back().rank;
+            out.push_back(Entry{x->name, x->score, rank});
+        }
+        return out;
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> g(m_);
+        return size_;
+    }
+
+private:
+    static constexpr int MAX_LEVEL = 32;
+
+    size_t count_above(int score) const {
+        size_t n = 0;
+        const Node *x = head_;
+        for (int i = levels_ - 1; i >= 0; --i) {
+            while (x->level[i].next && x->level[i].next->score > score) {
+                n += x->level[i].span;
+                x = x->level[i].next;
+            }
+        }
+        return n;
+    }
+
+    struct Node {
+        struct Link {
+            Node *next = nullptr;
+            // Entries passed by following next: 1 to the neighbour, and
+            // from the head or the last node at a level, up to the end.
+            size_t span = 0;
+        };
+        std::string name;
+        int score;
+        std::vector<Link> level;
+
+        Node(std::string name, int score, int levels) : name(std::move(name)), score(score), level(levels) {}
+    };
+
+    static bool before(const Node *x, int score, std::string_view name) {
+        return x->score > score || (x->score == score && x->name < name);
+    }
+
+    // One more level with probability 1/4, as in Redis.
+    int random_level() {
+        int n = 1;
+        while (n < MAX_LEVEL && (rng_() & 3) == 0) ++n;
+        return n;
+    }
+
+    void link(std::string_view name, int score) {
+        Node *update[MAX_LEVEL];
+        size_t rank[MAX_LEVEL];
+        Node *x = head_;
+        for (int i = levels_ - 1; i >= 0; --i) {
+            rank[i] = i == levels_ - 1 ? 0 : rank[i + 1];
+            while (x->level[i].next && before(x->level[i].next, score, name)) {
+                rank[i] += x->level[i].span;
+                x = x->level[i].next;
+            }
+            update[i] = x;
+        }
+        int n = random_level();
+        for (int i = levels_; i < n; ++i) {
+            rank[i] = 0;
+            update[i] = head_;
+            head_->level[i].span = size_;
+        }
+        if (n > levels_) levels_ = n;
+        x = new Node(std::string(name), score, n);
+        for (int i = 0; i < n; ++i) {
+            x->level[i].next = update[i]->level[i].next;
+            update[i]->level[i].next = x;
+            x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+            update[i]->level[i].span = rank[0] - rank[i] + 1;
+        }
+        for (int i = n; i < levels_; ++i) ++update[i]->level[i].span;
+        ++size_;
+        index_.emplace(std::string_view(x->name), x);
+    }
+
+    // Takes x out of the list and frees it; its index entry must be gone.
+    void unlink(Node *x) {
+        Node *update[MAX_LEVEL];
+        Node *p = head_;
+        for (int i = levels_ - 1; i >= 0; --i) {
+            while (p->level[i].next && before(p->level[i].next, x->score, x->name)) p = p->level[i].next;
+            update[i] = p;
+        }
+        for (int i = 0; i < levels_; ++i) {
+            if (update[i]->level[i].next == x) {
+                update[i]->level[i].span += x->level[i].span - 1;
+                update[i]->level[i].next = x->level[i].next;
+            } else {
+                --update[i]->level[i].span;
+            }
+        }
+        while (levels_ > 1 && !head_->level[levels_ - 1].next) --levels_;
+        --size_;
+        delete x;
+    }
+
+    mutable std::shared_mutex m_;
+    Node *head_;
+    int levels_ = 1;
+    size_t size_ = 0;
+    // Keys point at the node's own name.
+    std::unordered_map<std::string_view, Node *> index_;
+    std::mt19937 rng_{std::random_device{}()};
+};
@@ -0,0 +1,425 @@
+// Headless load generator for the lobby. Simulates many virtual clients,
+// each with its own connection and user, and reports throughput and
+// latency percentiles per command as one JSON object per line.
+//
+//   --host IP / --port N    lobby address (default 127.0.0.1:12000)
+//   --clients N             virtual clients (default 1000)
+//   --threads N             event loops driving them (default: all cores)
+//   --duration-ms N         measured run time (default 10000)
+//   --rate N                open loop: N requests/s in total, sent on
+//                           schedule whether or not replies have arrived.
+//                           0 (default) is closed loop: every client keeps
+//                           exactly one request in flight.
+//   --mix CMD=W,...         command weights (default
+//                           STATUS=70,ONLINE_STATUS=25,LOGIN=2,LOGOUT=2,REGISTER=1)
+//   --prefix S              username prefix, so runs do not collide (default "lg")
+//
+// Open-loop latency is measured from when a request was due, not from when
+// it was written, so a stalled lobby shows up in the tail instead of
+// silently lowering the offered load.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "json.hpp"
+#include "frame_reader.hpp"
+#include "histogram.hpp"
+
+using json = nlohmann::json;
+using namespace std;
+
+enum Cmd { REGISTER, LOGIN, STATUS, ONLINE_STATUS, LOGOUT, NCMD };
+const char* CMD_NAMES[NCMD] = {"REGISTER", "LOGIN", "STATUS", "ONLINE_STATUS", "LOGOUT"};
+
+string host = "127.0.0.1";
+int port = 12000;
+int clients = 1000;
+int threads = max(1u, thread::hardware_concurrency());
+int duration_ms = 10000;
+double rate = 0;
+string prefix = "lg";
+int weights[NCMD] = {1, 2, 70, 25, 2};
+
+int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool parse_mix(const string &spec) {
+    fill(begin(weights), end(weights), 0);
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        string name = item.substr(0, eq);
+        auto it = find(begin(CMD_NAMES), end(CMD_NAMES), name);
+        if (it == end(CMD_NAMES)) return false;
+        weights[it - begin(CMD_NAMES)] = atoi(item.c_str() + eq + 1);
+    }
+    int total = 0;
+    for (int w : weights) total += max(0, w);
+    return total > 0;
+}
+
+struct Inflight {
+    Cmd cmd;
+    int64_t t0;
+};
+
+struct Client {
+    int fd = -1;
+    string user;
+    bool online = false;
+    bool dead = false;
+    FrameReader in;
+    string out;
+    size_t out_off = 0;
+    bool want_write = false;
+    deque<Inflight> inflight;
+};
+
+struct Stats {
+    Histogram hist[NCMD];
+    uint64_t ok[NCMD] = {};
+    uint64_t err[NCMD] = {};
+    uint64_t lost = 0;  // requests that never got a reply
+};
+
+bool send_all(int fd, const string &s) {
+    size_t off = 0;
+    while (off < s.size()) {
+        ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+int connect_lobby() {
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
+    return s;
+}
+
+// Drives one slice of the clients from a single epoll loop.
+class Worker {
+public:
+    Worker(int id, int first, int count) : id_(id), rng_(id + 1) {
+        cl_.resize(count);
+        for (int i = 0; i < count; ++i) cl_[i].user = prefix + to_string(first + i);
+    }
+
+    // Connects every client and makes sure its user exists and is logged
+    // in. Requests are pipelined across all clients before any reply is
+    // read, so setup shares the lobby's group commits.
+    bool setup() {
+        for (auto &c : cl_) {
+            c.fd = connect_lobby();
+            if (c.fd < 0) {
+                perror("[ERROR] connect");
+                return false;
+            }
+            c.in.reset(c.fd);
+            string req = json{{"cmd","REGISTER"},{"username",c.user},{"password","pw"}}.dump() + "\n" +
+                         json{{"cmd","LOGIN"},{"username",c.user},{"password","pw"},{"id",0}}.dump() + "\n";
+            if (!send_all(c.fd, req)) return false;
+        }
+        for (auto &c : cl_) {
+            string line;
+            for (int k = 0; k < 2; ++k) {
+                if (c.in.read_frame(line) <= 0) return false;
+            }
+            // TAKEN means a previous run left the user online; either way
+            // this connection now counts as logged in.
+            c.online = true;
+            fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+        }
+        return true;
+    }
+
+    void run(int64_t start, int64_t stop, double my_rate) {
+        ep_ = epoll_create1(EPOLL_CLOEXEC);
+        for (size_t i = 0; i < cl_.size(); ++i) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = i;
+            epoll_ctl(ep_, EPOLL_CTL_ADD, cl_[i].fd, &ev);
+        }
+        bool open_loop = my_rate > 0;
+        int64_t interval = open_loop ? (int64_t)(1e9 / my_rate) : 0;
+        int64_t next_due = start;
+        size_t rr = 0;
+        if (!open_loop) {
+            for (auto &c : cl_) issue(c, now_ns());
+        }
+
+        vector<epoll_event> evs(256);
+        // After the run, in-flight replies get a grace period to arrive.
+        int64_t drain_until = stop + 2000000000LL;
+        while (true) {
+            int64_t now = now_ns();
+            if (now >= drain_until) break;
+            if (now >= stop && outstanding() == 0) break;
+            if (open_loop && now < stop) {
+                while (next_due <= now && next_due < stop) {
+                    Client &c = cl_[rr++ % cl_.size()];
+                    if (!c.dead) issue(c, next_due);
+                    next_due += interval;
+                }
+            }
+            int64_t wake = now >= stop ? drain_until : (open_loop ? next_due : stop);
+            int timeout = (int)max<int64_t>(0, (wake - now + 999999) / 1000000);
+            int n = epoll_wait(ep_, evs.data(), (int)evs.size(), timeout);
+            for (int i = 0; i < n; ++i) {
+                Client &c = cl_[evs[i].data.u64];
+                if (c.dead) continue;
+                bool ok = true;
+                if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = on_readable(c, stop);
+                if (ok && (evs[i].events & EPOLLOUT)) ok = flush(c);
+                if (!ok) kill(c);
+            }
+        }
+        for (auto &c : cl_) {
+            stats.lost += c.inflight.size();
+            close(c.fd);
+        }
+        close(ep_);
+    }
+
+    Stats stats;
+
+private:
+    size_t outstanding() const {
+        size_t n = 0;
+        for (auto &c : cl_) n += c.inflight.size();
+        return n;
+    }
+
+    Cmd pick() {
+        int total = 0;
+        for (int w : weights) total += max(0, w);
+        int r = (int)(rng_() % total);
+        for (int i = 0; i < NCMD; ++i) {
+            r -= max(0, weights[i]);
+            if (r < 0) return (Cmd)i;
+        }
+        return STATUS;
+    }
+
+    // LOGIN and LOGOUT picks flip the client's session: a pick that would
+    // repeat the current state sends the other one, so their weights set
+    // the rate of presence changes rather than of TAKEN replies.
+    void issue(Client &c, int64_t due) {
+        Cmd cmd = pick();
+        if (cmd == LOGIN && c.online) cmd = LOGOUT;
+        else if (cmd == LOGOUT && !c.online) cmd = LOGIN;
+        json req;
+        switch (cmd) {
+        case REGISTER:
+            req = {{"cmd","REGISTER"},{"username",prefix + "r" + to_string(getpid()) + "_" + to_string(id_) + "_" + to_string(registered_++)},
+                   {"password","pw"}};
+            break;
+        case LOGIN:
+            req = {{"cmd","LOGIN"},{"username",c.user},{"password","pw"}};
+            c.online = true;
+            break;
+        case LOGOUT:
+            req = {{"cmd","LOGOUT"},{"username",c.user}};
+            c.online = false;
+            break;
+        case STATUS:
+            req = {{"cmd","STATUS"},{"username",c.user}};
+            c.online = true;
+            break;
+        default:
+            req = {{"cmd","ONLINE_STATUS"},{"username",prefix + to_string(rng_() % clients)}};
+            break;
+        }
+        // Tagged like a persistent client, so closing the connection logs
+        // the user out.
+        req["id"] = 0;
+        c.out += req.dump();
+        c.out.push_back('\n');
+        c.inflight.push_back({cmd, due});
+        if (!flush(c)) kill(c);
+    }
+
+    bool on_readable(Client &c, int64_t stop) {
+        while (true) {
+            ssize_t n = c.in.fill();
+            if (n == 0) return false;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                return false;
+            }
+            string line;
+            while (c.in.next_frame(line)) {
+                if (c.inflight.empty()) continue;
+                Inflight f = c.inflight.front();
+                c.inflight.pop_front();
+                int64_t now = now_ns();
+                stats.hist[f.cmd].record(max<int64_t>(0, now - f.t0));
+                bool ok = line.find("\"status\":\"OK\"") != string::npos;
+                ++(ok ? stats.ok : stats.err)[f.cmd];
+                if (rate <= 0 && now < stop && !c.dead) issue(c, now);
+            }
+        }
+    }
+
+    bool flush(Client &c) {
+        while (c.out_off < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c.out_off += n;
+        }
+        if (c.out_off == c.out.size()) {
+            c.out.clear();
+            c.out_off = 0;
+        }
+        bool need = !c.out.empty();
+        if (need != c.want_write) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | (need ? (uint32_t)EPOLLOUT : 0u);
+            ev.data.u64 = &c - cl_.data();
+            epoll_ctl(ep_, EPOLL_CTL_MOD, c.fd, &ev);
+            c.want_write = need;
+        }
+        return true;
+    }
+
+    void kill(Client &c) {
+        if (c.dead) return;
+        cerr << "[WARN] Connection for " << c.user << " closed\n";
+        c.dead = true;
+        stats.lost += c.inflight.size();
+        c.inflight.clear();
+        epoll_ctl(ep_, EPOLL_CTL_DEL, c.fd, nullptr);
+    }
+
+    int id_;
+    mt19937_64 rng_;
+    vector<Client> cl_;
+    int ep_ = -1;
+    uint64_t registered_ = 0;
+};
+
+void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+json summarize(const string &cmd, const Histogram &h, uint64_t ok, uint64_t err, double secs) {
+    return {{"bench","loadgen"},{"mode", rate > 0 ? "open" : "closed"},{"cmd",cmd},
+            {"clients",clients},{"count",h.count()},{"ok",ok},{"errors",err},
+            {"rps", h.count() / secs},{"mean_us", h.mean() / 1e3},
+            {"p50_us", h.percentile(0.50) / 1e3},{"p99_us", h.percentile(0.99) / 1e3},
+            {"p999_us", h.percentile(0.999) / 1e3},{"max_us", h.max() / 1e3}};
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        bool has = i + 1 < argc;
+        if (a == "--host" && has) host = argv[++i];
+        else if (a == "--port" && has) port = atoi(argv[++i]);
+        else if (a == "--clients" && has) clients = max(1, atoi(argv[++i]));
+        else if (a == "--threads" && has) threads = max(1, atoi(argv[++i]));
+        else if (a == "--duration-ms" && has) duration_ms = max(1, atoi(argv[++i]));
+        else if (a == "--rate" && has) rate = atof(argv[++i]);
+        else if (a == "--prefix" && has) prefix = argv[++i];
+        else if (a == "--mix" && has) {
+            if (!parse_mix(argv[++i])) {
+                cerr << "Bad --mix, expected CMD=WEIGHT,... with at least one positive weight\n";
+                return 1;
+            }
+        } else {
+            cerr << "Unknown argument " << a << "\n";
+            return 1;
+        }
+    }
+    threads = min(threads, clients);
+    raise_fd_limit();
+
+    vector<unique_ptr<Worker>> workers;
+    for (int i = 0, first = 0; i < threads; ++i) {
+        int count = clients / threads + (i < clients % threads ? 1 : 0);
+        workers.emplace_back(new Worker(i, first, count));
+        first += count;
+    }
+    cerr << "[INFO] Connecting " << clients << " clients to " << host << ":" << port << "\n";
+    atomic<bool> setup_ok{true};
+    {
+        vector<thread> pool;
+        for (auto &w : workers) pool.emplace_back([&, w = w.get()]{ if (!w->setup()) setup_ok = false; });
+        for (auto &t : pool) t.join();
+    }
+    if (!setup_ok) {
+        cerr << "[ERROR] Setup failed\n";
+        return 1;
+    }
+
+    cerr << "[INFO] Running for " << duration_ms << " ms\n";
+    int64_t start = now_ns() + 10000000;  // lets every worker start on time
+    int64_t stop = start + (int64_t)duration_ms * 1000000;
+    {
+        vector<thread> pool;
+        for (auto &w : workers) pool.emplace_back([&, w = w.get()]{ w->run(start, stop, rate / threads); });
+        for (auto &t : pool) t.join();
+    }
+
+    double secs = duration_ms / 1000.0;
+    Stats total;
+    for (auto &w : workers) {
+        for (int c = 0; c < NCMD; ++c) {
+            total.hist[c].merge(w->stats.hist[c]);
+            total.ok[c] += w->stats.ok[c];
+            total.err[c] += w->stats.err[c];
+        }
+        total.lost += w->stats.lost;
+    }
+    Histogram all;
+    uint64_t ok = 0, err = 0;
+    for (int c = 0; c < NCMD; ++c) {
+        if (total.hist[c].count() == 0) continue;
+        cout << summarize(CMD_NAMES[c], total.hist[c], total.ok[c], total.err[c], secs).dump() << endl;
+        all.merge(total.hist[c]);
+        ok += total.ok[c];
+        err += total.err[c];
+    }
+    json j = summarize("ALL", all, ok, err, secs);
+    j["lost"] = total.lost;
+    if (rate > 0) j["offered_rps"] = rate;
+    cout << j.dump() << endl;
+    return 0;
+}
@@ -1,16 +1,38 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <cstring>
+#include <csignal>
 #include <iostream>
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <deque>
+#include <random>
 #include "json.hpp"
+#include "frame_reader.hpp"
+#include "wire.hpp"
+#include "wal.hpp"
+#include "user_file.hpp"
+#include "user_store.hpp"
+#include "presence.hpp"
+#include "leaderboard.hpp"
+#include "heartbeat.hpp"
+#include "timer_wheel.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
 #include <chrono>
 
 using json = nlohmann::json;
@@ -18,224 +40,1657 @@ using namespace std;
 
 const int LOBBY_PORT = 12000;
 const char* DB_FILE = "users.json";
-mutex db_m;
-
-struct User {
-    string password;
-    int login_count = 0;
-    int experience = 0;
-    bool online = false;
-    chrono::steady_clock::time_point last_seen = chrono::steady_clock::now();
+// --store mmap keeps snapshots in this binary file instead; see user_file.hpp.
+const char* BIN_DB_FILE = "users.db";
+bool mmap_store = false;
+const char* LOG_FILE = "users.log";
+// The log is folded into a snapshot once it outgrows the last snapshot,
+// which keeps persistence cost amortized O(1) per mutation.
+const uint64_t COMPACT_MIN_BYTES = 1 << 20;
+WriteAheadLog wal;
+atomic<uint64_t> snapshot_bytes{0};
+// Users whose last STATUS is older than the timeout are marked offline;
+// the sweeper checks every tick, so expiry lands within one tick of it.
+int64_t presence_timeout = ticks_of(chrono::seconds(10));
+int64_t presence_tick = ticks_of(chrono::seconds(1));
+// How often clients are told to heartbeat, and the UDP port that takes
+// heartbeat datagrams (0 when it is not open).
+int heartbeat_ms = 5000;
+int heartbeat_port = 0;
+unique_ptr<TimerWheel> presence_wheel;
+
+// The mapped snapshot users are faulted in from; declared before users so
+// it outlives the store.
+UserFile user_file;
+UserStore users;
+// Online flags, heartbeats, games and invite endpoints; memory only.
+PresenceTable presence;
+// Users with xp, best first. Rebuilt from the table at startup and moved
+// under the user's shard lock whenever their experience changes.
+Leaderboard leaderboard;
+// xp a RESULT adds by outcome.
+const int XP_WIN = 10, XP_DRAW = 4, XP_LOSE = 1;
+// Each heartbeat interval a player stays online earns HEARTBEAT_XP, the
+// same over UDP and STATUS. It collects in presence, off the disk, and is
+// banked into the account on logout, with a RESULT, before compaction and
+// every XP_BANK_INTERVAL, so a crash loses at most that much of it.
+const int HEARTBEAT_XP = 1;
+const auto XP_BANK_INTERVAL = chrono::seconds(60);
+// LEADERBOARD pages are capped at this many entries.
+const int MAX_LEADERBOARD_PAGE = 100;
+
+// Gauges kept by the code that changes them; see register_metrics().
+atomic<int64_t> connected_clients{0};
+atomic<int64_t> online_users{0};
+
+// Commands with their own request metrics; anything else counts as OTHER.
+const char* const COMMANDS[] = {"REGISTER", "LOGIN", "LOGOUT", "STATUS", "HELLO", "SUBSCRIBE",
+                                "UNSUBSCRIBE", "PLAYERS", "ONLINE_STATUS", "STATS", "RESULT",
+                                "LEADERBOARD", "RANK", "OTHER"};
+const int NUM_COMMANDS = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+struct CommandMetrics {
+    int requests = -1;
+    int errors = -1;
+    int latency = -1;
 };
+CommandMetrics cmd_metrics[NUM_COMMANDS];
+int m_save_count = -1, m_save_bytes = -1, m_save_ns = -1;
+int m_lock_wait_ns = -1, m_lock_hold_ns = -1;
+int m_sweep_ns = -1, m_expired = -1;
+int m_hb_datagrams = -1, m_hb_stale = -1, m_hb_batch = -1;
 
-unordered_map<string, User> users;
+void register_metrics() {
+    Metrics &m = Metrics::get();
+    for (int i = 0; i < NUM_COMMANDS; ++i) {
+        string label = string("{cmd=\"") + COMMANDS[i] + "\"}";
+        cmd_metrics[i].requests = m.counter("lobby_requests_total" + label);
+        cmd_metrics[i].errors = m.counter("lobby_request_errors_total" + label);
+        cmd_metrics[i].latency = m.histogram("lobby_request_duration_ns" + label);
+    }
+    m_save_count = m.counter("lobby_snapshot_writes_total");
+    m_save_bytes = m.counter("lobby_snapshot_bytes_total");
+    m_save_ns = m.histogram("lobby_snapshot_duration_ns");
+    // The user table's lock, per shard (this was the global db_m).
+    m_lock_wait_ns = m.histogram("lobby_user_lock_wait_ns");
+    m_lock_hold_ns = m.histogram("lobby_user_lock_hold_ns");
+    m_sweep_ns = m.histogram("lobby_presence_sweep_duration_ns");
+    m_expired = m.counter("lobby_presence_expired_total");
+    m_hb_datagrams = m.counter("lobby_heartbeat_datagrams_total");
+    m_hb_stale = m.counter("lobby_heartbeat_stale_total");
+    m_hb_batch = m.histogram("lobby_heartbeat_batch_size");
+    m.gauge("lobby_connected_clients", []{ return (double)connected_clients.load(); });
+    m.gauge("lobby_online_users", []{ return (double)online_users.load(); });
+    m.gauge("lobby_users", []{ return (double)users.size(); });
+    m.gauge("lobby_ranked_users", []{ return (double)leaderboard.size(); });
+    m.gauge("lobby_presence_timers", []{ return (double)presence_wheel->size(); });
+    m.gauge("lobby_wal_bytes", []{ return (double)wal.bytes(); });
+    users.set_lock_observer([](uint64_t wait_ns, uint64_t hold_ns){
+        Metrics::get().record(m_lock_wait_ns, wait_ns);
+        Metrics::get().record(m_lock_hold_ns, hold_ns);
+    });
+}
 
-void load_db() {
-    lock_guard<mutex> g(db_m);
-    ifstream in(DB_FILE);
-    if (!in.good()) {
-        cout<<"[DEBUG] Database Failed to open\n";
-        return;
-    }
-    json j;
-    try {
-        in >> j;
-        for (auto it = j.begin(); it != j.end(); ++it) {
-            User u;
-            u.password = it.value().value("password", "");
-            u.login_count = it.value().value("login_count", 0);
-            u.experience = it.value().value("experience", 0);
-            u.online = it.value().value("online", false);
-            users[it.key()] = u;
-        }
-    } catch (...) {
-        cerr << "Failed to parse DB file\n";
+int command_index(const string &cmd) {
+    for (int i = 0; i < NUM_COMMANDS - 1; ++i) {
+        if (cmd == COMMANDS[i]) return i;
     }
-    cout<<"[DEBUG] Load Database Successful\n";
+    return NUM_COMMANDS - 1;
+}
+
+// A fresh nonzero heartbeat token.
+uint64_t new_token() {
+    thread_local mt19937_64 rng(random_device{}());
+    uint64_t t;
+    while (!(t = rng())) {}
+    return t;
+}
+
+// Flips a user's online flag and keeps the online gauge in step. Coming
+// online issues a new heartbeat token; going offline revokes it and drops
+// the user's game, match and invite endpoint. Call under the user's
+// presence shard lock. Returns whether the flag changed.
+bool set_online(PresenceTable::Ref p, bool on) {
+    if (p.online == on) return false;
+    p.online = on;
+    p.token = on ? new_token() : 0;
+    // The first heartbeat xp is earned one interval after coming online.
+    if (on) p.xp_at.store(steady_ticks(), memory_order_relaxed);
+    if (!on) {
+        p.game.clear();
+        p.match = 0;
+        p.reported = false;
+        p.ip.clear();
+        p.port = 0;
+    }
+    online_users.fetch_add(on ? 1 : -1, memory_order_relaxed);
+    return true;
+}
+
+// Takes a User or a UserRef.
+template <class U>
+json user_to_json(const U &u) {
+    return {{"password", u.password},
+            {"login_count", u.login_count},
+            {"experience", u.experience}};
+}
+
+User user_from_json(const json &v) {
+    User u;
+    u.password = v.value("password", "");
+    u.login_count = v.value("login_count", 0);
+    u.experience = v.value("experience", 0);
+    return u;
 }
 
-void save_db() {
-    cout << "[DEBUG] save_db called\n";
-    ofstream f("users.json");
-    if (!f.is_open()) {
-        cerr << "[DEBUG] ERROR: Cannot open users.json for writing!\n";
-        return;
+// Logs the current state of one user and returns the record's seq. Call
+// with the user's shard locked, then wal.wait_durable(seq) after unlocking.
+uint64_t log_user(const string &name, UserRef u) {
+    json rec = user_to_json(u);
+    rec["op"] = "put";
+    rec["user"] = name;
+    return wal.append(rec);
+}
+
+// Adds xp to a user, moves them on the leaderboard and logs the change.
+// Call under the user's shard lock, as users.update() does, so the board
+// sees each user's changes in the same order as the log.
+uint64_t add_experience(const string &name, UserRef u, int xp) {
+    u.experience = (int)min<int64_t>((int64_t)u.experience + xp, INT32_MAX);
+    leaderboard.set(name, u.experience);
+    return log_user(name, u);
+}
+
+// Credits HEARTBEAT_XP for a heartbeat unless one was credited less than
+// three quarters of an interval ago, which leaves room for jitter but not
+// for extra STATUS requests. Takes at least the shared presence lock.
+void credit_heartbeat(PresenceTable::View p, int64_t now) {
+    int64_t at = p.xp_at.load(memory_order_relaxed);
+    if (now - at < ticks_of(chrono::milliseconds(heartbeat_ms)) * 3 / 4) return;
+    if (p.xp_at.compare_exchange_strong(at, now, memory_order_relaxed)) {
+        p.xp.fetch_add(HEARTBEAT_XP, memory_order_relaxed);
+    }
+}
+
+// Moves a user's heartbeat xp into the account. Returns the log seq, or 0
+// when there was nothing to bank.
+uint64_t bank_xp(const string &name) {
+    int xp = 0;
+    presence.read(name, [&](PresenceTable::View p){ xp = p.xp.exchange(0, memory_order_relaxed); });
+    uint64_t seq = 0;
+    if (xp) users.update(name, [&](UserRef u){ seq = add_experience(name, u, xp); });
+    return seq;
+}
+
+// Banks everyone's heartbeat xp; the log's group commit takes the burst.
+void bank_all_xp() {
+    vector<string> names;
+    presence.for_each([&](string_view name, PresenceTable::View p){
+        if (p.xp.load(memory_order_relaxed)) names.emplace_back(name);
+    });
+    for (auto &name : names) bank_xp(name);
+}
+
+// The xp a RESULT earns, or -1 for an unknown result. Results are named
+// as in GAME_END.
+int result_xp(const string &result) {
+    if (result == "WIN") return XP_WIN;
+    if (result == "DRAW") return XP_DRAW;
+    if (result == "LOSE") return XP_LOSE;
+    return -1;
+}
+
+// Writes a snapshot of the user table covering every log record up to seq.
+// The file is written to a temp name, synced and renamed, so a crash
+// leaves either the old snapshot or the new one.
+bool save_db(const vector<pair<string, User>> &snap, uint64_t seq) {
+    ScopedTimer timer(m_save_ns);
+    if (mmap_store) {
+        if (!UserFile::write(BIN_DB_FILE, snap, seq)) return false;
+        struct stat st{};
+        uint64_t bytes = stat(BIN_DB_FILE, &st) == 0 ? st.st_size : 0;
+        snapshot_bytes = bytes;
+        Metrics::get().add(m_save_count);
+        Metrics::get().add(m_save_bytes, bytes);
+        return true;
     }
-    cout << "[DEBUG] users.json opened for writing\n";
+    json j_users = json::object();
+    for (auto &[k,v] : snap) j_users[k] = user_to_json(v);
+    string out = json{{"format", 2}, {"seq", seq}, {"users", j_users}}.dump();
+    out.push_back('\n');
 
-    json j;
-    for (auto &[k,v] : users) {
-        j[k] = {{"password", v.password},
-                {"login_count", v.login_count},
-                {"experience", v.experience},
-                {"online", v.online}};
+    string tmp = string(DB_FILE) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "[DEBUG] ERROR: Cannot open " << tmp << " for writing!\n";
+        return false;
+    }
+    size_t off = 0;
+    while (off < out.size()) {
+        ssize_t n = write(fd, out.data() + off, out.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("[DEBUG] snapshot write"); close(fd); return false; }
+        off += n;
     }
-    cout << "[DEBUG] JSON prepared, writing to file...\n";
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), DB_FILE) < 0) { perror("[DEBUG] snapshot commit"); return false; }
+    snapshot_bytes = out.size();
+    Metrics::get().add(m_save_count);
+    Metrics::get().add(m_save_bytes, out.size());
+    return true;
+}
 
-    f << j.dump(4) << endl;
-    f.close();
-    cout << "[DEBUG] save_db finished\n";
+// Folds the log into a new snapshot without stopping writers. The log is
+// rotated first, at seq; the table is then copied shard by shard while
+// users keep changing. Records are whole users, so replaying the new log
+// from seq over the copy lands on the right state whichever changes the
+// copy already saw.
+//
+// A .old log still there means the last save failed and its records are in
+// no snapshot yet; rotating would rename the log over it. The snapshot is
+// then retried without rotating, and replay skips what it already covers
+// in the log. The next compaction rotates again.
+void compact_db() {
+    bank_all_xp();
+    bool unsettled = access(wal.old_path().c_str(), F_OK) == 0;
+    bool rotated = false;
+    uint64_t seq = 0;
+    if (unsettled) seq = wal.last_seq();
+    else rotated = wal.rotate(seq);
+    auto snap = users.snapshot();
+    if (save_db(snap, seq)) unlink(wal.old_path().c_str());
+    else if (rotated) cerr << "[DEBUG] Keeping " << wal.old_path() << " until a snapshot covers it\n";
+    cout << "[LOBBY] Compacted " << snap.size() << " users into snapshot at seq " << seq << "\n";
 }
 
-ssize_t recv_line(int fd, string &out) {
-    out.clear();
-    char buf[1024];
-    while (true) {
-        ssize_t n = recv(fd, buf, 1, 0);
-        if (n <= 0) return n;
-        if (buf[0] == '\n') break;
-        out.push_back(buf[0]);
+// Loads the snapshot, replays the log on top of it and opens the log for
+// appending. Accepts the old flat users.json layout as a snapshot at seq 0.
+// With --store mmap the binary snapshot is only mapped, not read; users.json
+// is still read when there is no users.db yet, and the next compaction
+// writes one.
+void load_db() {
+    uint64_t seq = 0;
+    if (mmap_store && user_file.open(BIN_DB_FILE)) {
+        seq = user_file.seq();
+        snapshot_bytes = user_file.bytes();
+        users.set_base(&user_file);
+        cout << "[LOBBY] Mapped " << user_file.size() << " users from " << BIN_DB_FILE << "\n";
+    } else {
+        ifstream in(DB_FILE);
+        if (!in.good()) {
+            cout<<"[DEBUG] Database Failed to open\n";
+        } else {
+            json j;
+            try {
+                in >> j;
+                const json *entries = &j;
+                if (j.contains("format") && j["format"].is_number()) {
+                    seq = j.value("seq", (uint64_t)0);
+                    entries = &j["users"];
+                }
+                for (auto it = entries->begin(); it != entries->end(); ++it) {
+                    users.put(it.key(), user_from_json(it.value()));
+                }
+            } catch (...) {
+                cerr << "Failed to parse DB file\n";
+            }
+        }
     }
-    return (ssize_t)out.size();
+
+    auto apply = [](const json &rec) {
+        if (rec.value("op", "") == "put") users.put(rec.value("user", ""), user_from_json(rec));
+    };
+    string old_log = string(LOG_FILE) + ".old";
+    uint64_t last = max(WriteAheadLog::replay(old_log, seq, apply),
+                        WriteAheadLog::replay(LOG_FILE, seq, apply));
+
+    // A leftover .old log means a compaction was interrupted; settle it now
+    // before the next rotation would overwrite it.
+    if (access(old_log.c_str(), F_OK) == 0) {
+        if (save_db(users.snapshot(), last)) unlink(old_log.c_str());
+    }
+    if (!wal.open(LOG_FILE, last + 1)) {
+        perror("[DEBUG] Cannot open users.log");
+        exit(1);
+    }
+    // The board is not persisted; one pass over the table rebuilds it. With
+    // --store mmap this reads the file's records without faulting users in.
+    users.for_each([](string_view name, UserView u){
+        if (u.experience > 0) leaderboard.set(name, u.experience);
+    });
+    cout << "[LOBBY] Ranked " << leaderboard.size() << " users with experience\n";
+    cout<<"[DEBUG] Load Database Successful\n";
 }
 
-bool send_json(int fd, const json &j) {
-    string s = j.dump();
-    s.push_back('\n');
+bool send_frame(int fd, const string &s) {
     ssize_t total = 0;
     const char* data = s.c_str();
     ssize_t tosend = s.size();
     while (total < tosend) {
-        ssize_t n = send(fd, data + total, tosend - total, 0);
+        ssize_t n = send(fd, data + total, tosend - total, MSG_NOSIGNAL);
         if (n <= 0) return false;
         total += n;
     }
     return true;
 }
 
-void handle_client(int client_fd) {   
+// Delivers server-initiated messages to one client connection. push() may
+// be called from any thread.
+struct PushSink {
+    virtual ~PushSink() = default;
+    virtual void push(const json &event) = 0;
+};
+
+// Presence subscriptions: for each watched user, the connections that want
+// an event when that user's online flag changes.
+class PresenceHub {
+public:
+    void subscribe(const string &user, const shared_ptr<PushSink> &sink) {
+        lock_guard<mutex> g(m_);
+        watchers_[user][sink.get()] = sink;
+    }
+
+    void unsubscribe(const string &user, const PushSink *sink) {
+        lock_guard<mutex> g(m_);
+        auto it = watchers_.find(user);
+        if (it == watchers_.end()) return;
+        it->second.erase(sink);
+        if (it->second.empty()) watchers_.erase(it);
+    }
+
+    void publish(const json &event) {
+        vector<shared_ptr<PushSink>> targets;
+        {
+            lock_guard<mutex> g(m_);
+            auto it = watchers_.find(event.value("username", ""));
+            if (it == watchers_.end()) return;
+            for (auto &kv : it->second) {
+                if (auto sp = kv.second.lock()) targets.push_back(sp);
+            }
+        }
+        for (auto &t : targets) t->push(event);
+    }
+
+private:
+    mutex m_;
+    unordered_map<string, unordered_map<const PushSink*, weak_ptr<PushSink>>> watchers_;
+};
+
+PresenceHub hub;
+// Stamped on every presence event; events are published after the shard
+// lock is dropped, so clients use it to discard ones that arrive late.
+atomic<uint64_t> presence_version{0};
+
+// Builds the event for a change of a user's online flag. Call under the
+// user's presence shard lock so versions follow the order of the changes.
+json presence_event(const string &name, bool online) {
+    return json{{"event","PRESENCE"},{"username",name},{"online",online},{"version",++presence_version}};
+}
+
+struct Session {
     string username;
+    // Address the connection comes from; advertised endpoints use it.
+    string peer_ip;
+    // Encoding of frames on this connection. HELLO sets next_format, which
+    // takes effect right after the HELLO reply has gone out as JSON.
+    WireFormat format = WireFormat::Json;
+    WireFormat next_format = WireFormat::Json;
+    shared_ptr<PushSink> sink;
+    unordered_set<string> watching;
+    // Set by event loops that must not block on the group commit. A
+    // mutating command then returns its reply right away and leaves the
+    // log seq it needs, and the event to publish, for the caller to hold
+    // back until wal.durable_seq() reaches it.
+    bool defer_durable = false;
+    uint64_t pending_seq = 0;
+    json pending_event;
+};
+
+// A reply held back until the log record it answers for is durable, with
+// the presence event to publish then. Replies and pushes behind it on the
+// same connection wait too, with seq 0.
+struct Parked {
+    uint64_t seq;
+    string bytes;
+    json event;
+};
+
+// Clients that tag requests with an "id" keep one connection for their
+// whole login, so the connection closing means the player is gone. Those
+// sessions are bound to the user on LOGIN and STATUS. Untagged clients
+// open a connection per request and are never bound there.
+void bind_session(Session &s, const json &req, const string &username) {
+    if (req.contains("id")) s.username = username;
+}
+
+// What a LOGIN or STATUS says about where the player is. "udp_port" 0
+// withdraws the invite endpoint and "game" "" clears the current game;
+// requests without a field leave that part alone. The IP is the one the
+// lobby sees unless the client names one.
+struct Whereabouts {
+    bool has_endpoint = false, has_game = false;
+    string ip, game;
+    int port = 0;
+
+    Whereabouts(const Session &s, const json &req) {
+        if ((has_endpoint = req.contains("udp_port"))) {
+            port = req.value("udp_port", 0);
+            if (port <= 0 || port > 65535) port = 0;
+            else ip = req.value("udp_ip", s.peer_ip);
+        }
+        if ((has_game = req.contains("game"))) game = req.value("game", "");
+    }
+
+    bool same(PresenceTable::View p) const {
+        return (!has_endpoint || (p.port == port && p.ip == ip)) && (!has_game || p.game == game);
+    }
+
+    void apply(PresenceTable::Ref p) const {
+        if (has_endpoint) {
+            p.ip = ip;
+            p.port = port;
+        }
+        if (has_game && p.game != game) {
+            p.game = game;
+            p.match = 0;
+            p.reported = false;
+        }
+    }
+};
+
+// Once two online players name each other as their game, gives both a new
+// match id; RESULT takes one report per player per match. Call after
+// applying name's game, without holding a presence lock, as it takes both
+// players' in turn.
+void pair_match(const string &name, const string &opponent) {
+    if (opponent.empty() || opponent == name) return;
+    bool mutual = false;
+    presence.read(opponent, [&](PresenceTable::View p){ mutual = p.online && p.game == name; });
+    if (!mutual) return;
+    uint64_t id = new_token();
+    auto claim = [&](const string &who, const string &other){
+        presence.update(who, [&](PresenceTable::Ref p){
+            if (p.online && p.game == other && !p.match) p.match = id;
+        });
+    };
+    claim(name, opponent);
+    claim(opponent, name);
+}
+
+string peer_ip_of(int fd) {
+    sockaddr_in a{};
+    socklen_t len = sizeof(a);
+    char buf[INET_ADDRSTRLEN] = "";
+    if (getpeername(fd, (sockaddr*)&a, &len) == 0) inet_ntop(AF_INET, &a.sin_addr, buf, sizeof(buf));
+    return buf;
+}
+
+// Tells a client that just came online or checked in how to heartbeat:
+// how often, and the token and port for heartbeat datagrams when the UDP
+// port is open.
+void add_heartbeat(json &reply, uint64_t token) {
+    reply["heartbeat_ms"] = heartbeat_ms;
+    if (!heartbeat_port) return;
+    reply["heartbeat_port"] = heartbeat_port;
+    reply["token"] = token;
+}
+
+// Puts an online user on the presence wheel unless it already has an
+// entry. Call under the user's presence shard lock. Heartbeats only bump
+// last_seen; the entry is pushed back lazily when its slot comes up.
+void arm_presence(const string &name, PresenceTable::Ref p) {
+    if (p.armed) return;
+    p.armed = true;
+    presence_wheel->schedule(name, p.last_seen + presence_timeout);
+}
+
+// Expires users whose wheel entry is due and whose last heartbeat is really
+// older than the timeout. Work is proportional to the due entries.
+void expire_presence() {
+    ScopedTimer timer(m_sweep_ns);
+    vector<TimerWheel::Entry> due;
+    int64_t now = steady_ticks();
+    presence_wheel->advance(now, due);
+    vector<json> events;
+    vector<string> expired;
+    for (auto &e : due) {
+        const string &name = e.first;
+        presence.update(name, [&](PresenceTable::Ref p){
+            if (!p.online) { p.armed = false; return; }
+            int64_t deadline = p.last_seen + presence_timeout;
+            if (deadline > now) { presence_wheel->schedule(name, deadline); return; }
+            cout << "[LOBBY] Player " << name << " timed out, marking offline.\n";
+            set_online(p, false);
+            p.armed = false;
+            events.push_back(presence_event(name, false));
+            expired.push_back(name);
+        });
+    }
+    for (auto &name : expired) bank_xp(name);
+    if (!events.empty()) Metrics::get().add(m_expired, events.size());
+    for (auto &ev : events) hub.publish(ev);
+}
+
+// Serves the heartbeat port on its own thread. Datagrams are read up to
+// HB_BATCH at a time with one recvmmsg(), and a player that shows up more
+// than once in a batch is touched once. A valid beat only bumps last_seen
+// under the presence shard's shared lock; one with a stale token gets a
+// HB_STALE answer, all of a batch's answers going out in one sendmmsg().
+void serve_heartbeats(int fd) {
+    const int HB_BATCH = 64;
+    vector<char> bufs(HB_BATCH * HB_MAX), out(HB_BATCH * HB_MAX);
+    mmsghdr in_msgs[HB_BATCH], out_msgs[HB_BATCH];
+    iovec in_iov[HB_BATCH], out_iov[HB_BATCH];
+    sockaddr_in from[HB_BATCH];
+    unordered_map<string, pair<uint64_t, int>> beats;
+    Metrics &m = Metrics::get();
+    while (true) {
+        for (int i = 0; i < HB_BATCH; ++i) {
+            in_iov[i] = {bufs.data() + i * HB_MAX, HB_MAX};
+            in_msgs[i] = {};
+            in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+            in_msgs[i].msg_hdr.msg_iovlen = 1;
+            in_msgs[i].msg_hdr.msg_name = &from[i];
+            in_msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int n = recvmmsg(fd, in_msgs, HB_BATCH, MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            if (errno != EINTR) perror("[LOBBY] heartbeat recvmmsg");
+            continue;
+        }
+        m.add(m_hb_datagrams, n);
+        m.record(m_hb_batch, n);
+        // Last beat per player; the index is where to answer a stale one.
+        beats.clear();
+        for (int i = 0; i < n; ++i) {
+            uint8_t kind;
+            string name;
+            uint64_t token;
+            if (!hb_decode(bufs.data() + i * HB_MAX, in_msgs[i].msg_len, kind, name, token) || kind != HB_BEAT) continue;
+            beats[move(name)] = {token, i};
+        }
+        int64_t now = steady_ticks();
+        int stale = 0;
+        for (auto &kv : beats) {
+            bool ok = false;
+            presence.read(kv.first, [&](PresenceTable::View p){
+                if (!p.online || p.token != kv.second.first) return;
+                p.last_seen = now;
+                credit_heartbeat(p, now);
+                ok = true;
+            });
+            if (ok) continue;
+            char *o = out.data() + stale * HB_MAX;
+            out_iov[stale] = {o, hb_encode(o, HB_STALE, kv.first, kv.second.first)};
+            out_msgs[stale] = {};
+            out_msgs[stale].msg_hdr.msg_iov = &out_iov[stale];
+            out_msgs[stale].msg_hdr.msg_iovlen = 1;
+            out_msgs[stale].msg_hdr.msg_name = &from[kv.second.second];
+            out_msgs[stale].msg_hdr.msg_namelen = in_msgs[kv.second.second].msg_hdr.msg_namelen;
+            ++stale;
+        }
+        if (stale) {
+            m.add(m_hb_stale, stale);
+            sendmmsg(fd, out_msgs, stale, MSG_DONTWAIT);
+        }
+    }
+}
+
+// Drops the session's subscriptions and marks its user offline once the
+// connection is gone.
+void on_disconnect(Session &s) {
+    connected_clients.fetch_sub(1, memory_order_relaxed);
+    for (auto &w : s.watching) hub.unsubscribe(w, s.sink.get());
+    s.watching.clear();
+    if (s.username.empty()) return;
+    json event;
+    presence.update(s.username, [&](PresenceTable::Ref p){
+        if (set_online(p, false)) event = presence_event(s.username, false);
+    });
+    bank_xp(s.username);
+    if (!event.is_null()) hub.publish(event);
+}
+
+json handle_command(Session &s, const json &req) {
+    string cmd = req.value("cmd", "");
+    cout << "[LOBBY] Received cmd=" << cmd << " user=" << req.value("username", "") << endl;
+    // Account changes append to the log under the user's shard lock; the
+    // reply waits for the group commit after the lock is released. Presence
+    // is never logged. A change of the online flag is published to
+    // watchers after the reply's commit.
+    uint64_t seq = 0;
+    json reply, event;
+    if (cmd == "REGISTER") {
+        cout<<"[DEBUG] Start Registering...\n";
+        s.username = req.value("username", "");
+        User u; u.password = req.value("password", "");
+        bool added = users.insert(s.username, u, [&](UserRef nu){ seq = log_user(s.username, nu); });
+        if (!added) {
+            cout<<"[DEBUG] User Already Exists\n";
+            return json{{"status","ERR"},{"detail","USER_EXISTS"}};
+        }
+        cout<<"[DEBUG] User Registered successfully\n";
+        reply = json{{"status","OK"},{"detail","REGISTER_SUCCESS"}};
+    } else if (cmd == "LOGIN") {
+        string username = req.value("username", "");
+        string password = req.value("password", "");
+        bool password_ok = false;
+        int login_count = 0, experience = 0;
+        bool found = users.read(username, [&](UserView u){
+            password_ok = u.password == password;
+            login_count = u.login_count;
+            experience = u.experience;
+        });
+        if (!found) return json{{"status","ERR"},{"detail","NO_SUCH_USER"}};
+        if (!password_ok) return json{{"status","ERR"},{"detail","WRONG_PASSWORD"}};
+        // Claiming the online flag is what makes a second login TAKEN, so
+        // only the winner goes on to count the login in the account.
+        Whereabouts where(s, req);
+        bool taken = false;
+        uint64_t token = 0;
+        presence.upsert(username, [&](PresenceTable::Ref p){
+            if (!set_online(p, true)) { taken = true; return; }
+            token = p.token;
+            p.last_seen = steady_ticks();
+            arm_presence(username, p);
+            where.apply(p);
+            event = presence_event(username, true);
+        });
+        if (taken) {
+            return json{{"status","TAKEN"},{"detail","LOGIN_FAIL"},
+                        {"login_count", login_count},
+                        {"experience", experience}};
+        }
+        if (where.has_game) pair_match(username, where.game);
+        users.update(username, [&](UserRef u){
+            u.login_count += 1;
+            login_count = u.login_count;
+            experience = u.experience;
+            seq = log_user(username, u);
+        });
+        bind_session(s, req, username);
+        reply = json{{"status","OK"},{"detail","LOGIN_SUCCESS"},
+                     {"login_count", login_count},
+                     {"experience", experience}};
+        add_heartbeat(reply, token);
+    } else if (cmd == "LOGOUT") {
+        string username = req.value("username", "");
+        presence.update(username, [&](PresenceTable::Ref p){
+            if (set_online(p, false)) event = presence_event(username, false);
+        });
+        seq = bank_xp(username);
+        reply = json{{"status","OK"},{"detail","LOGOUT_SUCCESS"}};
+    } else if (cmd == "STATUS") {
+        string username = req.value("username", "");
+        int experience = 0;
+        bool found = users.read(username, [&](UserView u){ experience = u.experience; });
+        if (!found) return json{{"status","ERR"},{"detail","NO_SUCH_USER"}};
+        bind_session(s, req, username);
+        // Heartbeats that change nothing but last_seen only need the shared
+        // lock; coming online or moving takes the exclusive one.
+        Whereabouts where(s, req);
+        int64_t now = steady_ticks();
+        bool settled = false;
+        uint64_t token = 0;
+        presence.read(username, [&](PresenceTable::View p){
+            if (!p.online) return;
+            p.last_seen = now;
+            credit_heartbeat(p, now);
+            settled = where.same(p);
+            token = p.token;
+        });
+        if (!settled) {
+            presence.upsert(username, [&](PresenceTable::Ref p){
+                p.last_seen = now;
+                if (set_online(p, true)) {
+                    arm_presence(username, p);
+                    event = presence_event(username, true);
+                }
+                where.apply(p);
+                token = p.token;
+            });
+            if (where.has_game) pair_match(username, where.game);
+        }
+        reply = json{{"status","OK"},{"detail","STATUS_UPDATED"},{"experience", experience}};
+        add_heartbeat(reply, token);
+    } else if (cmd == "HELLO") {
+        s.next_format = wire_choose(req.value("formats", json::array()));
+        return json{{"status","OK"},{"detail","HELLO"},{"format", wire_name(s.next_format)}};
+    } else if (cmd == "SUBSCRIBE") {
+        // The watcher first gets the current state as an ordinary event, so
+        // a client that (re)subscribes always starts from a known state.
+        string target = req.value("username", "");
+        if (!s.sink) return json{{"status","ERR"},{"detail","UNSUPPORTED"}};
+        hub.subscribe(target, s.sink);
+        s.watching.insert(target);
+        json current = json{{"event","PRESENCE"},{"username",target},{"online",false},
+                            {"version",presence_version.load()}};
+        presence.read(target, [&](PresenceTable::View p){
+            current["online"] = p.online;
+            current["version"] = presence_version.load();
+        });
+        s.sink->push(current);
+        return json{{"status","OK"},{"detail","SUBSCRIBED"}};
+    } else if (cmd == "UNSUBSCRIBE") {
+        string target = req.value("username", "");
+        if (s.watching.erase(target)) hub.unsubscribe(target, s.sink.get());
+        return json{{"status","OK"},{"detail","UNSUBSCRIBED"}};
+    } else if (cmd == "PLAYERS") {
+        // Invite endpoints of everyone available except the asker.
+        string asker = req.value("username", "");
+        json players = json::array();
+        presence.scan([](const PresenceTable::Liveness &l){ return l.online; },
+                      [&](string_view name, PresenceTable::View p){
+            if (!p.port || name == asker) return;
+            players.push_back({{"username",string(name)},{"ip",p.ip},{"port",p.port}});
+        });
+        return json{{"status","OK"},{"players", players}};
+    } else if (cmd == "ONLINE_STATUS") {
+        string query_user = req.value("username", "");
+        bool on = false;
+        string game;
+        presence.read(query_user, [&](PresenceTable::View p){
+            on = p.online;
+            game = p.game;
+        });
+        return json{{"status","OK"},{"online", on},{"game", game}};
+    } else if (cmd == "RESULT") {
+        // A player reports how their game ended, named as in GAME_END, on
+        // the session they logged in with and once per paired match.
+        string username = req.value("username", "");
+        int xp = result_xp(req.value("result", ""));
+        if (xp < 0) return json{{"status","ERR"},{"detail","BAD_RESULT"}};
+        if (username.empty() || s.username != username) return json{{"status","ERR"},{"detail","NOT_LOGGED_IN"}};
+        const char *error = "NOT_ONLINE";
+        uint64_t match = 0;
+        presence.update(username, [&](PresenceTable::Ref p){
+            if (!p.online) return;
+            if (!p.match) { error = "NO_MATCH"; return; }
+            if (p.reported) { error = "ALREADY_REPORTED"; return; }
+            p.reported = true;
+            match = p.match;
+            // Banked along with the result, in the same log record.
+            xp += p.xp.exchange(0, memory_order_relaxed);
+        });
+        if (!match) return json{{"status","ERR"},{"detail",error}};
+        int experience = 0;
+        size_t rank = 0;
+        bool found = users.update(username, [&](UserRef u){
+            seq = add_experience(username, u, xp);
+            experience = u.experience;
+            rank = leaderboard.above(experience) + 1;
+        });
+        if (!found) return json{{"status","ERR"},{"detail","NO_SUCH_USER"}};
+        reply = json{{"status","OK"},{"detail","RESULT_RECORDED"},{"match", match},
+                     {"experience", experience},{"rank", rank}};
+    } else if (cmd == "LEADERBOARD") {
+        // One page of the board, best first. Users tied on xp share a rank;
+        // users without xp are not listed.
+        size_t offset = (size_t)max<int64_t>(0, req.value("offset", (int64_t)0));
+        size_t count = (size_t)clamp<int64_t>(req.value("count", (int64_t)10), 0, MAX_LEADERBOARD_PAGE);
+        json leaders = json::array();
+        for (auto &e : leaderboard.range(offset, count)) {
+            leaders.push_back({{"rank", e.rank},{"username", e.name},{"experience", e.score}});
+        }
+        return json{{"status","OK"},{"leaders", leaders},{"ranked", leaderboard.size()}};
+    } else if (cmd == "RANK") {
+        // Ranked under the shard lock, so the rank matches the xp returned.
+        string username = req.value("username", "");
+        int experience = 0;
+        size_t rank = 0;
+        bool found = users.read(username, [&](UserView u){
+            experience = u.experience;
+            rank = leaderboard.above(experience) + 1;
+        });
+        if (!found) return json{{"status","ERR"},{"detail","NO_SUCH_USER"}};
+        return json{{"status","OK"},{"username", username},{"experience", experience},{"rank", rank},
+                    {"users", users.size()}};
+    } else if (cmd == "STATS") {
+        if (req.value("format", "") == "text") return json{{"status","OK"},{"text", metrics_text(Metrics::get())}};
+        return json{{"status","OK"},{"stats", metrics_json(Metrics::get())}};
+    } else {
+        return json{{"status","ERR"},{"detail","UNKNOWN_CMD"}};
+    }
+    if (seq && s.defer_durable) {
+        s.pending_seq = seq;
+        s.pending_event = event;
+        return reply;
+    }
+    // The change stays in memory, but the client is not told it took.
+    if (seq && !wal.wait_durable(seq)) return json{{"status","ERR"},{"detail","LOG_FAILED"}};
+    if (!event.is_null()) hub.publish(event);
+    return reply;
+}
+
+// Decodes one request frame and returns the encoded reply frame. A request
+// "id" is echoed back so pipelined clients can match replies to requests.
+string handle_frame(Session &s, const string &payload) {
+    json req, reply;
+    try { req = decode_payload(payload, s.format); } catch (...) {
+        reply = json{{"status","ERR"},{"detail","BAD_JSON"}};
+    }
+    if (reply.is_null()) {
+        auto t0 = chrono::steady_clock::now();
+        reply = handle_command(s, req);
+        const CommandMetrics &cm = cmd_metrics[command_index(req.value("cmd", ""))];
+        Metrics &m = Metrics::get();
+        m.record(cm.latency, elapsed_ns(t0));
+        m.add(cm.requests);
+        if (reply.value("status", "") != "OK") m.add(cm.errors);
+        if (req.is_object() && req.contains("id")) reply["id"] = req["id"];
+    }
+    string out = encode_frame(reply, s.format);
+    s.format = s.next_format;
+    return out;
+}
+
+// Thread mode pushes straight into the socket. The mutex keeps pushes and
+// replies from interleaving, and the send timeout set in handle_client
+// stops a client that never reads from stalling the publisher for long.
+struct SocketSink : PushSink {
+    int fd;
+    mutex m;
+    WireFormat format = WireFormat::Json;
+
+    explicit SocketSink(int fd) : fd(fd) {}
+    void push(const json &event) override {
+        lock_guard<mutex> g(m);
+        send_frame(fd, encode_frame(event, format));
+    }
+};
+
+// Legacy mode: one blocking thread per connection.
+void handle_client(int client_fd) {
+    timeval tv{2, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    connected_clients.fetch_add(1, memory_order_relaxed);
+    auto sink = make_shared<SocketSink>(client_fd);
+    Session s;
+    s.sink = sink;
+    s.peer_ip = peer_ip_of(client_fd);
+    FrameReader rd(client_fd);
     try{
         while (true) {
-            string line;
-            ssize_t r = recv_line(client_fd, line);
-            if (r <= 0){
+            string frame;
+            if (rd.read_frame(frame) <= 0){
                 cout << "[DEBUG] Client socket closed, marking offline\n";
-                if (!users.empty()) {
-                    lock_guard<mutex> g(db_m);
-                    users[username].online = false;
-                    save_db();
-                }
-                close(client_fd);
                 break;
             }
-            json req;
-            try { req = json::parse(line); } catch (...) { 
-                json res = { {"status","ERR"}, {"detail","BAD_JSON"} };
-                send_json(client_fd, res);
-                continue;
-            }
-            string cmd = req.value("cmd", "");
-            cout << "[LOBBY] Received cmd=" << cmd << " user=" << req.value("username", "") << endl;
-            if (cmd == "REGISTER") {
-                cout<<"[DEBUG] Start Registering...\n";
-                username = req.value("username", "");
-                string password = req.value("password", "");
-                lock_guard<mutex> g(db_m);
-                if (users.find(username) != users.end()) {
-                    send_json(client_fd, json{{"status","ERR"},{"detail","USER_EXISTS"}});
-                    cout<<"[DEBUG] User Already Exists\n";
-                } else {
-                    User u; u.password = password; u.login_count = 0; u.experience = 0; u.online = false;
-                    users[username] = u;
-                    save_db();
-                    send_json(client_fd, json{{"status","OK"},{"detail","REGISTER_SUCCESS"}});
-                    cout<<"[DEBUG] User Registered successfully\n";
-                }
-            } else if (cmd == "LOGIN") {
-                string username = req.value("username", "");
-                string password = req.value("password", "");
-                lock_guard<mutex> g(db_m);
-                auto it = users.find(username);
-                if (it == users.end()) {
-                    send_json(client_fd, json{{"status","ERR"},{"detail","NO_SUCH_USER"}});
-                } else if (it->second.password != password) {
-                    send_json(client_fd, json{{"status","ERR"},{"detail","WRONG_PASSWORD"}});
-                } else {
-                    if(it->second.online==false){
-                        it->second.login_count += 1;
-                        it->second.online = true;
-                        save_db();
-                        send_json(client_fd, json{{"status","OK"},{"detail","LOGIN_SUCCESS"},
-                                                {"login_count", it->second.login_count},
-                                                {"experience", it->second.experience}});
-                    }else{
-                        send_json(client_fd, json{{"status","TAKEN"},{"detail","LOGIN_FAIL"},
-                                                {"login_count", it->second.login_count},
-                                                {"experience", it->second.experience}});
-                    }
-                }
-            } else if (cmd == "LOGOUT") {
-                string username = req.value("username", "");
-                lock_guard<mutex> g(db_m);
-                auto it = users.find(username);
-                if (it != users.end()) {
-                    it->second.online = false;
-                    save_db();
-                }
-                send_json(client_fd, json{{"status","OK"},{"detail","LOGOUT_SUCCESS"}});
-            } else if (cmd == "STATUS") {
-                string username = req.value("username", "");
-                json extra = req.value("extra", json::object());
-                lock_guard<mutex> g(db_m);
-                auto it = users.find(username);
-                if (it == users.end()) {
-                    send_json(client_fd, json{{"status","ERR"},{"detail","NO_SUCH_USER"}});
-                } else {
-                    int xp = extra.value("xp", 0);
-                    it->second.last_seen = chrono::steady_clock::now();
-                    it->second.online = true;
-                    save_db();
-                    send_json(client_fd, json{{"status","OK"},{"detail","STATUS_UPDATED"},{"experience", it->second.experience}});
-                }
-            } else if (cmd == "ONLINE_STATUS") {
-                string query_user = req.value("username", "");
-                lock_guard<mutex> g(db_m);
-                bool on = (users.find(query_user) != users.end()) ? users[query_user].online : false;
-                send_json(client_fd, {{"status","OK"},{"online", on}});
-            }else {
-                send_json(client_fd, json{{"status","ERR"},{"detail","UNKNOWN_CMD"}});
+            string out = handle_frame(s, frame);
+            {
+                lock_guard<mutex> g(sink->m);
+                if (!send_frame(client_fd, out)) break;
+                sink->format = s.format;
             }
+            rd.set_length_prefixed(s.format != WireFormat::Json);
         }
     } catch (...){
         cout << "[ERROR] Exception in client handler\n";
-        if (!users.empty()) {
-            lock_guard<mutex> g(db_m);
-            users[username].online = false;
-            save_db();
-        }
     }
+    on_disconnect(s);
     close(client_fd);
 }
 
-int main() {
+int make_listener(bool reuseport) {
+    int sock = socket(AF_INET, SOCK_STREAM | (reuseport ? SOCK_NONBLOCK : 0), 0);
+    if (sock < 0) { perror("socket"); return -1; }
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT"); close(sock); return -1;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(LOBBY_PORT);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(sock); return -1; }
+    if (listen(sock, SOMAXCONN) < 0) { perror("listen"); close(sock); return -1; }
+    return sock;
+}
+
+// Reactor mode: each worker owns a SO_REUSEPORT listener and an epoll set,
+// so the kernel spreads accepts across workers and no thread is ever spawned
+// per client. As in io_uring mode, a request that changed a user does not
+// hold up the loop while the log syncs: its reply is parked until the log
+// is durable, and the log's durability hook wakes the worker.
+struct Conn {
+    int fd;
+    uint64_t id = 0;  // tells a reused fd apart from the connection a push was meant for
+    FrameReader in;
+    string out;
+    size_t out_off = 0;
+    bool want_write = false;
+    Session s;
+    deque<Parked> parked;
+    // Closed by the client or the worker, but kept (fd open, out of epoll)
+    // until its parked replies' events can be published.
+    bool closing = false;
+};
+
+class ReactorWorker {
+public:
+    explicit ReactorWorker(int id) : id_(id) {}
+
+    // Queues a pushed message for one of this worker's connections. Safe to
+    // call from any thread; the worker encodes and sends it on its own loop.
+    void post(int fd, uint64_t conn_id, const json &event) {
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail_.push_back({fd, conn_id, event});
+        }
+        wake();
+    }
 
-    thread([&](){
+    // Makes the loop look at its mail and parked replies.
+    void wake() {
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+    }
+
+    void run() {
+        listen_fd_ = make_listener(true);
+        if (listen_fd_ < 0) {
+            cerr << "[ERROR] Reactor worker " << id_ << " has no listener\n";
+            return;
+        }
+        ep_ = epoll_create1(EPOLL_CLOEXEC);
+        if (ep_ < 0) { perror("epoll_create1"); return; }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd_;
+        epoll_ctl(ep_, EPOLL_CTL_ADD, listen_fd_, &ev);
+        ev.data.fd = wake_fd_;
+        epoll_ctl(ep_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+        vector<epoll_event> evs(256);
         while (true) {
-            this_thread::sleep_for(chrono::seconds(5));  
-            lock_guard<mutex> g(db_m);
-            auto now = chrono::steady_clock::now();
-            for (auto &[name,u] : users) {
-                if (u.online && chrono::duration_cast<chrono::seconds>(now - u.last_seen).count() > 10) {
-                    cout << "[LOBBY] Player " << name << " timed out, marking offline.\n";
-                    u.online = false;
-                    save_db();
+            int n = epoll_wait(ep_, evs.data(), (int)evs.size(), -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = evs[i].data.fd;
+                if (fd == listen_fd_) { accept_all(); continue; }
+                if (fd == wake_fd_) { on_wake(); continue; }
+                auto it = conns_.find(fd);
+                if (it == conns_.end()) continue;
+                Conn &c = it->second;
+                bool ok = true;
+                if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = on_readable(c);
+                if (ok && (evs[i].events & EPOLLOUT)) ok = flush(c);
+                if (!ok) close_conn(c);
+            }
+        }
+    }
+
+private:
+    struct Mail {
+        int fd;
+        uint64_t conn_id;
+        json event;
+    };
+
+    struct Sink : PushSink {
+        ReactorWorker *w;
+        int fd;
+        uint64_t conn_id;
+
+        Sink(ReactorWorker *w, int fd, uint64_t conn_id) : w(w), fd(fd), conn_id(conn_id) {}
+        void push(const json &event) override { w->post(fd, conn_id, event); }
+    };
+
+    void on_wake() {
+        uint64_t n;
+        if (read(wake_fd_, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+        vector<Mail> mail;
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail.swap(mail_);
+        }
+        for (auto &m : mail) {
+            auto it = conns_.find(m.fd);
+            if (it == conns_.end() || it->second.id != m.conn_id || it->second.closing) continue;
+            Conn &c = it->second;
+            string bytes = encode_frame(m.event, c.s.format);
+            if (c.parked.empty()) c.out += bytes;
+            else c.parked.push_back({0, move(bytes), json()});
+            if (!flush(c)) close_conn(c);
+        }
+        vector<int> fds(parked_fds_.begin(), parked_fds_.end());
+        for (int fd : fds) {
+            auto it = conns_.find(fd);
+            if (it == conns_.end()) { parked_fds_.erase(fd); continue; }
+            Conn &c = it->second;
+            bool ok = release_parked(c);
+            if (!ok) c.parked.clear();
+            if (c.closing) {
+                if (c.parked.empty()) finish_close(c);
+            } else if (!ok || !flush(c)) {
+                close_conn(c);
+            }
+        }
+    }
+
+    // Sends a reply now, or parks it if it or a reply ahead of it waits for
+    // the log.
+    void queue_reply(Conn &c, string bytes) {
+        if (!c.s.pending_seq && c.parked.empty()) {
+            c.out += bytes;
+            return;
+        }
+        c.parked.push_back({c.s.pending_seq, move(bytes), move(c.s.pending_event)});
+        c.s.pending_seq = 0;
+        c.s.pending_event = json();
+        parked_fds_.insert(c.fd);
+    }
+
+    // Moves replies whose log records are durable to the send queue, in
+    // order, and publishes their presence events. False once the log has
+    // failed with replies still parked: they will never be sent.
+    bool release_parked(Conn &c) {
+        uint64_t durable = wal.durable_seq();
+        while (!c.parked.empty() && c.parked.front().seq <= durable) {
+            Parked &p = c.parked.front();
+            c.out += p.bytes;
+            if (!p.event.is_null()) hub.publish(p.event);
+            c.parked.pop_front();
+        }
+        if (c.parked.empty()) parked_fds_.erase(c.fd);
+        return c.parked.empty() || !wal.failed();
+    }
+
+    void accept_all() {
+        while (true) {
+            int c = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (c < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+                return;
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = c;
+            if (epoll_ctl(ep_, EPOLL_CTL_ADD, c, &ev) < 0) { close(c); continue; }
+            Conn &conn = conns_[c];
+            conn.fd = c;
+            conn.id = ++next_conn_id_;
+            conn.in.reset(c);
+            conn.s.sink = make_shared<Sink>(this, c, conn.id);
+            conn.s.peer_ip = peer_ip_of(c);
+            conn.s.defer_durable = true;
+            connected_clients.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // A client may shut down its write side right after its last request;
+    // the answers to everything read before the EOF are still sent, here
+    // or, for parked ones, by finish_close().
+    bool on_readable(Conn &c) {
+        bool eof = false;
+        while (true) {
+            ssize_t n = c.in.fill();
+            if (n == 0) { eof = true; break; }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            string frame;
+            while (c.in.next_frame(frame)) {
+                try {
+                    queue_reply(c, handle_frame(c.s, frame));
+                    c.in.set_length_prefixed(c.s.format != WireFormat::Json);
+                } catch (...) {
+                    cout << "[ERROR] Exception in client handler\n";
+                    return false;
                 }
             }
+            if (c.in.overflowed()) return false;
         }
-    }).detach();
+        if (!c.parked.empty() && !release_parked(c)) return false;
+        return flush(c) && !eof;
+    }
 
-    load_db();
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) { perror("socket"); return 1; }
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    bool flush(Conn &c) {
+        while (c.out_off < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (n > 0) { c.out_off += n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        if (c.out_off == c.out.size()) { c.out.clear(); c.out_off = 0; }
+        bool want = !c.out.empty();
+        if (want != c.want_write) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP | (want ? (uint32_t)EPOLLOUT : 0u);
+            ev.data.fd = c.fd;
+            epoll_ctl(ep_, EPOLL_CTL_MOD, c.fd, &ev);
+            c.want_write = want;
+        }
+        return true;
+    }
+
+    // Parked replies and their events still go out, after the log has them
+    // and before the user goes offline; until then the connection stays,
+    // out of epoll, and on_wake() finishes it.
+    void close_conn(Conn &c) {
+        if (c.closing) return;
+        c.closing = true;
+        epoll_ctl(ep_, EPOLL_CTL_DEL, c.fd, nullptr);
+        if (!c.parked.empty() && wal.failed()) c.parked.clear();
+        if (c.parked.empty()) finish_close(c);
+    }
+
+    // Sends what the socket takes without blocking, then closes it.
+    void finish_close(Conn &c) {
+        int fd = c.fd;
+        while (c.out_off < c.out.size()) {
+            ssize_t n = send(fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) c.out_off += n;
+            else if (n < 0 && errno == EINTR) continue;
+            else break;
+        }
+        parked_fds_.erase(fd);
+        on_disconnect(c.s);
+        close(fd);
+        conns_.erase(fd);
+    }
+
+    int id_;
+    int listen_fd_ = -1;
+    int ep_ = -1;
+    int wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    uint64_t next_conn_id_ = 0;
+    unordered_map<int, Conn> conns_;
+    unordered_set<int> parked_fds_;
+    mutex mail_m_;
+    vector<Mail> mail_;
+};
+
+// Created before the log opens so its durability hook can wake them.
+vector<unique_ptr<ReactorWorker>> reactor_workers;
+
+// io_uring mode (--io uring): the same per-worker SO_REUSEPORT listener as
+// the reactors, but accept, recv and send are submitted to one ring per
+// worker, so a loop iteration is a single io_uring_enter() however many
+// connections it serves. Replies are copied into chunks of a registered
+// buffer and sent with WRITE_FIXED. A request that changed a user does not
+// hold up the loop while the log syncs: its reply is parked until the log
+// is durable, and later replies on that connection queue behind it.
+class UringWorker {
+public:
+    static const size_t CHUNK = 16 * 1024;
+    static const size_t CHUNKS = 256;
+
+    explicit UringWorker(int id) : id_(id) {}
+
+    // Whether this kernel can run a worker at all.
+    static bool supported() {
+        Uring r;
+        return r.init(8) && r.supports({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                        IORING_OP_WRITE_FIXED, IORING_OP_READ});
+    }
+
+    // Queues a pushed message for one of this worker's connections. Safe to
+    // call from any thread.
+    void post(uint64_t conn_id, const json &event) {
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail_.push_back({conn_id, event});
+        }
+        wake();
+    }
+
+    // Makes the loop look at its mail and parked replies.
+    void wake() {
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+
+    void run() {
+        listen_fd_ = make_listener(true);
+        if (listen_fd_ < 0) {
+            cerr << "[ERROR] io_uring worker " << id_ << " has no listener\n";
+            return;
+        }
+        // The ring waits for readiness itself; plain blocking fds keep every
+        // kernel from handing back EAGAIN.
+        fcntl(listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) & ~O_NONBLOCK);
+        if (!ring_.init(4096)) { perror("io_uring_setup"); return; }
+        chunk_mem_.reset(new char[CHUNK * CHUNKS]);
+        iovec iov{chunk_mem_.get(), CHUNK * CHUNKS};
+        if (ring_.register_buffers(&iov, 1)) {
+            for (size_t i = 0; i < CHUNKS; ++i) free_chunks_.push_back(i);
+        } else {
+            perror("[LOBBY] io_uring buffer registration, sending from the heap");
+        }
+        arm_accept();
+        arm_wake();
+        while (true) {
+            int r = ring_.submit(1);
+            if (r < 0 && r != -EBUSY) {
+                errno = -r;
+                perror("io_uring_enter");
+                return;
+            }
+            ring_.drain([this](uint64_t data, int res, unsigned){ complete(data, res); });
+        }
+    }
+
+private:
+    enum Op : uint64_t { OP_ACCEPT, OP_WAKE, OP_RECV, OP_SEND };
+
+    struct Mail {
+        uint64_t conn_id;
+        json event;
+    };
+
+    struct UConn {
+        int fd = -1;
+        uint64_t id = 0;
+        FrameReader in;
+        Session s;
+        string out;
+        deque<Parked> parked;
+        bool recv_busy = false, send_busy = false, closing = false;
+        // The send in flight: a registered chunk, or `sending` when no chunk
+        // was free.
+        int chunk = -1;
+        string sending;
+        const char *send_ptr = nullptr;
+        size_t send_len = 0, send_off = 0;
+    };
+
+    struct Sink : PushSink {
+        UringWorker *w;
+        uint64_t conn_id;
+
+        Sink(UringWorker *w, uint64_t conn_id) : w(w), conn_id(conn_id) {}
+        void push(const json &event) override { w->post(conn_id, event); }
+    };
+
+    static uint64_t tag(uint64_t id, Op op) { return id << 2 | op; }
+
+    io_uring_sqe *next_sqe() {
+        io_uring_sqe *e;
+        while (!(e = ring_.sqe())) ring_.submit(0);
+        return e;
+    }
+
+    void arm_accept() {
+        io_uring_sqe *e = next_sqe();
+        uring_prep(e, IORING_OP_ACCEPT, listen_fd_, nullptr, 0, 0, tag(0, OP_ACCEPT));
+        e->accept_flags = SOCK_CLOEXEC;
+    }
+
+    void arm_wake() {
+        uring_prep(next_sqe(), IORING_OP_READ, wake_fd_, &wake_buf_, sizeof(wake_buf_), 0, tag(0, OP_WAKE));
+    }
+
+    void arm_recv(UConn &c) {
+        size_t len;
+        char *p = c.in.recv_area(len);
+        uring_prep(next_sqe(), IORING_OP_RECV, c.fd, p, len, 0, tag(c.id, OP_RECV));
+        c.recv_busy = true;
+    }
+
+    void arm_send(UConn &c) {
+        io_uring_sqe *e = next_sqe();
+        const char *p = c.send_ptr + c.send_off;
+        size_t n = c.send_len - c.send_off;
+        if (c.chunk >= 0) {
+            uring_prep(e, IORING_OP_WRITE_FIXED, c.fd, p, n, (uint64_t)-1, tag(c.id, OP_SEND));
+            e->buf_index = 0;
+        } else {
+            uring_prep(e, IORING_OP_SEND, c.fd, p, n, 0, tag(c.id, OP_SEND));
+            e->msg_flags = MSG_NOSIGNAL;
+        }
+        c.send_busy = true;
+    }
+
+    // Starts sending whatever is ready unless a send is already in flight.
+    void start_send(UConn &c) {
+        if (c.send_busy || c.closing || c.out.empty()) return;
+        if (!free_chunks_.empty()) {
+            c.chunk = free_chunks_.back();
+            free_chunks_.pop_back();
+            char *buf = chunk_mem_.get() + c.chunk * CHUNK;
+            size_t n = min(c.out.size(), CHUNK);
+            memcpy(buf, c.out.data(), n);
+            c.out.erase(0, n);
+            c.send_ptr = buf;
+            c.send_len = n;
+        } else {
+            c.sending.swap(c.out);
+            c.out.clear();
+            c.send_ptr = c.sending.data();
+            c.send_len = c.sending.size();
+        }
+        c.send_off = 0;
+        arm_send(c);
+    }
+
+    void complete(uint64_t data, int res) {
+        Op op = (Op)(data & 3);
+        if (op == OP_ACCEPT) { on_accept(res); return; }
+        if (op == OP_WAKE) { on_wake(res); return; }
+        auto it = conns_.find(data >> 2);
+        if (it == conns_.end()) return;
+        UConn &c = it->second;
+        if (op == OP_RECV) {
+            c.recv_busy = false;
+            if (!c.closing) on_recv(c, res);
+        } else {
+            c.send_busy = false;
+            on_sent(c, res);
+        }
+        if (c.closing && c.fd < 0 && !c.recv_busy && !c.send_busy) {
+            parked_conns_.erase(c.id);
+            conns_.erase(it);
+        }
+    }
+
+    void on_accept(int res) {
+        arm_accept();
+        if (res < 0) {
+            errno = -res;
+            perror("io_uring accept");
+            return;
+        }
+        UConn &c = conns_[++next_conn_id_];
+        c.fd = res;
+        c.id = next_conn_id_;
+        c.in.reset(res);
+        c.s.sink = make_shared<Sink>(this, c.id);
+        c.s.peer_ip = peer_ip_of(res);
+        c.s.defer_durable = true;
+        connected_clients.fetch_add(1, memory_order_relaxed);
+        arm_recv(c);
+    }
+
+    void on_wake(int res) {
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            errno = -res;
+            perror("eventfd read");
+        }
+        arm_wake();
+        vector<Mail> mail;
+        {
+            lock_guard<mutex> g(mail_m_);
+            mail.swap(mail_);
+        }
+        for (auto &m : mail) {
+            auto it = conns_.find(m.conn_id);
+            if (it == conns_.end() || it->second.closing) continue;
+            UConn &c = it->second;
+            string bytes = encode_frame(m.event, c.s.format);
+            if (c.parked.empty()) c.out += bytes;
+            else c.parked.push_back({0, move(bytes), json()});
+            start_send(c);
+        }
+        uint64_t durable = wal.durable_seq();
+        for (auto pit = parked_conns_.begin(); pit != parked_conns_.end();) {
+            auto it = conns_.find(*pit);
+            if (it == conns_.end()) { pit = parked_conns_.erase(pit); continue; }
+            UConn &c = it->second;
+            release_parked(c, durable);
+            if (!c.parked.empty() && wal.failed()) {
+                c.parked.clear();
+                close_conn(c);
+            }
+            if (c.parked.empty() && c.closing && c.fd >= 0) finish_close(c);
+            start_send(c);
+            if (!c.parked.empty()) { ++pit; continue; }
+            pit = parked_conns_.erase(pit);
+            if (c.closing && c.fd < 0 && !c.recv_busy && !c.send_busy) conns_.erase(it);
+        }
+    }
+
+    // Moves replies whose log records are durable to the send queue, in
+    // order, and publishes their presence events. Once the log has failed,
+    // the rest never will be; their connection is closed unanswered.
+    void release_parked(UConn &c, uint64_t durable) {
+        while (!c.parked.empty() && c.parked.front().seq <= durable) {
+            Parked &p = c.parked.front();
+            if (!c.closing) c.out += p.bytes;
+            if (!p.event.is_null()) hub.publish(p.event);
+            c.parked.pop_front();
+        }
+    }
+
+    void on_recv(UConn &c, int res) {
+        if (res <= 0) {
+            if (res == -EINTR || res == -EAGAIN) { arm_recv(c); return; }
+            close_conn(c);
+            return;
+        }
+        c.in.commit(res);
+        string frame;
+        while (c.in.next_frame(frame)) {
+            string bytes;
+            try {
+                bytes = handle_frame(c.s, frame);
+                c.in.set_length_prefixed(c.s.format != WireFormat::Json);
+            } catch (...) {
+                cout << "[ERROR] Exception in client handler\n";
+                close_conn(c);
+                return;
+            }
+            uint64_t seq = c.s.pending_seq;
+            if (seq || !c.parked.empty()) {
+                c.parked.push_back({seq, move(bytes), move(c.s.pending_event)});
+                c.s.pending_seq = 0;
+                c.s.pending_event = json();
+                parked_conns_.insert(c.id);
+            } else {
+                c.out += bytes;
+            }
+        }
+        if (c.in.overflowed()) { close_conn(c); return; }
+        if (!c.parked.empty()) {
+            release_parked(c, wal.durable_seq());
+            if (!c.parked.empty() && wal.failed()) { close_conn(c); return; }
+        }
+        start_send(c);
+        arm_recv(c);
+    }
+
+    void on_sent(UConn &c, int res) {
+        if (res < 0 && (res == -EINTR || res == -EAGAIN)) res = 0;
+        if (res < 0 || c.closing) {
+            if (c.chunk >= 0) free_chunks_.push_back(c.chunk);
+            c.chunk = -1;
+            close_conn(c);
+            return;
+        }
+        c.send_off += res;
+        if (c.send_off < c.send_len) { arm_send(c); return; }
+        if (c.chunk >= 0) free_chunks_.push_back(c.chunk);
+        c.chunk = -1;
+        c.sending.clear();
+        start_send(c);
+    }
+
+    // Shutting the socket down completes whatever is still in flight on it;
+    // the connection is dropped once nothing is. Parked replies will not be
+    // sent, but their events still have to go out, after the log has them
+    // and before the user goes offline, so until then on_wake() holds back
+    // the rest of the close instead of the ring waiting for the log.
+    void close_conn(UConn &c) {
+        if (c.closing) return;
+        c.closing = true;
+        if (!c.parked.empty() && wal.failed()) c.parked.clear();
+        shutdown(c.fd, SHUT_RDWR);
+        if (c.parked.empty()) finish_close(c);
+    }
+
+    void finish_close(UConn &c) {
+        on_disconnect(c.s);
+        close(c.fd);
+        c.fd = -1;
+    }
+
+    int id_;
+    int listen_fd_ = -1;
+    int wake_fd_ = eventfd(0, EFD_CLOEXEC);
+    uint64_t wake_buf_ = 0;
+    Uring ring_;
+    unique_ptr<char[]> chunk_mem_;
+    vector<int> free_chunks_;
+    uint64_t next_conn_id_ = 0;
+    unordered_map<uint64_t, UConn> conns_;
+    unordered_set<uint64_t> parked_conns_;
+    mutex mail_m_;
+    vector<Mail> mail_;
+};
+
+// Created before the log opens so its durability hook can wake them.
+vector<unique_ptr<UringWorker>> uring_workers;
+
+// Binds the UDP heartbeat port. -1 (and heartbeats over STATUS only) if
+// the port is taken.
+int open_heartbeat_port(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    // Bursts after a restart arrive all at once; keep them for the batch.
+    int rcvbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(LOBBY_PORT);
-    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(sock, 10) < 0) { perror("listen"); return 1; }
+    addr.sin_port = htons(port);
+    if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("[LOBBY] heartbeat port");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Lift the fd limit as far as the hard limit allows; each client is one fd.
+void raise_fd_limit() {
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char** argv) {
+    bool thread_mode = false;
+    bool convert_db = false;
+    bool use_uring = false;
+    bool timeout_set = false;
+    int hb_port = LOBBY_PORT;
+    int workers = (int)thread::hardware_concurrency();
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--threads") thread_mode = true;
+        else if (a == "--workers" && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (a == "--timeout-ms" && i + 1 < argc) {
+            presence_timeout = ticks_of(chrono::milliseconds(atoi(argv[++i])));
+            timeout_set = true;
+        }
+        else if (a == "--heartbeat-ms" && i + 1 < argc) heartbeat_ms = max(1, atoi(argv[++i]));
+        else if (a == "--hb-port" && i + 1 < argc) hb_port = atoi(argv[++i]);
+        else if (a == "--tick-ms" && i + 1 < argc) presence_tick = ticks_of(chrono::milliseconds(atoi(argv[++i])));
+        else if (a == "--store" && i + 1 < argc) mmap_store = string(argv[++i]) == "mmap";
+        else if (a == "--convert-db") convert_db = mmap_store = true;
+        else if (a == "--io" && i + 1 < argc) use_uring = string(argv[++i]) == "uring";
+        else {
+            cerr << "Usage: " << argv[0] << " [--threads] [--workers N] [--timeout-ms MS] [--tick-ms MS]"
+                 << " [--store json|mmap] [--convert-db] [--io epoll|uring] [--heartbeat-ms MS] [--hb-port N]\n";
+            return 1;
+        }
+    }
+    if (workers < 1) workers = 1;
+    // Unless told otherwise, a player may miss one heartbeat.
+    if (!timeout_set) presence_timeout = ticks_of(chrono::milliseconds(2 * heartbeat_ms));
+    if (presence_tick <= 0) presence_tick = ticks_of(chrono::milliseconds(1));
+    if (presence_timeout < presence_tick) presence_timeout = presence_tick;
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    presence_wheel.reset(new TimerWheel(presence_tick, presence_timeout / presence_tick + 1, steady_ticks()));
+    register_metrics();
+    if (use_uring && !UringWorker::supported()) {
+        cerr << "[LOBBY] io_uring is not available on this kernel, using epoll\n";
+        use_uring = false;
+    }
+    if (use_uring) {
+        wal.use_uring(true);
+        if (!thread_mode) {
+            for (int i = 0; i < workers; ++i) uring_workers.emplace_back(new UringWorker(i));
+            wal.set_durable_hook([]{ for (auto &w : uring_workers) w->wake(); });
+        }
+    } else if (!thread_mode) {
+        for (int i = 0; i < workers; ++i) reactor_workers.emplace_back(new ReactorWorker(i));
+        wal.set_durable_hook([]{ for (auto &w : reactor_workers) w->wake(); });
+    }
+    load_db();
+    // One-shot conversion: whatever load_db() found is written out as a
+    // users.db snapshot for --store mmap.
+    if (convert_db) {
+        uint64_t seq = wal.last_seq();
+        if (!save_db(users.snapshot(), seq)) return 1;
+        cout << "[LOBBY] Wrote " << users.size() << " users to " << BIN_DB_FILE << " at seq " << seq << endl;
+        return 0;
+    }
+    // Presence is not stored, so everyone starts offline until their next
+    // LOGIN or STATUS.
+
+    if (hb_port > 0) {
+        int hb = open_heartbeat_port(hb_port);
+        if (hb >= 0) {
+            heartbeat_port = hb_port;
+            thread(serve_heartbeats, hb).detach();
+        }
+    }
+
+    thread([](){
+        while (true) {
+            this_thread::sleep_for(chrono::steady_clock::duration(presence_tick));
+            expire_presence();
+        }
+    }).detach();
+
+    // Compacts when the log has grown, and otherwise banks heartbeat xp
+    // every XP_BANK_INTERVAL; a compaction banks it too.
+    thread([](){
+        auto next_bank = chrono::steady_clock::now() + XP_BANK_INTERVAL;
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(5));
+            if (wal.bytes() >= max(COMPACT_MIN_BYTES, snapshot_bytes.load())) compact_db();
+            else if (chrono::steady_clock::now() >= next_bank) bank_all_xp();
+            else continue;
+            next_bank = chrono::steady_clock::now() + XP_BANK_INTERVAL;
+        }
+    }).detach();
+
+    if (!uring_workers.empty()) {
+        vector<thread> pool;
+        for (auto &w : uring_workers) pool.emplace_back([w = w.get()](){ w->run(); });
+        cout << "Lobby server listening on port " << LOBBY_PORT << " (" << workers << " io_uring workers)" << endl;
+        for (auto &t : pool) t.join();
+        return 1;
+    }
+
+    if (!thread_mode) {
+        // Workers outlive their threads: connections hand out pointers to
+        // them for pushes.
+        vector<thread> pool;
+        for (auto &w : reactor_workers) pool.emplace_back([w = w.get()](){ w->run(); });
+        cout << "Lobby server listening on port " << LOBBY_PORT << " (" << workers << " workers)" << endl;
+        for (auto &t : pool) t.join();
+        return 1;
+    }
+
+    int sock = make_listener(false);
+    if (sock < 0) return 1;
     cout << "Lobby server listening on port " << LOBBY_PORT << endl;
     while (true) {
         sockaddr_in cli{};
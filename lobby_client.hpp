@@ -0,0 +1,322 @@
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "json.hpp"
+#include "frame_reader.hpp"
+#include "wire.hpp"
+#include "heartbeat.hpp"
+
+// Long-lived connection to the lobby shared by every thread of a player.
+//
+// Each request is tagged with an "id" that the lobby echoes back, so any
+// number of requests can be in flight on the one socket and replies are
+// matched no matter the order they arrive in. A background thread owns the
+// reads; when the connection drops it fails the outstanding requests and
+// reconnects with exponential backoff.
+//
+// Right after connecting the client sends HELLO offering the binary wire
+// formats; lobbies that do not know HELLO answer UNKNOWN_CMD and the
+// connection stays on JSON lines.
+//
+// Messages the lobby pushes on its own (they carry "event" instead of
+// "id") go to the on_push() handler. Presence subscriptions are replayed
+// on every reconnect, and the lobby answers each with the current state.
+class LobbyClient {
+public:
+    LobbyClient(const std::string &host, int port, bool binary = true)
+        : host_(host), port_(port), binary_(binary) {
+        reader_ = std::thread([this]{ run(); });
+    }
+
+    ~LobbyClient() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            if (stopping_) return;
+            stopping_ = true;
+            if (fd_ >= 0) shutdown(fd_, SHUT_RDWR);
+        }
+        cv_.notify_all();
+        if (reader_.joinable()) reader_.join();
+    }
+
+    // Sends req and waits for the matching reply. Returns a null json if
+    // the lobby cannot be reached or does not answer within timeout_ms.
+    nlohmann::json request(nlohmann::json req, int timeout_ms = 5000) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        auto slot = std::make_shared<Pending>();
+        uint64_t id;
+        {
+            std::unique_lock<std::mutex> lk(m_);
+            if (!cv_.wait_until(lk, deadline, [&]{ return fd_ >= 0 || stopping_; }) || stopping_) {
+                return nlohmann::json();
+            }
+        }
+        {
+            // write_m_ is held across the send so the reader cannot close
+            // (and the kernel cannot reuse) the fd underneath us.
+            std::lock_guard<std::mutex> w(write_m_);
+            int fd;
+            WireFormat fmt;
+            {
+                std::lock_guard<std::mutex> g(m_);
+                if (fd_ < 0) return nlohmann::json();
+                fd = fd_;
+                fmt = format_;
+                id = next_id_++;
+                pending_[id] = slot;
+            }
+            req["id"] = id;
+            if (!send_all(fd, encode_frame(req, fmt))) {
+                std::lock_guard<std::mutex> g(m_);
+                pending_.erase(id);
+                return nlohmann::json();
+            }
+        }
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait_until(lk, deadline, [&]{ return slot->done; });
+        pending_.erase(id);
+        return slot->reply;
+    }
+
+    // Installs the handler for pushed events; pass nullptr to remove it.
+    // Returns once no call to the previous handler is still running, so a
+    // handler may capture locals of the caller's scope.
+    void on_push(std::function<void(const nlohmann::json&)> fn) {
+        std::lock_guard<std::mutex> g(push_m_);
+        on_push_ = std::move(fn);
+    }
+
+    // Asks the lobby to push PRESENCE events for user. False if the lobby
+    // does not support subscriptions, in which case callers should poll.
+    bool subscribe(const std::string &user) {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            watched_.insert(user);
+        }
+        nlohmann::json r = request({{"cmd","SUBSCRIBE"},{"username",user}});
+        return r.is_object() && r.value("status", "") == "OK";
+    }
+
+    void unsubscribe(const std::string &user) {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            watched_.erase(user);
+        }
+        request({{"cmd","UNSUBSCRIBE"},{"username",user}});
+    }
+
+private:
+    struct Pending {
+        bool done = false;
+        nlohmann::json reply;
+    };
+
+    static bool send_all(int fd, const std::string &s) {
+        size_t off = 0;
+        while (off < s.size()) {
+            ssize_t n = send(fd, s.data() + off, s.size() - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            off += n;
+        }
+        return true;
+    }
+
+    // Agrees on a wire format for a fresh connection. JSON if the lobby
+    // predates HELLO; -1 if the connection failed.
+    int hello(int fd, FrameReader &rd, WireFormat &fmt) {
+        fmt = WireFormat::Json;
+        if (!binary_) return 0;
+        nlohmann::json req = {{"cmd","HELLO"},{"formats",wire_offer()}};
+        if (!send_all(fd, encode_frame(req, WireFormat::Json))) return -1;
+        std::string line;
+        if (rd.read_frame(line) <= 0) return -1;
+        try {
+            nlohmann::json reply = nlohmann::json::parse(line);
+            if (reply.value("status", "") == "OK") wire_from_name(reply.value("format", "json"), fmt);
+        } catch (...) {}
+        rd.set_length_prefixed(fmt != WireFormat::Json);
+        return 0;
+    }
+
+    int connect_once() {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s < 0) return -1;
+        // Bounds how long connect() and send() may block.
+        timeval tv{3, 0};
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_);
+        inet_pton(AF_INET, host_.c_str(), &addr.sin_addr);
+        if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
+        return s;
+    }
+
+    void run() {
+        std::mt19937 rng(std::random_device{}());
+        int backoff_ms = 100;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> g(m_);
+                if (stopping_) return;
+            }
+            int fd = connect_once();
+            FrameReader rd(fd);
+            WireFormat fmt = WireFormat::Json;
+            if (fd >= 0 && hello(fd, rd, fmt) < 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd < 0) {
+                // Jitter keeps a fleet of players from reconnecting in lockstep.
+                int wait_ms = backoff_ms / 2 + (int)(rng() % (backoff_ms / 2 + 1));
+                backoff_ms = std::min(backoff_ms * 2, 5000);
+                std::unique_lock<std::mutex> lk(m_);
+                cv_.wait_for(lk, std::chrono::milliseconds(wait_ms), [&]{ return stopping_; });
+                continue;
+            }
+            backoff_ms = 100;
+            {
+                std::lock_guard<std::mutex> g(m_);
+                if (stopping_) { close(fd); return; }
+                // Untagged, so the replies are dropped; the events that
+                // follow carry the state.
+                for (auto &user : watched_) {
+                    send_all(fd, encode_frame({{"cmd","SUBSCRIBE"},{"username",user}}, fmt));
+                }
+                fd_ = fd;
+                format_ = fmt;
+            }
+            cv_.notify_all();
+
+            std::string frame;
+            while (rd.read_frame(frame) > 0) {
+                nlohmann::json msg;
+                try { msg = decode_payload(frame, fmt); } catch (...) { continue; }
+                if (!msg.is_object()) continue;
+                if (msg.contains("event")) {
+                    std::lock_guard<std::mutex> g(push_m_);
+                    if (on_push_) on_push_(msg);
+                    continue;
+                }
+                if (!msg.contains("id") || !msg["id"].is_number_unsigned()) continue;
+                uint64_t id = msg["id"].get<uint64_t>();
+                msg.erase("id");
+                std::lock_guard<std::mutex> g(m_);
+                auto it = pending_.find(id);
+                if (it == pending_.end()) continue;
+                it->second->reply = std::move(msg);
+                it->second->done = true;
+                cv_.notify_all();
+            }
+
+            {
+                std::lock_guard<std::mutex> w(write_m_);
+                std::lock_guard<std::mutex> g(m_);
+                fd_ = -1;
+                close(fd);
+                for (auto &kv : pending_) kv.second->done = true;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    std::string host_;
+    int port_;
+    bool binary_;
+    WireFormat format_ = WireFormat::Json;
+    std::mutex m_;        // fd_, format_, pending_, watched_, next_id_, stopping_
+    std::mutex write_m_;  // serializes sends; taken before m_
+    std::condition_variable cv_;
+    int fd_ = -1;
+    uint64_t next_id_ = 1;
+    bool stopping_ = false;
+    std::unordered_map<uint64_t, std::shared_ptr<Pending>> pending_;
+    std::set<std::string> watched_;
+    std::mutex push_m_;
+    std::function<void(const nlohmann::json&)> on_push_;
+    std::thread reader_;
+};
+
+// Keeps a player marked online. While the lobby has handed out a token and
+// a heartbeat port, every interval costs one datagram; otherwise, or once
+// the lobby calls the token stale, it sends a STATUS request through
+// status() instead. Interval, port and token come from the replies, so the
+// lobby decides how often players check in.
+class Heartbeater {
+public:
+    using StatusFn = std::function<nlohmann::json()>;
+
+    Heartbeater(const std::string &host, const std::string &user, StatusFn status)
+        : host_(host), user_(user), status_(std::move(status)) {}
+    ~Heartbeater() { stop(); }
+
+    void start() { thread_ = std::thread([this]{ run(); }); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> g(m_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // Sends STATUS right away, e.g. because what it reports has changed.
+    void status_now() { adopt(status_()); }
+
+    // Takes the heartbeat settings from a LOGIN or STATUS reply.
+    void adopt(const nlohmann::json &reply) {
+        if (!reply.is_object() || reply.value("status", "") != "OK") return;
+        std::lock_guard<std::mutex> g(m_);
+        interval_ms_ = std::max(1, reply.value("heartbeat_ms", interval_ms_));
+        port_ = reply.value("heartbeat_port", 0);
+        token_ = reply.value("token", (uint64_t)0);
+    }
+
+private:
+    void run() {
+        HeartbeatSocket sock;
+        int open_port = 0;
+        std::unique_lock<std::mutex> lk(m_);
+        while (!cv_.wait_for(lk, std::chrono::milliseconds(interval_ms_), [&]{ return stopping_; })) {
+            int port = port_;
+            uint64_t token = token_;
+            lk.unlock();
+            if (port != open_port) open_port = sock.open(host_, port) ? port : 0;
+            if (open_port && token && !sock.stale(token)) sock.beat(user_, token);
+            else status_now();
+            lk.lock();
+        }
+    }
+
+    std::string host_, user_;
+    StatusFn status_;
+    std::mutex m_;  // guards everything below
+    std::condition_variable cv_;
+    int interval_ms_ = 5000;
+    int port_ = 0;
+    uint64_t token_ = 0;
+    bool stopping_ = false;
+    std::thread thread_;
+};
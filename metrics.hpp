@@ -0,0 +1,207 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "histogram.hpp"
+#include "json.hpp"
+
+// Process-wide counters, histograms and gauges, cheap enough to leave on.
+//
+// Writers record into one of a fixed set of shards, picked per thread on
+// first use, so busy threads do not share a lock or a cache line. Each
+// shard's mutex is only ever contended by a reader, which merges all
+// shards. The shard count is fixed rather than one per thread so the
+// thread-per-connection mode does not multiply histogram memory.
+//
+// Names are registered up front (counter(), histogram(), gauge()) and the
+// returned id is used on the hot path. A name may carry Prometheus labels,
+// e.g. lobby_requests_total{cmd="LOGIN"}. Ids live in fixed per-shard
+// arrays; a name registered past MAX_COUNTERS or MAX_HISTOGRAMS gets id -1,
+// which add() and record() ignore, like the -1 of a metric never
+// registered.
+class Metrics {
+public:
+    static const int MAX_COUNTERS = 64;
+    static const int MAX_HISTOGRAMS = 32;
+
+    static Metrics &get() {
+        static Metrics m;
+        return m;
+    }
+
+    int counter(const std::string &name) {
+        std::lock_guard<std::mutex> g(reg_m_);
+        if (counter_names_.size() >= MAX_COUNTERS) return rejected("counter", name);
+        counter_names_.push_back(name);
+        return (int)counter_names_.size() - 1;
+    }
+
+    int histogram(const std::string &name) {
+        std::lock_guard<std::mutex> g(reg_m_);
+        if (hist_names_.size() >= MAX_HISTOGRAMS) return rejected("histogram", name);
+        hist_names_.push_back(name);
+        return (int)hist_names_.size() - 1;
+    }
+
+    // Gauges are sampled by calling fn when the metrics are read.
+    void gauge(const std::string &name, std::function<double()> fn) {
+        std::lock_guard<std::mutex> g(reg_m_);
+        gauges_.push_back({name, std::move(fn)});
+    }
+
+    void add(int id, uint64_t n = 1) {
+        if ((unsigned)id >= MAX_COUNTERS) return;
+        Shard &s = local();
+        std::lock_guard<std::mutex> g(s.m);
+        s.counters[id] += n;
+    }
+
+    void record(int id, uint64_t v) {
+        if ((unsigned)id >= MAX_HISTOGRAMS) return;
+        Shard &s = local();
+        std::lock_guard<std::mutex> g(s.m);
+        if (!s.hists[id]) s.hists[id].reset(new Histogram());
+        s.hists[id]->record(v);
+    }
+
+    uint64_t counter_value(int id) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < nshards_; ++i) {
+            std::lock_guard<std::mutex> g(shards_[i].m);
+            total += shards_[i].counters[id];
+        }
+        return total;
+    }
+
+    Histogram histogram_value(int id) const {
+        Histogram total;
+        for (size_t i = 0; i < nshards_; ++i) {
+            std::lock_guard<std::mutex> g(shards_[i].m);
+            if (shards_[i].hists[id]) total.merge(*shards_[i].hists[id]);
+        }
+        return total;
+    }
+
+    std::vector<std::string> counter_names() const {
+        std::lock_guard<std::mutex> g(reg_m_);
+        return counter_names_;
+    }
+
+    std::vector<std::string> histogram_names() const {
+        std::lock_guard<std::mutex> g(reg_m_);
+        return hist_names_;
+    }
+
+    std::vector<std::pair<std::string, double>> gauge_values() const {
+        std::vector<std::pair<std::string, std::function<double()>>> gs;
+        {
+            std::lock_guard<std::mutex> g(reg_m_);
+            gs = gauges_;
+        }
+        std::vector<std::pair<std::string, double>> out;
+        for (auto &g : gs) out.push_back({g.first, g.second()});
+        return out;
+    }
+
+private:
+    struct alignas(64) Shard {
+        mutable std::mutex m;
+        uint64_t counters[MAX_COUNTERS] = {};
+        std::unique_ptr<Histogram> hists[MAX_HISTOGRAMS];
+    };
+
+    Metrics() {
+        size_t n = 1;
+        while (n < 2 * std::max(1u, std::thread::hardware_concurrency())) n <<= 1;
+        nshards_ = n;
+        shards_.reset(new Shard[n]);
+    }
+
+    static int rejected(const char *kind, const std::string &name) {
+        std::cerr << "[ERROR] Too many metrics, not registering " << kind << " " << name << "\n";
+        return -1;
+    }
+
+    Shard &local() {
+        thread_local size_t idx = next_.fetch_add(1, std::memory_order_relaxed) & (nshards_ - 1);
+        return shards_[idx];
+    }
+
+    mutable std::mutex reg_m_;
+    std::vector<std::string> counter_names_;
+    std::vector<std::string> hist_names_;
+    std::vector<std::pair<std::string, std::function<double()>>> gauges_;
+
+    std::unique_ptr<Shard[]> shards_;
+    size_t nshards_ = 1;
+    std::atomic<size_t> next_{0};
+};
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Records the lifetime of the scope, in ns, into a histogram.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(int hist) : hist_(hist), t0_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { Metrics::get().record(hist_, elapsed_ns(t0_)); }
+
+private:
+    int hist_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+// All metrics as one JSON object keyed by metric name.
+inline nlohmann::json metrics_json(const Metrics &m) {
+    nlohmann::json counters = nlohmann::json::object(), gauges = nlohmann::json::object(),
+                   hists = nlohmann::json::object();
+    auto cn = m.counter_names();
+    for (size_t i = 0; i < cn.size(); ++i) counters[cn[i]] = m.counter_value(i);
+    for (auto &g : m.gauge_values()) gauges[g.first] = g.second;
+    auto hn = m.histogram_names();
+    for (size_t i = 0; i < hn.size(); ++i) {
+        Histogram h = m.histogram_value(i);
+        hists[hn[i]] = {{"count", h.count()}, {"sum", h.sum()}, {"mean", h.mean()},
+                        {"p50", h.percentile(0.5)}, {"p90", h.percentile(0.9)},
+                        {"p99", h.percentile(0.99)}, {"p999", h.percentile(0.999)},
+                        {"max", h.max()}};
+    }
+    return {{"counters", counters}, {"gauges", gauges}, {"histograms", hists}};
+}
+
+// Prometheus text exposition; histograms are written as summaries.
+inline std::string metrics_text(const Metrics &m) {
+    // name{a="1"} + suffix/label -> name_suffix{a="1",label}
+    auto compose = [](const std::string &name, const std::string &suffix, const std::string &label) {
+        size_t brace = name.find('{');
+        std::string base = name.substr(0, brace) + suffix;
+        std::string labels = brace == std::string::npos ? "" : name.substr(brace + 1, name.size() - brace - 2);
+        if (!label.empty()) labels += (labels.empty() ? "" : ",") + label;
+        return labels.empty() ? base : base + "{" + labels + "}";
+    };
+    std::ostringstream os;
+    auto cn = m.counter_names();
+    for (size_t i = 0; i < cn.size(); ++i) os << cn[i] << " " << m.counter_value(i) << "\n";
+    for (auto &g : m.gauge_values()) os << g.first << " " << g.second << "\n";
+    auto hn = m.histogram_names();
+    for (size_t i = 0; i < hn.size(); ++i) {
+        Histogram h = m.histogram_value(i);
+        for (const char *q : {"0.5", "0.9", "0.99", "0.999"}) {
+            os << compose(hn[i], "", std::string("quantile=\"") + q + "\"") << " "
+               << h.percentile(std::stod(q)) << "\n";
+        }
+        os << compose(hn[i], "_sum", "") << " " << h.sum() << "\n";
+        os << compose(hn[i], "_count", "") << " " << h.count() << "\n";
+    }
+    return os.str();
+}
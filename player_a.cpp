@@ -1,15 +1,27 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <poll.h>
 #include <cstring>
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <functional>
+#include <unordered_set>
 #include <atomic>
 #include <chrono>
 #include "json.hpp"
+#include "frame_reader.hpp"
+#include "lobby_client.hpp"
+#include "game_sync.hpp"
+#include "game_channel.hpp"
+#include "wire.hpp"
+#include "game.hpp"
+#include "ai.hpp"
 
 using json = nlohmann::json;
 using namespace std;
@@ -20,6 +32,8 @@ const string LOBBY_HOST = "140.113.17.14";
 const int LOBBY_PORT = 12000;
 const int UDP_PORT_MIN = 17000;
 const int UDP_PORT_MAX = 17010;
+// How long a discovery round listens for CHECK_RESPONSEs.
+const int PROBE_WINDOW_MS = 500;
 
 bool send_udp_json(int sock, const sockaddr_in &to, const json &j) {
     string s = j.dump();
@@ -41,6 +55,84 @@ bool recv_udp_json(int sock, json &out, sockaddr_in &from, int timeout_ms) {
     return true;
 }
 
+sockaddr_in make_addr(const string &ip, int port) {
+    sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    inet_pton(AF_INET, ip.c_str(), &a.sin_addr);
+    return a;
+}
+
+// Sends CHECK to every target with sendmmsg() and gathers replies with
+// recvmmsg() until the window closes, so a round costs one RTT plus the
+// window rather than a timeout per target. A reply counts only if it
+// echoes our nonce and comes from an address we probed; on_found sees each
+// one as soon as it arrives.
+vector<pair<sockaddr_in, json>> probe_all(int sock, const vector<sockaddr_in> &targets, const json &check,
+                                          int window_ms, const function<void(const sockaddr_in&, const json&)> &on_found) {
+    string payload = check.dump();
+    vector<iovec> iov(targets.size());
+    vector<mmsghdr> out(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        iov[i] = {(void*)payload.data(), payload.size()};
+        out[i] = {};
+        out[i].msg_hdr.msg_name = (void*)&targets[i];
+        out[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        out[i].msg_hdr.msg_iov = &iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
+    size_t sent = 0;
+    while (sent < targets.size()) {
+        int n = sendmmsg(sock, out.data() + sent, targets.size() - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[DEBUG] sendmmsg");
+            ++sent;  // the error belongs to the first message; skip it
+            continue;
+        }
+        sent += n;
+    }
+
+    auto key = [](const sockaddr_in &a){ return ((uint64_t)a.sin_addr.s_addr << 16) | a.sin_port; };
+    unordered_set<uint64_t> probed, seen;
+    for (auto &t : targets) probed.insert(key(t));
+
+    const int BATCH = 16;
+    vector<array<char, 4096>> bufs(BATCH);
+    vector<iovec> riov(BATCH);
+    vector<sockaddr_in> src(BATCH);
+    vector<mmsghdr> in(BATCH);
+    int nonce = check.value("nonce", 0);
+    vector<pair<sockaddr_in, json>> found;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(window_ms);
+    while (seen.size() < probed.size()) {
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0) break;
+        pollfd p{sock, POLLIN, 0};
+        if (poll(&p, 1, (int)left) <= 0) continue;
+        for (int i = 0; i < BATCH; ++i) {
+            riov[i] = {bufs[i].data(), bufs[i].size()};
+            in[i] = {};
+            in[i].msg_hdr.msg_name = &src[i];
+            in[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            in[i].msg_hdr.msg_iov = &riov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(sock, in.data(), BATCH, MSG_DONTWAIT, nullptr);
+        for (int i = 0; i < n; ++i) {
+            json reply;
+            try { reply = json::parse(string(bufs[i].data(), in[i].msg_len)); } catch (...) { continue; }
+            if (!reply.is_object() || reply.value("type","") != "CHECK_RESPONSE") continue;
+            if (reply.value("nonce",0) != nonce || reply.value("status","") != "ONLINE") continue;
+            uint64_t k = key(src[i]);
+            if (!probed.count(k) || !seen.insert(k).second) continue;
+            found.push_back({src[i], reply});
+            on_found(src[i], reply);
+        }
+    }
+    return found;
+}
+
 bool send_tcp_json(int fd, const json &j) {
     string s = j.dump(); s.push_back('\n');
     ssize_t total=0; const char* data = s.c_str(); ssize_t tosend = s.size();
@@ -52,92 +144,73 @@ bool send_tcp_json(int fd, const json &j) {
     return true;
 }
 
-bool recv_tcp_line(int fd, string &out) {
-    out.clear();
-    char c;
-    while (true) {
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n==0) {
-            cout<<"[ERROR] Connection closed by peer\n";
-        }
-        if (n < 0){
-            cout<<"[ERROR] recv() failed\n";
-            return false;
-        }
-        if (c == '\n') break;
-        out.push_back(c);
-    }
-    return true;
+bool recv_tcp_line(FrameReader &rd, string &out) {
+    int r = rd.read_frame(out);
+    if (r == 0) cout<<"[ERROR] Connection closed by peer\n";
+    if (r < 0) cout<<"[ERROR] recv() failed\n";
+    return r > 0;
 }
 
-json lobby_request(const json &req) {
-    //cout << "[DEBUG] Creating socket...\n";
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) { perror("[DEBUG] socket failed"); return json(); }
-    sockaddr_in addr{}; 
-    addr.sin_family = AF_INET; 
-    addr.sin_port = htons(LOBBY_PORT);
-    inet_pton(AF_INET, LOBBY_HOST.c_str(), &addr.sin_addr);
-    //cout << "[DEBUG] Connecting to lobby " << LOBBY_HOST << ":" << LOBBY_PORT << "...\n";
-    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("[DEBUG] connect failed"); close(s); return json(); }
-    //cout << "[DEBUG] Connected successfully.\n";
-    string out = req.dump(); out.push_back('\n'); 
-    //cout << "[DEBUG] Sending JSON request: " << out;
-    ssize_t sent = send(s, out.c_str(), out.size(), 0);
-    if (sent != (ssize_t)out.size()) {
-        perror("[DEBUG] send failed");
-        close(s);
-        return json();
-    }
-    //cout << "[DEBUG] Sent " << sent << " bytes.\n";
-    string response;
-    char buf[1024];
-     //cout << "[DEBUG] Receiving response...\n";
-    while (true) {
-        ssize_t n = recv(s, buf, sizeof(buf), 0);
-        //cout << "[DEBUG] recv returned: " << n << endl;
-        if (n <= 0) break;               // disconnected or error
-        response.append(buf, n);
-        //cout << "[DEBUG] Current response buffer: " << response << endl;
-        if (response.find('\n') != string::npos){
-            //cout << "[DEBUG] Newline found in response.\n";
-            break;
-        }
-    }
-    close(s);
-
-    size_t pos = response.find('\n');
-    if (pos != string::npos) response = response.substr(0, pos);
+// One connection to the lobby for the whole process; heartbeats, polls and
+// the interactive login all share it.
+LobbyClient lobby(LOBBY_HOST, LOBBY_PORT);
 
-    //cout << "[DEBUG] Server replied: " << response << endl;  
-
-    try { return json::parse(response); }
-    catch (...) { return json(); }
+json lobby_request(const json &req) {
+    return lobby.request(req);
 }
 
 
 
-void print_board(const vector<string>& b) {
-    cout << "\nBoard:\n";
-    for (int r=0;r<3;++r) {
-        for (int c=0;c<3;++c) {
-            cout << (b[3*r+c].empty()? "." : b[3*r+c]) << (c<2? " " : "");
-        }
-        cout << "\n";
+// Gets X's move from the AI if there is one, otherwise from the keyboard.
+int choose_move(const Game &game, Ai *ai) {
+    game.print(cout);
+    int pos = -1;
+    if (ai) {
+        pos = ai->choose(game);
+        cout << "[AI] Plays " << pos << " (depth " << ai->last_depth() << ", "
+             << ai->last_nodes() << " nodes)\n";
     }
-}
-
-int check_tictactoe(const vector<string>& b) {
-    vector<array<int,3>> lines = {{0,1,2},{3,4,5},{6,7,8},{0,3,6},{1,4,7},{2,5,8},{0,4,8},{2,4,6}};
-    for (auto &ln : lines) {
-        string a=b[ln[0]], c=b[ln[1]], d=b[ln[2]];
-        if (!a.empty() && a==c && c==d) return (a=="X"? 1 : 2);
+    while (!game.legal(pos)) {
+        cout << "Your move (0-" << game.cells() - 1 << "): ";
+        string s; getline(cin, s);
+        try { pos = stoi(s); } catch(...) { continue; }
     }
-    if (all_of(b.begin(), b.end(), [](const string &s){ return !s.empty(); })) return 3;
-    return 0;
+    return pos;
 }
 
-int main(){
+int main(int argc, char** argv){
+    // Board variant for the games this player hosts, e.g. --size 15 --win 5.
+    // --ai lets the computer play X and invite the first PlayerB found.
+    int board_size = 3, win_len = 3;
+    bool ai_mode = false;
+    string game_host_ip;
+    int game_host_port = 0;
+    // --udp-game plays over a reliable channel on the invite socket instead
+    // of a TCP connection, when the invited PlayerB supports it.
+    bool udp_game = false;
+    int ai_ms = 1000, ai_threads = (int)max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--size" && i + 1 < argc) board_size = atoi(argv[++i]);
+        else if (a == "--win" && i + 1 < argc) win_len = atoi(argv[++i]);
+        else if (a == "--ai") ai_mode = true;
+        else if (a == "--udp-game") udp_game = true;
+        else if (a == "--ai-ms" && i + 1 < argc) ai_ms = atoi(argv[++i]);
+        else if (a == "--ai-threads" && i + 1 < argc) ai_threads = atoi(argv[++i]);
+        else if (a == "--game-host" && i + 1 < argc) {
+            // Play on a game_host (IP:PORT) instead of hosting the match here.
+            string hp = argv[++i];
+            size_t colon = hp.rfind(':');
+            game_host_ip = hp.substr(0, colon);
+            game_host_port = colon == string::npos ? 21000 : atoi(hp.c_str() + colon + 1);
+        }
+    }
+    unique_ptr<Ai> ai;
+    if (ai_mode) ai.reset(new Ai(ai_threads, ai_ms));
+    if (!Rules::get(board_size, win_len)) {
+        cerr << "Unsupported board " << board_size << "x" << board_size << " with " << win_len << " in a row\n";
+        return 1;
+    }
     cout << "Welcome to the game!\n";
 
     string username, password;
@@ -177,60 +250,63 @@ int main(){
         break;
     }
 
+    // Who we are playing, reported with each STATUS like B does, so the
+    // lobby can pair the match that RESULT is accepted for.
+    mutex game_m;
+    string game_with;
     while(true){ //return to lobby
         //Periodic Status update
-        atomic<bool> still_online(true);
-
-        thread status_thread([&](){
-            while (still_online) {
-                this_thread::sleep_for(chrono::seconds(5));  
-                json resp = lobby_request({
-                    {"cmd", "STATUS"},
-                    {"username", username},
-                    {"extra", {{"xp", 1}}} 
-                });
-                //cout << "[DEBUG] Lobby status tick: " << resp.dump() << "\n";
-            }
+        Heartbeater heartbeat(LOBBY_HOST, username, [&](){
+            string game;
+            { lock_guard<mutex> g(game_m); game = game_with; }
+            return lobby_request({{"cmd", "STATUS"}, {"username", username}, {"game", game}});
         });
+        heartbeat.start();
 
         // UDP socket for sending invites
-        int udp = socket(AF_INET,  c, 0);
+        int udp = socket(AF_INET, SOCK_DGRAM, 0);
         if (udp < 0) { perror("udp"); return 1; }
 
-        vector<pair<string,int>> servers;
+        // Fallback for lobbies without PLAYERS: scan every known host/port.
+        vector<sockaddr_in> scan_targets;
         vector<string> linux_ips = {"140.113.17.11","140.113.17.12","140.113.17.13","140.113.17.14"};
-        for(int i=0;i<linux_ips.size();i++){
-            //for (int p=UDP_PORT_MIN;p<=UDP_PORT_MAX;++p) servers.push_back({"127.0.0.1", p});
-            for (int p=UDP_PORT_MIN;p<=UDP_PORT_MAX;++p) servers.push_back({linux_ips[i], p});
+        for (auto &ip : linux_ips) {
+            for (int p=UDP_PORT_MIN;p<=UDP_PORT_MAX;++p) scan_targets.push_back(make_addr(ip, p));
         }
         sockaddr_in target;
         bool Found=false;
+        // Encoding for the game connection, picked from the formats B lists
+        // in its INVITE_RESPONSE and announced back in CONNECT_INFO.
+        WireFormat game_fmt = WireFormat::Json;
+        // Whether B takes move deltas instead of the whole board each turn.
+        bool delta = false;
+        bool peer_udp = false;
+        string opponent_name;
         while(!Found){
             cout<<"[DEBUG] Start probing\n";
             srand(time(nullptr));
             int nonce = rand() % 1000000;
-            vector<pair<sockaddr_in, json>> candidates;
-            for (auto &sv : servers) {
-                sockaddr_in to{}; 
-                to.sin_family = AF_INET; 
-                to.sin_port = htons(sv.second);
-                inet_pton(AF_INET, sv.first.c_str(), &to.sin_addr);
-                json check = {{"type","CHECK"},{"from",username},{"nonce",nonce}};
-                send_udp_json(udp, to, check);
-                cout<<"[DEBUG] Sending Checks\n";
-                json reply; sockaddr_in from;
-                if (recv_udp_json(udp, reply, from, 500)) {  // short timeout
-                    if (reply.value("type","") == "CHECK_RESPONSE" && reply.value("nonce",0) == nonce) {
-                        if (reply.value("status","") == "ONLINE") {
-                            candidates.push_back({from, reply});
-                            cout << "Found PlayerB at " << inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port) << "\n";
-                        }
-                    }
+            // The lobby knows where available players listen; the CHECK
+            // round then only confirms they are still there.
+            vector<sockaddr_in> targets;
+            json listing = lobby_request({{"cmd","PLAYERS"},{"username",username}});
+            if (listing.value("status","") == "OK") {
+                for (auto &p : listing.value("players", json::array())) {
+                    targets.push_back(make_addr(p.value("ip",""), p.value("port",0)));
                 }
+            } else {
+                cout<<"[DEBUG] Lobby has no player list, scanning\n";
+                targets = scan_targets;
             }
+            json check = {{"type","CHECK"},{"from",username},{"nonce",nonce}};
+            cout<<"[DEBUG] Sending Checks\n";
+            auto candidates = probe_all(udp, targets, check, PROBE_WINDOW_MS, [](const sockaddr_in &from, const json &){
+                cout << "Found PlayerB at " << inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port) << "\n";
+            });
 
             if (candidates.empty()) {
                 cout << "No available PlayerB found\n";
+                this_thread::sleep_for(chrono::seconds(1));
                 continue;
             }
 
@@ -242,7 +318,7 @@ int main(){
             }
 
             size_t choice_p = 0;
-            while (true) {
+            while (!ai) {
                 cout << "Enter the number of the PlayerB to invite: ";
                 string s; 
                 getline(cin, s);
@@ -259,9 +335,12 @@ int main(){
             json invite = {{"type","INVITE"},{"from",username},{"nonce",nonce}};
             send_udp_json(udp, target, invite);
             cout << "Invite sent to " << inet_ntoa(target.sin_addr) << ":" << ntohs(target.sin_port) << "\n";
+            // Late CHECK_RESPONSEs from the probe round may still trickle in.
             json reply;
             sockaddr_in from{};
-            if (!recv_udp_json(udp, reply, from, 10000)) {
+            bool got = false;
+            while ((got = recv_udp_json(udp, reply, from, 10000)) && reply.value("type","") == "CHECK_RESPONSE") {}
+            if (!got) {
                 cout << "[WARN] No reply (timeout)\n";
                 continue;
             }
@@ -271,71 +350,132 @@ int main(){
                 cout << "[INFO] Invite declined.\n";
             }else{
                 cout<<"[INFO] Invite Accepted!\n";
+                game_fmt = wire_choose(reply.value("formats", json()));
+                delta = reply.value("delta", false);
+                peer_udp = reply.value("udp", false);
+                opponent_name = reply.value("from", "");
+                { lock_guard<mutex> g(game_m); game_with = opponent_name; }
+                heartbeat.status_now();
                 Found=true;
             }
         }
-        // Start TCP server
-        int tcps = socket(AF_INET, SOCK_STREAM, 0);
-        int opt = 1; setsockopt(tcps, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_addr.s_addr = INADDR_ANY;
-        int tcp_port = 20000;
-        while (true) {
-            addr.sin_port = htons(tcp_port);
-            if (bind(tcps, (sockaddr*)&addr, sizeof(addr))==0) break;
-            ++tcp_port;
-        }
-        if (listen(tcps, 1) < 0) {
-            perror("listen failed");
-            return 0;
-        }
+        int tcps = -1, conn = -1;
+        unique_ptr<GameChannel> chan;
+        if (udp_game && peer_udp && game_host_ip.empty()) {
+            // CONNECT_INFO is the channel's first message, so it is resent
+            // like the rest, and GAME_START follows without waiting for B.
+            chan.reset(new GameChannel(udp, target));
+            chan->send(json{{"type","CONNECT_INFO"},{"transport","udp"},{"format",wire_name(game_fmt)}}.dump());
+            cout << "Playing over the UDP game channel with " << inet_ntoa(target.sin_addr) << ":" << ntohs(target.sin_port) << "\n";
+        } else if (!game_host_ip.empty()) {
+            // The host referees; B learns the match id from CONNECT_INFO.
+            string match_id = username + "-" + to_string(((uint64_t)random_device{}() << 32) | random_device{}());
+            json info = {{"type","CONNECT_INFO"},{"ip",game_host_ip},{"port",game_host_port},
+                         {"format",wire_name(game_fmt)},{"match",match_id}};
+            send_udp_json(udp, target, info);
+            cout << "Sent CONNECT_INFO for game host " << game_host_ip << ":" << game_host_port << "\n";
+            conn = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in haddr = make_addr(game_host_ip, game_host_port);
+            json join = {{"type","JOIN"},{"match",match_id},{"role","X"},{"name",username},
+                         {"size",board_size},{"k",win_len},{"format",wire_name(game_fmt)},{"delta",true}};
+            if (connect(conn, (sockaddr*)&haddr, sizeof(haddr)) < 0 || !send_tcp_json(conn, join)) {
+                perror("[ERROR] game host");
+                close(conn);
+                close(udp);
+                continue;
+            }
+        } else {
+            // Start TCP server
+            tcps = socket(AF_INET, SOCK_STREAM, 0);
+            int opt = 1; setsockopt(tcps, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_addr.s_addr = INADDR_ANY;
+            int tcp_port = 20000;
+            while (true) {
+                addr.sin_port = htons(tcp_port);
+                if (bind(tcps, (sockaddr*)&addr, sizeof(addr))==0) break;
+                ++tcp_port;
+            }
+            if (listen(tcps, 1) < 0) {
+                perror("listen failed");
+                return 0;
+            }
         
 
-        // send CONNECT_INFO to B via UDP (we must send A's reachable IP)
-        char hostname[256]; 
-        gethostname(hostname, sizeof(hostname));
-        // get first non-loopback IP (simple)
-        string myip = "140.113.17.12";
-        json info = {{"type","CONNECT_INFO"},{"ip",myip},{"port",tcp_port}};
-        send_udp_json(udp, target, info);
-        cout << "Sent CONNECT_INFO to " << inet_ntoa(target.sin_addr) << ":"<<ntohs(target.sin_port) << " (tcp port " << tcp_port << ")\n";
-
-        // accept TCP
-        sockaddr_in peer{}; 
-        socklen_t plen = sizeof(peer);
-        cout << "[DEBUG] Waiting for TCP connection...\n";
-        int conn = accept(tcps, (sockaddr*)&peer, &plen);
-        if (conn < 0) { perror("accept"); return 1; }
-        cout << "PlayerB connected via TCP\n";
+            // send CONNECT_INFO to B via UDP (we must send A's reachable IP)
+            char hostname[256]; 
+            gethostname(hostname, sizeof(hostname));
+            // get first non-loopback IP (simple)
+            string myip = "140.113.17.12";
+            json info = {{"type","CONNECT_INFO"},{"ip",myip},{"port",tcp_port},{"format",wire_name(game_fmt)}};
+            send_udp_json(udp, target, info);
+            cout << "Sent CONNECT_INFO to " << inet_ntoa(target.sin_addr) << ":"<<ntohs(target.sin_port) << " (tcp port " << tcp_port << ")\n";
+
+            // accept TCP
+            sockaddr_in peer{}; 
+            socklen_t plen = sizeof(peer);
+            cout << "[DEBUG] Waiting for TCP connection...\n";
+            conn = accept(tcps, (sockaddr*)&peer, &plen);
+            if (conn < 0) { perror("accept"); return 1; }
+            cout << "PlayerB connected via TCP\n";
+        }
         // Game
-        vector<string> board(9, "");
+        int one = 1;
+        if (conn >= 0) setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Game game(board_size, win_len);
         string line;
-        auto send_tcp = [&](const json &j){ string s = j.dump(); s.push_back('\n'); send(conn, s.c_str(), s.size(), 0); };
-        auto recv_tcp = [&](string &out)->bool{
-            out.clear(); char c;
-            while (true) {
-                ssize_t n = recv(conn, &c, 1, 0);
-                if (n <= 0) return false;
-                if (c=='\n') break;
-                out.push_back(c);
-            }
-            return true;
+        auto send_tcp = [&](const json &j){
+            return chan ? chan->send(encode_payload(j, game_fmt)) : write_frame(conn, encode_frame(j, game_fmt));
         };
-        send_tcp(json{{"type","GAME_START"},{"you","O"},{"opponent",username},{"board",board},{"first_turn","X"}});
-        string turn = "X";
-        //Periodic check Alive
+        FrameReader conn_rd(conn);
+        conn_rd.set_length_prefixed(game_fmt != WireFormat::Json);
+        bool hosted = !game_host_ip.empty();
+        if (!hosted) {
+            json start = {{"type","GAME_START"},{"you","O"},{"opponent",username},{"board",game.to_strings()},{"first_turn","X"},
+                          {"size",game.size()},{"k",game.win_length()}};
+            if (delta) start["delta"] = true;
+            send_tcp(start);
+        }
+        // Last cell played, for deltas; RESYNC from B sends the whole board.
+        int last = -1;
+        bool resync = false;
+        //Watch the opponent's presence
         atomic<bool> opponent_online(true);
         atomic<bool> running(true);
-        string opponent_name = username; // get this from handshake or game start
-        thread online_checker([&]() {
+        auto recv_tcp = [&](string &out)->bool{
+            if (!chan) return conn_rd.read_frame(out) > 0;
+            // Nothing closes a UDP channel, so wake up now and then to
+            // notice the opponent going offline.
             while (running) {
+                if (chan->recv(out, 500)) return true;
+                if (chan->dead()) return false;
+            }
+            return false;
+        };
+        auto opponent_gone = [&](){
+            cout << "\n[INFO] Opponent " << opponent_name << " went offline.\n";
+            opponent_online = false;
+            running = false;
+        };
+        // The lobby pushes PRESENCE events over our open connection, so a
+        // disconnect shows up within a round trip. Lobbies without SUBSCRIBE
+        // get the old 5 s ONLINE_STATUS poll instead.
+        uint64_t presence_seen = 0;
+        lobby.on_push([&](const json &ev){
+            if (ev.value("event","") != "PRESENCE" || ev.value("username","") != opponent_name) return;
+            uint64_t v = ev.value("version", (uint64_t)0);
+            if (v < presence_seen) return;
+            presence_seen = v;
+            if (!ev.value("online", true) && opponent_online) opponent_gone();
+        });
+        bool pushed = !opponent_name.empty() && lobby.subscribe(opponent_name);
+        thread online_checker([&]() {
+            while (running && !pushed && !opponent_name.empty()) {
                 json status_req = {{"cmd", "ONLINE_STATUS"}, {"username", opponent_name}};
                 json status_resp = lobby_request(status_req);
 
-                bool on = status_resp.value("online", true);
+                bool on = status_resp.is_object() ? status_resp.value("online", true) : true;
                 if (!on) {
-                    cout << "\n[INFO] Opponent " << opponent_name << " went offline.\n";
-                    opponent_online = false;
-                    running = false;
+                    opponent_gone();
                     break;
                 }
 
@@ -343,53 +483,112 @@ int main(){
             }
         });
 
+        // How the game ended for us, as GAME_END names it; reported to the
+        // lobby for xp once the game is over.
+        string outcome;
         while (running) {
             if (!opponent_online) {
                 cout << "[INFO] Game stopped — opponent is offline.\n";
                 break;
             }
-            if (turn == "X") {
-                print_board(board);
-                int pos = -1;
-                while (true) {
-                    cout << "Your move (0-8): ";
-                    string s; getline(cin, s);
-                    try { pos = stoi(s); } catch(...) { continue; }
-                    if (pos>=0 && pos<9 && board[pos].empty()) break;
+            if (hosted) {
+                // The host referees: answer its MOVE_REQs until GAME_END.
+                if (!recv_tcp(line)) {
+                    cout << "[ERROR] Game host disconnected\n";
+                    break;
                 }
-                board[pos] = "X";
-                //send_tcp(json{{"type","MOVE"},{"pos",pos}});
+                json m;
+                try { m = decode_payload(line, game_fmt); } catch(...) { continue; }
+                string t = m.value("type","");
+                if (t == "GAME_START") {
+                    game = Game(m.value("size",board_size), m.value("k",win_len));
+                    cout << "[INFO] Game started against " << m.value("opponent","") << "\n";
+                } else if (t == "MOVE_REQ") {
+                    if (!sync_game(game, m)) {
+                        send_tcp(json{{"type","RESYNC"}});
+                        continue;
+                    }
+                    int pos = choose_move(game, ai.get());
+                    game.play(pos);
+                    send_tcp(json{{"type","MOVE"},{"pos",pos},{"seq",game.moves()}});
+                    cout<<"[INFO] Waiting for opponent to move...\n";
+                } else if (t == "GAME_END") {
+                    string result = m.value("result","");
+                    if (sync_game(game, m)) game.print(cout);
+                    cout << (result=="WIN" ? "You Won!" : result=="LOSE" ? "You Lost..." : "Draw!") << "\n";
+                    outcome = result;
+                    break;
+                }
+                continue;
+            }
+            if (game.to_move() == X) {
+                last = choose_move(game, ai.get());
+                game.play(last);
                 cout<<"[INFO] Waiting for opponent to move...\n";
             } else {
-                send_tcp(json{{"type","MOVE_REQ"},{"board",board}});
+                json req = {{"type","MOVE_REQ"}};
+                if (!delta || resync) req["board"] = game.to_strings();
+                if (delta) add_delta(req, game, last);
+                resync = false;
+                send_tcp(req);
                 if (!recv_tcp(line)) { 
                     cout << "[ERROR] Peer disconnected\n"; 
                     break; 
                 }
-                try { json m = json::parse(line); if (m.value("type","")=="MOVE") { int p = m.value("pos",-1); if (p>=0 && p<9) board[p] = "O"; } } catch(...) {}
+                // An illegal, stale or garbled move just gets asked for again.
+                try {
+                    json m = decode_payload(line, game_fmt);
+                    string t = m.value("type","");
+                    int p = m.value("pos",-1), seq = m.value("seq",-1);
+                    if (t == "RESYNC") resync = true;
+                    else if (t == "MOVE" && (seq < 0 || seq == game.moves() + 1) && game.legal(p)) {
+                        game.play(p);
+                        last = p;
+                    }
+                } catch(...) {}
             }
-            int res = check_tictactoe(board);
-            if (res != 0) {
-                if (res == 1){
-                    send_tcp(json{{"type","GAME_END"},{"result","LOSE"},{"board",board}});
+            Outcome res = game.outcome();
+            if (res != ONGOING) {
+                auto game_end = [&](const char *result){
+                    json end = {{"type","GAME_END"},{"result",result}};
+                    if (delta) add_delta(end, game, last);
+                    else end["board"] = game.to_strings();
+                    send_tcp(end);
+                };
+                if (res == X_WINS){
+                    game_end("LOSE");
+                    outcome = "WIN";
                     cout<<"You Won!\n";
-                } else if (res == 2){
-                    send_tcp(json{{"type","GAME_END"},{"result","WIN"},{"board",board}});
+                } else if (res == O_WINS){
+                    game_end("WIN");
+                    outcome = "LOSE";
                     cout<<"You Lost...\n";
                 } else{
-                    send_tcp(json{{"type","GAME_END"},{"result","DRAW"},{"board",board}});
+                    game_end("DRAW");
+                    outcome = "DRAW";
                     cout<<"Draw!\n";
                 }
+                game.print(cout);
                 break;
             }
-            turn = (turn=="X")? "O" : "X";
         }
+        // B only learns the result from GAME_END; make sure it got there.
+        if (chan) chan->flush(2000);
+        if (!outcome.empty()) {
+            json r = lobby_request({{"cmd","RESULT"},{"username",username},{"result",outcome}});
+            if (r.is_object() && r.value("status","") == "OK") {
+                cout << "[INFO] Experience " << r.value("experience",0) << ", rank " << r.value("rank",0) << "\n";
+            }
+        }
+        { lock_guard<mutex> g(game_m); game_with.clear(); }
+        heartbeat.status_now();
         running=false;
-        still_online=false;
-        status_thread.join();
+        heartbeat.stop();
         online_checker.join();
-        close(conn);
-        close(tcps);
+        lobby.on_push(nullptr);
+        if (pushed) lobby.unsubscribe(opponent_name);
+        if (conn >= 0) close(conn);
+        if (tcps >= 0) close(tcps);
         close(udp);
     }
     return 0;
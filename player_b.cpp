@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cstring>
@@ -11,6 +12,13 @@
 #include <atomic>
 #include <fcntl.h>
 #include "json.hpp"
+#include "frame_reader.hpp"
+#include "lobby_client.hpp"
+#include "game_sync.hpp"
+#include "game_channel.hpp"
+#include "wire.hpp"
+#include "game.hpp"
+#include "ai.hpp"
 
 using json = nlohmann::json;
 using namespace std;
@@ -26,16 +34,23 @@ bool send_udp_json(int sock, const sockaddr_in &to, const json &j) {
     return n == (ssize_t)s.size();
 }
 
-bool recv_udp_json(int sock, json &out, sockaddr_in &from, int timeout_ms=0) {
+bool recv_udp_raw(int sock, string &out, sockaddr_in &from, int timeout_ms=0) {
     fd_set set; FD_ZERO(&set); FD_SET(sock,&set);
     timeval tv; tv.tv_sec = timeout_ms/1000; tv.tv_usec = (timeout_ms%1000)*1000;
     int rc = select(sock+1, &set, nullptr, nullptr, (timeout_ms>0?&tv:nullptr));
     if (rc <= 0) return false;
-    char buf[4096]; sockaddr_in src{}; socklen_t srclen = sizeof(src);
-    ssize_t n = recvfrom(sock, buf, sizeof(buf)-1, 0, (sockaddr*)&src, &srclen);
+    char buf[GameChannel::HEADER + GameChannel::MAX_PAYLOAD]; sockaddr_in src{}; socklen_t srclen = sizeof(src);
+    ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)&src, &srclen);
     if (n <= 0) return false;
-    buf[n] = 0;
-    try { out = json::parse(string(buf)); from = src; return true; } catch (...) { return false; }
+    out.assign(buf, n);
+    from = src;
+    return true;
+}
+
+bool recv_udp_json(int sock, json &out, sockaddr_in &from, int timeout_ms=0) {
+    string s;
+    if (!recv_udp_raw(sock, s, from, timeout_ms)) return false;
+    try { out = json::parse(s); return true; } catch (...) { return false; }
 }
 
 bool send_tcp_json(int fd, const json &j) {
@@ -49,46 +64,32 @@ bool send_tcp_json(int fd, const json &j) {
     return true;
 }
 
-bool recv_tcp_line(int fd, string &out) {
-    out.clear();
-    char c;
-    //cout<<"[DEBUG] Receiving TCP...\n";
-    while (true) {
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n <= 0) return false;
-        if (c == '\n') break;
-        out.push_back(c);
-    }
-    //cout<<"[DEBUG] Receive TCP complete.\n"<<out<<"\n";
-    return true;
+bool recv_tcp_line(FrameReader &rd, string &out) {
+    return rd.read_frame(out) > 0;
 }
 
+// One connection to the lobby for the whole process; heartbeats, polls and
+// the interactive login all share it.
+LobbyClient lobby(LOBBY_HOST, LOBBY_PORT);
+
 json lobby_request(const json &req) {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) { perror("socket"); return json(); }
-    sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_port = htons(LOBBY_PORT);
-    inet_pton(AF_INET, LOBBY_HOST.c_str(), &addr.sin_addr);
-    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return json(); }
-    send_tcp_json(s, req);
-    string line;
-    if (!recv_tcp_line(s, line)) { close(s); return json(); }
-    close(s);
-    try { return json::parse(line); } catch (...) { return json(); }
+    return lobby.request(req);
 }
 
 
 
-void print_board(const vector<string>& b) {
-    cout << "\nBoard:\n";
-    for (int r=0;r<3;++r) {
-        for (int c=0;c<3;++c) {
-            string v = b[3*r+c]; cout << (v.empty()? "." : v) << (c<2? " " : "");
-        }
-        cout << "\n";
+int main(int argc, char** argv){
+    // --ai accepts every invite and lets the computer answer MOVE_REQ.
+    bool ai_mode = false;
+    int ai_ms = 1000, ai_threads = (int)max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--ai") ai_mode = true;
+        else if (a == "--ai-ms" && i + 1 < argc) ai_ms = atoi(argv[++i]);
+        else if (a == "--ai-threads" && i + 1 < argc) ai_threads = atoi(argv[++i]);
     }
-}
-
-int main(){
+    unique_ptr<Ai> ai;
+    if (ai_mode) ai.reset(new Ai(ai_threads, ai_ms));
     cout << "Welcome to the game!\n";
     //Login & Register
     string username, password;
@@ -140,15 +141,27 @@ int main(){
         if (bound_port == -1) { cerr << "No free UDP port\n"; return 1; }
         cout << "Listening for invites on UDP port " << bound_port << endl;
 
-        // Lobby status updater
-        atomic<bool> running(true);
-        thread status_thread([&](){
-            while (running) {
-                this_thread::sleep_for(chrono::seconds(5));
-                lobby_request({{"cmd","STATUS"},{"username",username},{"extra", {{"xp",1}}}});
-                //cout << "[DEBUG] Lobby status update tick\n";
-            }
+        // Lobby status updater. Each heartbeat also refreshes the endpoint
+        // the lobby lists us under and the game we are in; while in a game
+        // port 0 takes us off the list.
+        atomic<int> listed_port(bound_port);
+        mutex game_m;
+        string game_with;
+        Heartbeater heartbeat(LOBBY_HOST, username, [&](){
+            string game;
+            { lock_guard<mutex> g(game_m); game = game_with; }
+            return lobby_request({{"cmd","STATUS"},{"username",username},
+                                  {"udp_port",listed_port.load()},{"game",game}});
         });
+        // Tells the lobby right away that we joined a game against opponent,
+        // or with "" that we are back and available.
+        auto in_game = [&](const string &opponent){
+            { lock_guard<mutex> g(game_m); game_with = opponent; }
+            listed_port = opponent.empty() ? bound_port : 0;
+            heartbeat.status_now();
+        };
+        heartbeat.status_now();
+        heartbeat.start();
 
         //Invite, TCP, Game
         bool play = true;
@@ -161,7 +174,7 @@ int main(){
             //Probe response
             if (msgtype == "CHECK"){
                 cout<<"[DEBUG] Received cmd CHECK\n";
-                json reply = {{"type","CHECK_RESPONSE"},{"status","ONLINE"},{"nonce",msg.value("nonce",0)}};
+                json reply = {{"type","CHECK_RESPONSE"},{"status","ONLINE"},{"nonce",msg.value("nonce",0)},{"from",username}};
                 send_udp_json(udp, from, reply);
                 continue;
             }else if (msgtype == "INVITE") {
@@ -170,75 +183,127 @@ int main(){
                 inet_ntop(AF_INET, &from.sin_addr, buf, sizeof(buf));
                 cout << "Invitation from " << buf << ":" << ntohs(from.sin_port) << " nonce="<<nonce<<"\n";
                 cout << "Accept invite? (y/n): ";
-                string ans; 
-                getline(cin, ans);
+                string ans = "y";
+                if (ai) cout << ans << "\n";
+                else getline(cin, ans);
                 json reply;
                 if (!ans.empty() && (ans[0]=='y' || ans[0]=='Y')) {
-                    reply = {{"type","INVITE_RESPONSE"},{"response","ACCEPT"},{"nonce",nonce}};
+                    reply = {{"type","INVITE_RESPONSE"},{"response","ACCEPT"},{"nonce",nonce},{"from",username},{"formats",wire_offer()},
+                             {"delta",true},{"udp",true}};
                     send_udp_json(udp, from, reply);
+                    in_game(msg.value("from", string(buf)));
                     cout << "Accepted. Waiting for CONNECT_INFO...\n";
-                    //TCP
+                    // A sends CONNECT_INFO as plain JSON when we are to open
+                    // a TCP connection, or as the first message of a UDP
+                    // game channel.
+                    string first;
                     json info; 
                     sockaddr_in inf_from{};
-                    bool got = recv_udp_json(udp, info, inf_from, 10000); 
+                    unique_ptr<GameChannel> chan;
+                    bool got = recv_udp_raw(udp, first, inf_from, 10000);
+                    if (got && GameChannel::is_channel(first.data(), first.size())) {
+                        chan.reset(new GameChannel(udp, inf_from));
+                        chan->deliver(first.data(), first.size(), inf_from);
+                        got = chan->recv(first, 10000);
+                    }
+                    try { if (got) info = json::parse(first); } catch (...) { got = false; }
                     if (!got || info.value("type","") != "CONNECT_INFO") {
                         cout << "No CONNECT_INFO received.\n";
+                        in_game("");
                         continue;
                     }
-                    string aip = info.value("ip","");
-                    int aport = info.value("port",0);
-                    cout << "Connecting to A " << aip << ":"<<aport<<" via TCP...\n";
-                    
-                    int conn = socket(AF_INET, SOCK_STREAM, 0);
-                    sockaddr_in aaddr{}; aaddr.sin_family = AF_INET; aaddr.sin_port = htons(aport);
-                    inet_pton(AF_INET, aip.c_str(), &aaddr.sin_addr);
-                    if (connect(conn, (sockaddr*)&aaddr, sizeof(aaddr)) < 0) {
-                        perror("connect");
-                        close(conn);
-                        continue;
+                    WireFormat game_fmt = WireFormat::Json;
+                    wire_from_name(info.value("format","json"), game_fmt);
+                    int conn = -1;
+                    if (chan) {
+                        cout << "Playing over the UDP game channel\n";
+                    } else {
+                        string aip = info.value("ip","");
+                        int aport = info.value("port",0);
+                        cout << "Connecting to A " << aip << ":"<<aport<<" via TCP...\n";
+                        
+                        conn = socket(AF_INET, SOCK_STREAM, 0);
+                        sockaddr_in aaddr{}; aaddr.sin_family = AF_INET; aaddr.sin_port = htons(aport);
+                        inet_pton(AF_INET, aip.c_str(), &aaddr.sin_addr);
+                        // A "match" id means the address is a game host, which
+                        // needs to be told which match we are joining.
+                        string match_id = info.value("match","");
+                        json join = {{"type","JOIN"},{"match",match_id},{"role","O"},{"name",username},
+                                     {"format",wire_name(game_fmt)},{"delta",true}};
+                        if (connect(conn, (sockaddr*)&aaddr, sizeof(aaddr)) < 0 ||
+                            (!match_id.empty() && !send_tcp_json(conn, join))) {
+                            perror("connect");
+                            close(conn);
+                            in_game("");
+                            continue;
+                        }
+                        int one = 1;
+                        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
                     }
 
                     //Game
-                    auto send_tcp = [&](const json& j){ string out = j.dump(); out.push_back('\n'); send(conn, out.c_str(), out.size(), 0); };
+                    auto send_tcp = [&](const json& j){
+                        return chan ? chan->send(encode_payload(j, game_fmt)) : write_frame(conn, encode_frame(j, game_fmt));
+                    };
+                    FrameReader conn_rd(conn);
+                    conn_rd.set_length_prefixed(game_fmt != WireFormat::Json);
+                    // The channel is polled so a peer that stopped acking ends the
+                    // game instead of leaving us waiting out the idle limit.
                     auto recv_tcp = [&](string &line)->bool{
-                        line.clear(); char c;
-                        while (true) {
-                            ssize_t n = recv(conn, &c, 1, 0);
-                            if (n <= 0) return false;
-                            if (c=='\n') break;
-                            line.push_back(c);
+                        if (!chan) return recv_tcp_line(conn_rd, line);
+                        while (!chan->recv(line, 500)) {
+                            if (chan->dead()) return false;
                         }
                         return true;
                     };
 
                     
+                    Game game;
                     while (play) {
                         string line;
                         if (!recv_tcp(line)) { cout << "Disconnected from A\n"; break; }
                         json m;
-                        try { m = json::parse(line); } catch(...) { continue; }
+                        try { m = decode_payload(line, game_fmt); } catch(...) { continue; }
                         string t = m.value("type","");
                         if (t == "GAME_START") {
-                            cout << "[INFO] Game started\n";
+                            // Hosts that predate variants leave out size and k.
+                            game = Game(m.value("size",3), m.value("k",3));
+                            cout << "[INFO] Game started (" << game.size() << "x" << game.size()
+                                 << ", " << game.win_length() << " in a row)\n";
                         } else if (t == "MOVE_REQ") {
-                            vector<string> board = m.value("board", vector<string>(9,""));
-                            print_board(board);
+                            if (!sync_game(game, m)) {
+                                cout << "[WARN] Board out of sync, asking for all of it\n";
+                                send_tcp(json{{"type","RESYNC"}});
+                                continue;
+                            }
+                            game.print(cout);
                             int pos = -1;
-                            while (true) {
-                                cout << "Your move (0-8): ";
+                            if (ai) {
+                                pos = ai->choose(game);
+                                cout << "[AI] Plays " << pos << " (depth " << ai->last_depth() << ", "
+                                     << ai->last_nodes() << " nodes)\n";
+                            }
+                            while (!game.legal(pos)) {
+                                cout << "Your move (0-" << game.cells() - 1 << "): ";
                                 string sline; getline(cin, sline);
                                 if (sline.empty()) continue;
                                 try { pos = stoi(sline); } catch(...) { continue; }
-                                if (pos>=0 && pos<9 && board[pos].empty()) break;
                             }
-                            send_tcp(json{{"type","MOVE"},{"pos",pos}}); 
+                            game.play(pos);
+                            send_tcp(json{{"type","MOVE"},{"pos",pos},{"seq",game.moves()}});
                             cout<<"[INFO] Waiting for opponent to move...\n";
                         } else if (t == "GAME_END") {
                             string result = m.value("result","");
+                            if (sync_game(game, m)) game.print(cout);
                             cout << "Game ended: You " 
                                 << ((result=="WIN")?"Won!":
                                     (result=="LOSE")?"Lost...":"Draw!") 
                                 << "\n";
+                            json r = lobby_request({{"cmd","RESULT"},{"username",username},{"result",result}});
+                            if (r.is_object() && r.value("status","") == "OK") {
+                                cout << "[INFO] Experience " << r.value("experience",0)
+                                     << ", rank " << r.value("rank",0) << "\n";
+                            }
                             play = false;
                             break;
                         } else {
@@ -247,9 +312,12 @@ int main(){
                         }
                     }
                     cout<<"[DEBUG] Return to lobby\n";
-                    close(conn);
+                    // Stay to ack GAME_END again in case our ack was lost.
+                    if (chan) chan->linger();
+                    else close(conn);
+                    in_game("");
                 } else {
-                    reply = {{"type","INVITE_RESPONSE"},{"response","DECLINE"},{"nonce",nonce}};
+                    reply = {{"type","INVITE_RESPONSE"},{"response","DECLINE"},{"nonce",nonce},{"from",username}};
                     send_udp_json(udp, from, reply);
                     cout << "Declined.\n";
                 }
@@ -262,8 +330,7 @@ int main(){
             if(!play) break;
         }
         cout<<"[DEBUG] Final shut down\n";
-        running = false;
-        status_thread.join();
+        heartbeat.stop();
         
         close(udp);
     }
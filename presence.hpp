@@ -0,0 +1,250 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+inline int64_t steady_ticks() {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+inline int64_t ticks_of(std::chrono::steady_clock::duration d) { return d.count(); }
+
+// Volatile per-user state: whether the player is online, when they were
+// last heard from, the game they are in and where they take invites.
+// None of it is logged or snapshotted, so heartbeats never reach the disk
+// and a restarted lobby starts with everyone offline. The xp heartbeats
+// earn also waits here until the lobby banks it into the account.
+//
+// Sharded by username like UserStore, and laid out the same way: a flat
+// index over dense rows, names interned in one arena per shard. The online
+// flag and last heartbeat are their own array by row, so a presence scan
+// reads 16 bytes per user; the rest of a row sits in a second array. A row
+// is created the first time a user comes online and kept after they go
+// offline, so the presence wheel can still find it.
+class PresenceTable {
+public:
+    // The part of a row presence scans read.
+    struct Liveness {
+        bool online = false;
+        // Heartbeats write it under the shard's shared lock.
+        mutable std::atomic<int64_t> last_seen{steady_ticks()};
+
+        Liveness() = default;
+        Liveness(const Liveness &o) : online(o.online), last_seen(o.last_seen.load(std::memory_order_relaxed)) {}
+    };
+
+    // A row handed to callbacks that hold the shard's exclusive lock. The
+    // fields refer into the table and are only valid during the callback.
+    struct Ref {
+        bool &online;
+        std::atomic<int64_t> &last_seen;
+        // Whether the presence wheel holds an entry for this user.
+        bool &armed;
+        std::string &game;
+        // Invite endpoint; port 0 when the player is not advertising one.
+        std::string &ip;
+        int &port;
+        // Session token UDP heartbeats must carry; 0 while offline.
+        uint64_t &token;
+        // Heartbeat xp not yet in the account, and when a heartbeat last
+        // earned some. Heartbeats update both under the shared lock.
+        std::atomic<int> &xp;
+        std::atomic<int64_t> &xp_at;
+        // Id the lobby gave the game once this player and the one named in
+        // game named each other; 0 until then and after game changes.
+        uint64_t &match;
+        // Whether the player already sent a RESULT for match.
+        bool &reported;
+    };
+
+    // Same for callbacks under the shared lock: only the atomics are
+    // writable.
+    struct View {
+        const bool &online;
+        std::atomic<int64_t> &last_seen;
+        const bool &armed;
+        const std::string &game;
+        const std::string &ip;
+        const int &port;
+        const uint64_t &token;
+        std::atomic<int> &xp;
+        std::atomic<int64_t> &xp_at;
+        const uint64_t &match;
+        const bool &reported;
+    };
+
+    explicit PresenceTable(size_t shards = 64) {
+        size_t n = 1;
+        while (n < shards) n <<= 1;
+        shift_ = 64;
+        for (size_t m = n; m > 1; m >>= 1) --shift_;
+        nshards_ = n;
+        shards_.reset(new Shard[n]);
+    }
+
+    // Runs fn(Ref) under the shard's exclusive lock, creating the row if
+    // the user has none yet.
+    template <class F>
+    void upsert(const std::string &name, F &&fn) {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        std::unique_lock<std::shared_mutex> g(s.m);
+        int64_t row = s.find(name, h);
+        if (row < 0) row = s.add(name, h);
+        fn(s.ref(row));
+    }
+
+    // Same, but only for an existing row. False if there is none.
+    template <class F>
+    bool update(const std::string &name, F &&fn) {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        std::unique_lock<std::shared_mutex> g(s.m);
+        int64_t row = s.find(name, h);
+        if (row < 0) return false;
+        fn(s.ref(row));
+        return true;
+    }
+
+    // Runs fn(View) under the shard's shared lock. False if the user has
+    // no row, i.e. has not been online since the start.
+    template <class F>
+    bool read(const std::string &name, F &&fn) const {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        std::shared_lock<std::shared_mutex> g(s.m);
+        int64_t row = s.find(name, h);
+        if (row < 0) return false;
+        fn(s.view(row));
+        return true;
+    }
+
+    // Calls fn(name, View) for every row, one shard at a time under its
+    // shared lock.
+    template <class F>
+    void for_each(F &&fn) const {
+        for (size_t i = 0; i < nshards_; ++i) {
+            Shard &s = shards_[i];
+            std::shared_lock<std::shared_mutex> g(s.m);
+            for (uint32_t row = 0; row < s.live.size(); ++row) fn(s.name_of(row), s.view(row));
+        }
+    }
+
+    // Same, but walks only the liveness rows and calls fn(name, View) for
+    // the rows where pick(const Liveness&) is true.
+    template <class P, class F>
+    void scan(P &&pick, F &&fn) const {
+        for (size_t i = 0; i < nshards_; ++i) {
+            Shard &s = shards_[i];
+            std::shared_lock<std::shared_mutex> g(s.m);
+            for (uint32_t row = 0; row < s.live.size(); ++row) {
+                if (pick((const Liveness&)s.live[row])) fn(s.name_of(row), s.view(row));
+            }
+        }
+    }
+
+private:
+    // Everything in a row but liveness. Names are (offset, length) into
+    // the arena.
+    struct Detail {
+        uint32_t name_off = 0, name_len = 0;
+        bool armed = false;
+        bool reported = false;
+        int port = 0;
+        uint64_t token = 0;
+        uint64_t match = 0;
+        mutable std::atomic<int> xp{0};
+        mutable std::atomic<int64_t> xp_at{0};
+        std::string game;
+        std::string ip;
+
+        Detail() = default;
+        Detail(const Detail &o)
+            : name_off(o.name_off), name_len(o.name_len), armed(o.armed), reported(o.reported),
+              port(o.port), token(o.token), match(o.match),
+              xp(o.xp.load(std::memory_order_relaxed)), xp_at(o.xp_at.load(std::memory_order_relaxed)),
+              game(o.game), ip(o.ip) {}
+    };
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex m;
+        // (hash >> 32) << 32 | (row + 1) per slot, 0 when empty; linear
+        // probing, kept at most 3/4 full.
+        std::vector<uint64_t> slots;
+        std::string arena;
+        std::vector<Liveness> live;
+        std::vector<Detail> details;
+
+        int64_t find(std::string_view name, uint64_t h) const {
+            if (slots.empty()) return -1;
+            uint64_t mask = slots.size() - 1;
+            for (uint64_t i = h & mask; slots[i]; i = (i + 1) & mask) {
+                if ((slots[i] >> 32) != (h >> 32)) continue;
+                uint32_t row = (uint32_t)slots[i] - 1;
+                if (name_of(row) == name) return row;
+            }
+            return -1;
+        }
+
+        uint32_t add(std::string_view name, uint64_t h) {
+            if ((live.size() + 1) * 4 > slots.size() * 3) grow();
+            uint32_t row = live.size();
+            Detail d;
+            d.name_off = arena.size();
+            d.name_len = name.size();
+            arena.append(name.data(), name.size());
+            live.emplace_back();
+            details.push_back(d);
+            place(h, row);
+            return row;
+        }
+
+        std::string_view name_of(uint32_t row) const {
+            return std::string_view(arena.data() + details[row].name_off, details[row].name_len);
+        }
+
+        Ref ref(uint32_t row) {
+            Liveness &l = live[row];
+            Detail &d = details[row];
+            return Ref{l.online, l.last_seen, d.armed, d.game, d.ip, d.port, d.token,
+                       d.xp, d.xp_at, d.match, d.reported};
+        }
+
+        View view(uint32_t row) const {
+            const Liveness &l = live[row];
+            const Detail &d = details[row];
+            return View{l.online, l.last_seen, d.armed, d.game, d.ip, d.port, d.token,
+                        d.xp, d.xp_at, d.match, d.reported};
+        }
+
+        void place(uint64_t h, uint32_t row) {
+            uint64_t mask = slots.size() - 1;
+            uint64_t i = h & mask;
+            while (slots[i]) i = (i + 1) & mask;
+            slots[i] = (h >> 32 << 32) | (row + 1);
+        }
+
+        void grow() {
+            slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+            for (uint32_t row = 0; row < live.size(); ++row) place(hash_of(name_of(row)), row);
+        }
+    };
+
+    static uint64_t hash_of(std::string_view name) { return std::hash<std::string_view>{}(name); }
+
+    // Fibonacci hashing, as in UserStore.
+    Shard &shard_for(uint64_t h) const {
+        if (nshards_ == 1) return shards_[0];
+        return shards_[(h * 0x9E3779B97F4A7C15ull) >> shift_];
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+    size_t nshards_ = 1;
+    unsigned shift_ = 64;
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Hashed timing wheel of string keys. Each slot covers one tick; a deadline
+// further out than one revolution simply stays in its slot until the wheel
+// comes around enough times. Scheduling and expiry are O(1) per entry, so
+// advancing the wheel only touches entries that are actually due.
+class TimerWheel {
+public:
+    using Entry = std::pair<std::string, int64_t>;  // key, deadline
+
+    TimerWheel(int64_t tick, size_t slots, int64_t now)
+        : tick_(tick), slots_(slots), now_tick_(now / tick) {}
+
+    void schedule(const std::string &key, int64_t deadline) {
+        std::lock_guard<std::mutex> g(m_);
+        // The first tick at or after the deadline, so the slot is never
+        // visited before the entry is due.
+        int64_t t = (deadline + tick_ - 1) / tick_;
+        if (t <= now_tick_) t = now_tick_ + 1;
+        slots_[t % slots_.size()].emplace_back(key, deadline);
+        ++size_;
+    }
+
+    // Moves every entry due by `now` into `due`.
+    void advance(int64_t now, std::vector<Entry> &due) {
+        std::lock_guard<std::mutex> g(m_);
+        int64_t target = now / tick_;
+        // After a long stall one revolution visits every slot once.
+        if (target - now_tick_ > (int64_t)slots_.size()) now_tick_ = target - slots_.size();
+        while (now_tick_ < target) {
+            ++now_tick_;
+            auto &slot = slots_[now_tick_ % slots_.size()];
+            size_t keep = 0;
+            for (size_t i = 0; i < slot.size(); ++i) {
+                if (slot[i].second <= now) due.push_back(std::move(slot[i]));
+                else if (keep++ != i) slot[keep - 1] = std::move(slot[i]);
+            }
+            size_ -= slot.size() - keep;
+            slot.resize(keep);
+        }
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> g(m_);
+        return size_;
+    }
+
+private:
+    int64_t tick_;
+    std::vector<std::vector<Entry>> slots_;
+    int64_t now_tick_;
+    size_t size_ = 0;
+    mutable std::mutex m_;
+};
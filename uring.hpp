@@ -0,0 +1,166 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+// Minimal io_uring wrapper over the raw syscalls, so nothing beyond the
+// kernel headers is needed. One thread owns a ring: it fills SQEs, calls
+// submit() once per loop to both submit and wait, then drains completions.
+//
+// init() fails on kernels without io_uring (or where it is disabled), and
+// supports() tells whether the running kernel knows a set of opcodes;
+// callers fall back to their plain syscall path in either case.
+class Uring {
+public:
+    Uring() = default;
+    ~Uring() { close(); }
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    bool init(unsigned entries) {
+        io_uring_params p{};
+        fd_ = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd_ < 0) return false;
+        features_ = p.features;
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+        sq_ring_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) { sq_ring_ = nullptr; close(); return false; }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        } else {
+            cq_ring_ = mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) { cq_ring_ = nullptr; close(); return false; }
+        }
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) { close(); return false; }
+        sqes_ = (io_uring_sqe*)sqes;
+
+        char *sq = (char*)sq_ring_, *cq = (char*)cq_ring_;
+        sq_head_ = (unsigned*)(sq + p.sq_off.head);
+        sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array_ = (unsigned*)(sq + p.sq_off.array);
+        cq_head_ = (unsigned*)(cq + p.cq_off.head);
+        cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        sq_entries_ = p.sq_entries;
+        tail_ = *sq_tail_;
+        return true;
+    }
+
+    void close() {
+        if (sqes_) munmap(sqes_, sqes_len_);
+        if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_len_);
+        if (sq_ring_) munmap(sq_ring_, sq_len_);
+        if (fd_ >= 0) ::close(fd_);
+        sqes_ = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        fd_ = -1;
+    }
+
+    bool ok() const { return fd_ >= 0; }
+    unsigned features() const { return features_; }
+
+    // True if every opcode in ops is supported by the running kernel.
+    bool supports(std::initializer_list<int> ops) const {
+        std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = (io_uring_probe*)buf.data();
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        for (int op : ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    // Pins iovecs for IORING_OP_READ_FIXED/WRITE_FIXED; buf_index refers
+    // to their position here.
+    bool register_buffers(const iovec *iov, unsigned n) {
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iov, n) == 0;
+    }
+
+    // A zeroed SQE to fill in, or nullptr when the queue is full and
+    // submit() has to run first.
+    io_uring_sqe *sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (tail_ - head >= sq_entries_) return nullptr;
+        unsigned idx = tail_ & sq_mask_;
+        io_uring_sqe *e = &sqes_[idx];
+        memset(e, 0, sizeof(*e));
+        sq_array_[idx] = idx;
+        ++tail_;
+        ++queued_;
+        return e;
+    }
+
+    // Publishes queued SQEs and, with wait_nr > 0, blocks until that many
+    // completions are ready, all in one io_uring_enter(). Returns -errno on
+    // failure; EINTR is not an error.
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        int r = (int)syscall(__NR_io_uring_enter, fd_, queued_, wait_nr, flags, nullptr, 0);
+        if (r < 0) return errno == EINTR ? 0 : -errno;
+        queued_ -= std::min<unsigned>(queued_, r);
+        ++enters_;
+        return r;
+    }
+
+    // Calls fn(user_data, res, flags) for every ready completion.
+    template <class F>
+    unsigned drain(F &&fn) {
+        unsigned head = *cq_head_, n = 0;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe &c = cqes_[head & cq_mask_];
+            uint64_t data = c.user_data;
+            int res = c.res;
+            unsigned flags = c.flags;
+            ++head;
+            ++n;
+            // Release the slot before fn runs; it may queue and submit more.
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            fn(data, res, flags);
+            tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        }
+        return n;
+    }
+
+    // io_uring_enter() calls made so far.
+    uint64_t enters() const { return enters_; }
+
+private:
+    int fd_ = -1;
+    unsigned features_ = 0;
+    void *sq_ring_ = nullptr, *cq_ring_ = nullptr;
+    size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+    unsigned sq_mask_ = 0, cq_mask_ = 0, sq_entries_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+    unsigned tail_ = 0;
+    unsigned queued_ = 0;
+    uint64_t enters_ = 0;
+};
+
+inline void uring_prep(io_uring_sqe *e, int op, int fd, const void *addr, unsigned len, uint64_t off,
+                       uint64_t user_data) {
+    e->opcode = (uint8_t)op;
+    e->fd = fd;
+    e->addr = (uint64_t)(uintptr_t)addr;
+    e->len = len;
+    e->off = off;
+    e->user_data = user_data;
+}
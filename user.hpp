@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// One user's account as a plain value: what is loaded, logged and
+// snapshotted. Presence lives in PresenceTable and is never stored.
+struct User {
+    std::string password;
+    int login_count = 0;
+    int experience = 0;
+};
+
+// A user inside UserStore, handed to callbacks that hold the shard's
+// exclusive lock. The fields refer into the store and are only valid
+// during the callback.
+struct UserRef {
+    std::string_view password;
+    int &login_count;
+    int &experience;
+};
+
+// Same for callbacks under the shared lock.
+struct UserView {
+    std::string_view password;
+    const int &login_count;
+    const int &experience;
+};
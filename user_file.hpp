@@ -0,0 +1,243 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "user.hpp"
+
+// Binary user snapshot that is used in place through a read-only mmap.
+//
+//   Header   magic, version, seq, counts and section offsets
+//   Index    `slots` uint64 entries, open addressing with linear probing;
+//            each is (hash >> 32) << 32 | (record + 1), 0 when empty
+//   Records  `count` fixed 32-byte records
+//   Strings  name and password bytes of every record, back to back
+//
+// Opening the file is an mmap and a header check, so the lobby can serve
+// requests before a single user has been read; pages are faulted in by
+// the lookups that need them. Only account fields are stored. Index
+// entries and records are bounds-checked as they are read instead, and one
+// that points outside the file is treated as missing.
+//
+// The file is never modified once written. write() builds a new one under
+// a temp name, syncs it and renames it over the old one, so a crash leaves
+// either the old snapshot or the new one.
+class UserFile {
+public:
+    static const uint32_t VERSION = 1;
+
+    UserFile() = default;
+    ~UserFile() { close(); }
+    UserFile(const UserFile &) = delete;
+    UserFile &operator=(const UserFile &) = delete;
+
+    bool open(const std::string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Header)) { ::close(fd); return false; }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        base_ = (const char*)p;
+        size_ = st.st_size;
+        if (!valid()) { close(); return false; }
+        madvise(p, size_, MADV_RANDOM);
+        return true;
+    }
+
+    void close() {
+        if (base_) munmap((void*)base_, size_);
+        base_ = nullptr;
+        size_ = 0;
+    }
+
+    bool is_open() const { return base_ != nullptr; }
+    size_t bytes() const { return size_; }
+    uint64_t seq() const { return header().seq; }
+    size_t size() const { return base_ ? header().count : 0; }
+
+    // Copies the account fields of `name` into u. False if it is not here.
+    bool find(const std::string &name, User &u) const {
+        const Record *r = lookup(name);
+        if (!r) return false;
+        decode(*r, u);
+        return true;
+    }
+
+    bool contains(const std::string &name) const { return lookup(name) != nullptr; }
+
+    // Calls fn(name, const User&) for every record, in file order.
+    template <class F>
+    void for_each(F &&fn) const {
+        User u;
+        for (size_t i = 0; i < size(); ++i) {
+            const Record &r = records()[i];
+            if (!in_bounds(r)) continue;
+            decode(r, u);
+            fn(std::string(strings() + r.str_off, r.name_len), (const User&)u);
+        }
+    }
+
+    // Writes users as a new file at path covering log records up to seq.
+    static bool write(const std::string &path, const std::vector<std::pair<std::string, User>> &users,
+                      uint64_t seq) {
+        uint64_t count = users.size();
+        uint64_t slots = 16;
+        while (slots < count + count / 2) slots <<= 1;
+        uint64_t str_bytes = 0;
+        for (auto &kv : users) {
+            if (kv.first.size() > UINT16_MAX || kv.second.password.size() > UINT16_MAX) {
+                fprintf(stderr, "[DEBUG] snapshot: user %.32s does not fit a record\n", kv.first.c_str());
+                return false;
+            }
+            str_bytes += kv.first.size() + kv.second.password.size();
+        }
+
+        Header h{};
+        memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.version = VERSION;
+        h.seq = seq;
+        h.count = count;
+        h.slots = slots;
+        h.index_off = sizeof(Header);
+        h.records_off = h.index_off + slots * sizeof(uint64_t);
+        h.strings_off = h.records_off + count * sizeof(Record);
+        h.file_size = h.strings_off + str_bytes;
+
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) { perror("[DEBUG] snapshot open"); return false; }
+        if (ftruncate(fd, h.file_size) < 0) { perror("[DEBUG] snapshot size"); ::close(fd); return false; }
+        void *p = mmap(nullptr, h.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) { perror("[DEBUG] snapshot mmap"); ::close(fd); return false; }
+
+        char *out = (char*)p;
+        memcpy(out, &h, sizeof(h));
+        uint64_t *index = (uint64_t*)(out + h.index_off);
+        Record *recs = (Record*)(out + h.records_off);
+        char *strs = out + h.strings_off;
+        uint64_t off = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            const std::string &name = users[i].first;
+            const User &u = users[i].second;
+            Record &r = recs[i];
+            r.str_off = off;
+            r.name_len = name.size();
+            r.pw_len = u.password.size();
+            r.login_count = u.login_count;
+            r.experience = u.experience;
+            memcpy(strs + off, name.data(), name.size());
+            memcpy(strs + off + name.size(), u.password.data(), u.password.size());
+            off += name.size() + u.password.size();
+
+            uint64_t hash = hash_of(name.data(), name.size());
+            uint64_t s = hash & (slots - 1);
+            while (index[s]) s = (s + 1) & (slots - 1);
+            index[s] = (hash >> 32 << 32) | (i + 1);
+        }
+        bool ok = msync(p, h.file_size, MS_SYNC) == 0;
+        munmap(p, h.file_size);
+        ok = fsync(fd) == 0 && ok;
+        ::close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) < 0) { perror("[DEBUG] snapshot commit"); return false; }
+        return true;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'N','P','U','S','E','R','S','\0'};
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t seq;
+        uint64_t count;
+        uint64_t slots;
+        uint64_t index_off;
+        uint64_t records_off;
+        uint64_t strings_off;
+        uint64_t file_size;
+    };
+
+    struct Record {
+        uint64_t str_off;
+        uint16_t name_len;
+        uint16_t pw_len;
+        uint32_t reserved;
+        int32_t login_count;
+        int32_t experience;
+        uint64_t reserved2;
+    };
+    static_assert(sizeof(Record) == 32, "records are a fixed 32 bytes");
+
+    // FNV-1a; the index is on disk, so the hash must not change between runs.
+    static uint64_t hash_of(const char *s, size_t n) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < n; ++i) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ull;
+        return h;
+    }
+
+    const Header &header() const { return *(const Header*)base_; }
+    const uint64_t *index() const { return (const uint64_t*)(base_ + header().index_off); }
+    const Record *records() const { return (const Record*)(base_ + header().records_off); }
+    const char *strings() const { return base_ + header().strings_off; }
+
+    bool valid() const {
+        const Header &h = header();
+        if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+        if (h.slots == 0 || (h.slots & (h.slots - 1)) || h.slots <= h.count) return false;
+        // Keeps the section arithmetic below from overflowing; index
+        // entries only have 32 bits for the record.
+        if (h.slots > size_ / sizeof(uint64_t) || h.count > size_ / sizeof(Record) || h.count >= UINT32_MAX) {
+            return false;
+        }
+        return h.index_off == sizeof(Header) &&
+               h.records_off == h.index_off + h.slots * sizeof(uint64_t) &&
+               h.strings_off == h.records_off + h.count * sizeof(Record) &&
+               h.file_size == size_ && h.strings_off <= size_;
+    }
+
+    // Whether the record's strings lie inside the strings section.
+    bool in_bounds(const Record &r) const {
+        uint64_t str_bytes = size_ - header().strings_off;
+        return r.str_off <= str_bytes && (uint64_t)r.name_len + r.pw_len <= str_bytes - r.str_off;
+    }
+
+    // Probes at most every slot once, so a corrupt index without an empty
+    // slot still ends.
+    const Record *lookup(const std::string &name) const {
+        if (!base_) return nullptr;
+        uint64_t hash = hash_of(name.data(), name.size());
+        uint64_t mask = header().slots - 1;
+        const uint64_t *idx = index();
+        uint64_t s = hash & mask;
+        for (uint64_t probes = 0; probes <= mask && idx[s]; ++probes, s = (s + 1) & mask) {
+            if ((idx[s] >> 32) != (hash >> 32)) continue;
+            uint64_t rec = (idx[s] & 0xffffffffu) - 1;
+            if (rec >= header().count) continue;
+            const Record &r = records()[rec];
+            if (!in_bounds(r)) continue;
+            if (r.name_len == name.size() && memcmp(strings() + r.str_off, name.data(), name.size()) == 0) {
+                return &r;
+            }
+        }
+        return nullptr;
+    }
+
+    void decode(const Record &r, User &u) const {
+        u.password.assign(strings() + r.str_off + r.name_len, r.pw_len);
+        u.login_count = r.login_count;
+        u.experience = r.experience;
+    }
+
+    const char *base_ = nullptr;
+    size_t size_ = 0;
+};
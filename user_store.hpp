@@ -0,0 +1,317 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "user.hpp"
+#include "user_file.hpp"
+
+// User table split into independently locked shards by username hash.
+// Lookups take one shard's shared lock, so logins only contend with
+// writers that hash to the same shard. Presence is kept in PresenceTable.
+//
+// Each shard is a flat open-addressing index over dense rows instead of a
+// node per user. Names and passwords live back to back in one arena per
+// shard and account fields in an array indexed by row. Users are never
+// removed, so rows and arena bytes are only appended.
+//
+// The table can sit on top of a read-only UserFile. Users are then copied
+// out of the file into their shard the first time they are looked up, and
+// the shard's copy shadows the file from then on.
+class UserStore {
+public:
+    explicit UserStore(size_t shards = 64) {
+        size_t n = 1;
+        while (n < shards) n <<= 1;
+        shift_ = 64;
+        for (size_t m = n; m > 1; m >>= 1) --shift_;
+        nshards_ = n;
+        shards_.reset(new Shard[n]);
+    }
+
+    // Optional hook told how long each insert/update waited for its shard's
+    // exclusive lock and then held it, in ns.
+    using LockObserver = void (*)(uint64_t wait_ns, uint64_t hold_ns);
+    void set_lock_observer(LockObserver f) { observer_ = f; }
+
+    // Serves users missing from memory out of base, which must outlive the
+    // store. Call before any users are added.
+    void set_base(const UserFile *base) {
+        base_ = base;
+        count_.store(base ? base->size() : 0, std::memory_order_relaxed);
+    }
+
+    // Adds a new user unless the name is taken. on_insert(UserRef) runs
+    // under the shard lock, which is where the caller logs the change.
+    template <class F>
+    bool insert(const std::string &name, const User &u, F &&on_insert) {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        WriteLock g(s.m, observer_);
+        if (s.find(name, h) >= 0 || (base_ && base_->contains(name))) return false;
+        uint32_t row = s.add(name, h, u);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        on_insert(s.ref(row));
+        return true;
+    }
+
+    // Runs fn(UserRef) under the shard's exclusive lock. False if no such user.
+    template <class F>
+    bool update(const std::string &name, F &&fn) {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        WriteLock g(s.m, observer_);
+        int64_t row = s.find(name, h);
+        if (row < 0 && (row = fault_in(s, name, h)) < 0) return false;
+        fn(s.ref(row));
+        return true;
+    }
+
+    // Runs fn(UserView) under the shard's shared lock. False if no such user.
+    // A user still only in the base file is first copied in under the
+    // exclusive lock.
+    template <class F>
+    bool read(const std::string &name, F &&fn) const {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        {
+            std::shared_lock<std::shared_mutex> g(s.m);
+            int64_t row = s.find(name, h);
+            if (row >= 0) {
+                fn(s.view(row));
+                return true;
+            }
+            if (!base_) return false;
+        }
+        WriteLock g(s.m, observer_);
+        int64_t row = s.find(name, h);
+        if (row < 0 && (row = fault_in(s, name, h)) < 0) return false;
+        fn(s.view(row));
+        return true;
+    }
+
+    // Copies the whole table, one shard at a time under its shared lock,
+    // then the users still only in the base file without taking any lock.
+    // Writers carry on meanwhile, so the copy is no cut: each user is as of
+    // some moment during the call. Every change made after the call began
+    // is logged after the log position read before it, so replaying the
+    // log from there brings the copy up to date.
+    std::vector<std::pair<std::string, User>> snapshot() const {
+        std::vector<std::pair<std::string, User>> out;
+        out.reserve(size());
+        for (size_t i = 0; i < nshards_; ++i) {
+            Shard &s = shards_[i];
+            std::shared_lock<std::shared_mutex> g(s.m);
+            for (uint32_t row = 0; row < s.accounts.size(); ++row) {
+                out.emplace_back(std::string(s.name_of(row)), s.value(row));
+            }
+        }
+        if (base_) {
+            // Users faulted in after their shard was copied come from the
+            // file; anything they changed since is in the log. The names
+            // point into out, so out only grows once the set is gone.
+            std::vector<std::pair<std::string, User>> rest;
+            {
+                std::unordered_set<std::string_view> copied;
+                copied.reserve(out.size());
+                for (auto &kv : out) copied.insert(kv.first);
+                base_->for_each([&](const std::string &name, const User &u){
+                    if (!copied.count(name)) rest.emplace_back(name, u);
+                });
+            }
+            out.insert(out.end(), std::make_move_iterator(rest.begin()), std::make_move_iterator(rest.end()));
+        }
+        return out;
+    }
+
+    // Calls fn(name, UserView) for every user, one shard at a time under its
+    // shared lock, then for users still only in the base file. Copies
+    // nothing and faults nothing in.
+    template <class F>
+    void for_each(F &&fn) const {
+        for (size_t i = 0; i < nshards_; ++i) {
+            Shard &s = shards_[i];
+            std::shared_lock<std::shared_mutex> g(s.m);
+            for (uint32_t row = 0; row < s.accounts.size(); ++row) fn(s.name_of(row), s.view(row));
+        }
+        if (base_) {
+            base_->for_each([&](const std::string &name, const User &u){
+                uint64_t h = hash_of(name);
+                Shard &s = shard_for(h);
+                std::shared_lock<std::shared_mutex> g(s.m);
+                if (s.find(name, h) < 0) {
+                    fn(std::string_view(name), UserView{u.password, u.login_count, u.experience});
+                }
+            });
+        }
+    }
+
+    // Inserts or overwrites without a callback; used while loading.
+    void put(const std::string &name, const User &u) {
+        uint64_t h = hash_of(name);
+        Shard &s = shard_for(h);
+        std::unique_lock<std::shared_mutex> g(s.m);
+        int64_t row = s.find(name, h);
+        if (row >= 0) {
+            s.assign(row, u);
+            return;
+        }
+        s.add(name, h, u);
+        if (!(base_ && base_->contains(name))) count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t size() const { return count_.load(std::memory_order_relaxed); }
+
+private:
+    // Cold per-user fields. Strings are (offset, length) into the arena.
+    struct Account {
+        uint32_t name_off = 0, name_len = 0;
+        uint32_t pw_off = 0, pw_len = 0;
+        int login_count = 0;
+        int experience = 0;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex m;
+        // (hash >> 32) << 32 | (row + 1) per slot, 0 when empty; linear
+        // probing, kept at most 3/4 full.
+        std::vector<uint64_t> slots;
+        std::string arena;
+        std::vector<Account> accounts;
+
+        int64_t find(std::string_view name, uint64_t h) const {
+            if (slots.empty()) return -1;
+            uint64_t mask = slots.size() - 1;
+            for (uint64_t i = h & mask; slots[i]; i = (i + 1) & mask) {
+                if ((slots[i] >> 32) != (h >> 32)) continue;
+                uint32_t row = (uint32_t)slots[i] - 1;
+                if (name_of(row) == name) return row;
+            }
+            return -1;
+        }
+
+        uint32_t add(std::string_view name, uint64_t h, const User &u) {
+            if ((accounts.size() + 1) * 4 > slots.size() * 3) grow();
+            uint32_t row = accounts.size();
+            Account a;
+            a.name_off = intern(name);
+            a.name_len = name.size();
+            accounts.push_back(a);
+            assign(row, u);
+            place(h, row);
+            return row;
+        }
+
+        void assign(uint32_t row, const User &u) {
+            Account &a = accounts[row];
+            if (std::string_view(arena.data() + a.pw_off, a.pw_len) != u.password) {
+                a.pw_off = intern(u.password);
+                a.pw_len = u.password.size();
+            }
+            a.login_count = u.login_count;
+            a.experience = u.experience;
+        }
+
+        std::string_view name_of(uint32_t row) const {
+            return std::string_view(arena.data() + accounts[row].name_off, accounts[row].name_len);
+        }
+
+        std::string_view password_of(uint32_t row) const {
+            return std::string_view(arena.data() + accounts[row].pw_off, accounts[row].pw_len);
+        }
+
+        UserRef ref(uint32_t row) {
+            Account &a = accounts[row];
+            return UserRef{password_of(row), a.login_count, a.experience};
+        }
+
+        UserView view(uint32_t row) const {
+            const Account &a = accounts[row];
+            return UserView{password_of(row), a.login_count, a.experience};
+        }
+
+        User value(uint32_t row) const {
+            User u;
+            const Account &a = accounts[row];
+            u.password = std::string(password_of(row));
+            u.login_count = a.login_count;
+            u.experience = a.experience;
+            return u;
+        }
+
+        uint32_t intern(std::string_view str) {
+            uint32_t off = arena.size();
+            arena.append(str.data(), str.size());
+            return off;
+        }
+
+        void place(uint64_t h, uint32_t row) {
+            uint64_t mask = slots.size() - 1;
+            uint64_t i = h & mask;
+            while (slots[i]) i = (i + 1) & mask;
+            slots[i] = (h >> 32 << 32) | (row + 1);
+        }
+
+        void grow() {
+            slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+            for (uint32_t row = 0; row < accounts.size(); ++row) place(hash_of(name_of(row)), row);
+        }
+    };
+
+    // Exclusive shard lock that reports its wait and hold time to the
+    // observer, when there is one.
+    class WriteLock {
+    public:
+        WriteLock(std::shared_mutex &m, LockObserver obs) : m_(m), obs_(obs) {
+            if (obs_) t0_ = std::chrono::steady_clock::now();
+            m_.lock();
+            if (obs_) t1_ = std::chrono::steady_clock::now();
+        }
+        ~WriteLock() {
+            if (!obs_) { m_.unlock(); return; }
+            auto t2 = std::chrono::steady_clock::now();
+            m_.unlock();
+            obs_(std::chrono::duration_cast<std::chrono::nanoseconds>(t1_ - t0_).count(),
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1_).count());
+        }
+        WriteLock(const WriteLock &) = delete;
+        WriteLock &operator=(const WriteLock &) = delete;
+
+    private:
+        std::shared_mutex &m_;
+        LockObserver obs_;
+        std::chrono::steady_clock::time_point t0_, t1_;
+    };
+
+    static uint64_t hash_of(std::string_view name) { return std::hash<std::string_view>{}(name); }
+
+    // Copies name from the base file into its shard and returns its row, or
+    // -1. Call under the shard's exclusive lock.
+    int64_t fault_in(Shard &s, const std::string &name, uint64_t h) const {
+        User u;
+        if (!base_ || !base_->find(name, u)) return -1;
+        return s.add(name, h, u);
+    }
+
+    // Fibonacci hashing on top of the hash so the shard index does not
+    // reuse the low bits the shard's index probes from.
+    Shard &shard_for(uint64_t h) const {
+        if (nshards_ == 1) return shards_[0];
+        return shards_[(h * 0x9E3779B97F4A7C15ull) >> shift_];
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+    size_t nshards_ = 1;
+    unsigned shift_ = 64;
+    std::atomic<size_t> count_{0};
+    LockObserver observer_ = nullptr;
+    const UserFile *base_ = nullptr;
+};
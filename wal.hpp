@@ -0,0 +1,308 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "json.hpp"
+#include "uring.hpp"
+
+// Append-only mutation log with group commit.
+//
+// append() only queues a record and hands back its sequence number. A
+// single writer thread writes everything queued so far with one write()
+// and one fdatasync(), then wakes every caller whose record made it to
+// disk. Concurrent requests therefore share one fsync instead of paying
+// for one each.
+//
+// Each record is one compact JSON line carrying a "seq" field. A snapshot
+// remembers the last seq it covers, so replay can skip older records.
+//
+// With use_uring() the writer submits each batch's write and fdatasync as
+// one linked pair through io_uring, so a batch costs a single syscall.
+//
+// A batch whose write or fdatasync fails is never reported durable. The
+// file is cut back to the end of the last durable batch and the log stops:
+// later records are dropped, and waiting for any of them returns false.
+class WriteAheadLog {
+public:
+    ~WriteAheadLog() { close(); }
+
+    // Call before open(). Falls back to write()/fdatasync() if the kernel
+    // has no io_uring.
+    void use_uring(bool on) { use_uring_ = on; }
+
+    // Called on the writer thread after every batch becomes durable, and
+    // once when the log fails, for callers that poll durable_seq() and
+    // failed() instead of blocking in wait_durable().
+    void set_durable_hook(std::function<void()> fn) { durable_hook_ = std::move(fn); }
+
+    // Opens (or creates) the log for appending. Sequence numbers continue
+    // after next_seq - 1.
+    bool open(const std::string &path, uint64_t next_seq) {
+        path_ = path;
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) return false;
+        terminate_torn_record();
+        bytes_ = file_size();
+        last_seq_ = durable_seq_ = next_seq - 1;
+        stop_ = false;
+        writer_ = std::thread([this]{ writer_loop(); });
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> g(mu_);
+            if (fd_ < 0) return;
+            stop_ = true;
+        }
+        work_cv_.notify_one();
+        if (writer_.joinable()) writer_.join();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Queues a record and returns its sequence number. Callers that mutate
+    // shared state should append while still holding that state's lock so
+    // log order matches the order the mutations happened in.
+    uint64_t append(nlohmann::json rec) {
+        std::lock_guard<std::mutex> g(mu_);
+        uint64_t seq = ++last_seq_;
+        rec["seq"] = seq;
+        pending_ += rec.dump();
+        pending_.push_back('\n');
+        work_cv_.notify_one();
+        return seq;
+    }
+
+    // Blocks until the record with this seq is on disk. False if it never
+    // will be because the log failed or is closed.
+    bool wait_durable(uint64_t seq) {
+        std::unique_lock<std::mutex> lk(mu_);
+        done_cv_.wait(lk, [&]{ return durable_seq_ >= seq || failed_ || fd_ < 0; });
+        return durable_seq_ >= seq;
+    }
+
+    // Whether a write or sync failed; nothing after durable_seq() will
+    // become durable.
+    bool failed() const {
+        std::lock_guard<std::mutex> g(mu_);
+        return failed_;
+    }
+
+    uint64_t durable_seq() const {
+        std::lock_guard<std::mutex> g(mu_);
+        return durable_seq_;
+    }
+
+    uint64_t last_seq() const {
+        std::lock_guard<std::mutex> g(mu_);
+        return last_seq_;
+    }
+
+    // Bytes in the current log file, including queued records.
+    uint64_t bytes() const {
+        std::lock_guard<std::mutex> g(mu_);
+        return bytes_ + pending_.size();
+    }
+
+    // Flushes everything queued, moves the current file to <path>.old and
+    // starts an empty log. upto is set to the last seq in the moved file;
+    // every later record goes to the new one. Used by compaction: the
+    // caller rotates, snapshots state at or after upto, writes the snapshot
+    // and then removes the .old file. An existing .old file is replaced, so
+    // the caller must not rotate while one is still waiting for its
+    // snapshot.
+    //
+    // False if nothing was rotated; the log then keeps appending to <path>.
+    // If the moved file cannot even be put back, the log fails.
+    bool rotate(uint64_t &upto) {
+        std::unique_lock<std::mutex> lk(mu_);
+        done_cv_.wait(lk, [&]{ return (pending_.empty() && !writing_) || failed_ || fd_ < 0; });
+        upto = last_seq_;
+        if (failed_ || fd_ < 0) return false;
+        if (std::rename(path_.c_str(), old_path().c_str()) < 0) {
+            perror("[WAL] rotate");
+            return false;
+        }
+        int fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("[WAL] rotate");
+            // fd_ still writes to the moved file; move it back under path_.
+            if (std::rename(old_path().c_str(), path_.c_str()) < 0) {
+                perror("[WAL] rotate");
+                fprintf(stderr, "[WAL] Log failed; %s is stuck at %s\n", path_.c_str(), old_path().c_str());
+                failed_ = true;
+                done_cv_.notify_all();
+            }
+            return false;
+        }
+        ::close(fd_);
+        fd_ = fd;
+        bytes_ = 0;
+        return true;
+    }
+
+    std::string old_path() const { return path_ + ".old"; }
+
+    // Calls fn for every intact record in the file with seq > after and
+    // returns the highest seq seen. A torn record left by a crash is skipped.
+    static uint64_t replay(const std::string &path, uint64_t after,
+                           const std::function<void(const nlohmann::json&)> &fn) {
+        std::ifstream in(path);
+        std::string line;
+        uint64_t max_seq = after;
+        while (std::getline(in, line)) {
+            if (line.empty()) continue;
+            nlohmann::json rec;
+            try { rec = nlohmann::json::parse(line); } catch (...) { continue; }
+            uint64_t seq = rec.value("seq", (uint64_t)0);
+            if (seq <= after) continue;
+            fn(rec);
+            if (seq > max_seq) max_seq = seq;
+        }
+        return max_seq;
+    }
+
+private:
+    void writer_loop() {
+        Uring ring;
+        if (use_uring_ && (!ring.init(4) || !ring.supports({IORING_OP_WRITE, IORING_OP_FSYNC}))) {
+            fprintf(stderr, "[WAL] io_uring unavailable, using write/fdatasync\n");
+            ring.close();
+        }
+        std::unique_lock<std::mutex> lk(mu_);
+        while (true) {
+            work_cv_.wait(lk, [&]{ return stop_ || !pending_.empty(); });
+            if (pending_.empty() && stop_) break;
+            if (failed_) {
+                pending_.clear();
+                continue;
+            }
+            std::string batch;
+            batch.swap(pending_);
+            uint64_t upto = last_seq_;
+            int fd = fd_;
+            writing_ = true;
+            lk.unlock();
+
+            bool ok = ring.ok() ? write_batch_uring(ring, fd, batch) : write_batch(fd, batch);
+
+            lk.lock();
+            writing_ = false;
+            if (ok) {
+                bytes_ += batch.size();
+                durable_seq_ = upto;
+            } else {
+                // Part of the batch may be in the file, and after a failed
+                // sync nothing written since the last good one can be
+                // trusted. Cut back to it so replay never sees a torn line
+                // glued to a later record, and stop logging.
+                fprintf(stderr, "[WAL] Log failed; records after seq %llu are not durable\n",
+                        (unsigned long long)durable_seq_);
+                if (ftruncate(fd, bytes_) < 0 || fdatasync(fd) < 0) perror("[WAL] truncate");
+                failed_ = true;
+                pending_.clear();
+            }
+            done_cv_.notify_all();
+            if (durable_hook_) {
+                lk.unlock();
+                durable_hook_();
+                lk.lock();
+            }
+        }
+    }
+
+    // True once the whole batch is written and synced.
+    static bool write_batch(int fd, const std::string &batch) {
+        size_t off = 0;
+        while (off < batch.size()) {
+            ssize_t n = ::write(fd, batch.data() + off, batch.size() - off);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("[WAL] write");
+                return false;
+            }
+            off += n;
+        }
+        if (fdatasync(fd) < 0) {
+            perror("[WAL] fdatasync");
+            return false;
+        }
+        return true;
+    }
+
+    // The fdatasync is linked to the write, so it only runs once the write
+    // completed in full; a short write cancels it and the rest is retried.
+    static bool write_batch_uring(Uring &ring, int fd, const std::string &batch) {
+        size_t off = 0;
+        while (true) {
+            io_uring_sqe *w = ring.sqe(), *f = ring.sqe();
+            uring_prep(w, IORING_OP_WRITE, fd, batch.data() + off, batch.size() - off, (uint64_t)-1, 0);
+            w->flags = IOSQE_IO_LINK;
+            uring_prep(f, IORING_OP_FSYNC, fd, nullptr, 0, 0, 1);
+            f->fsync_flags = IORING_FSYNC_DATASYNC;
+            int wres = 0, fres = 0;
+            unsigned got = 0;
+            while (got < 2) {
+                if (ring.submit(2 - got) < 0) { perror("[WAL] io_uring_enter"); return false; }
+                got += ring.drain([&](uint64_t which, int res, unsigned){ (which ? fres : wres) = res; });
+            }
+            if (wres < 0) {
+                if (wres == -EINTR || wres == -EAGAIN) continue;
+                errno = -wres;
+                perror("[WAL] write");
+                return false;
+            }
+            off += wres;
+            if (off < batch.size()) continue;
+            if (fres < 0) {
+                errno = -fres;
+                perror("[WAL] fdatasync");
+                return false;
+            }
+            return true;
+        }
+    }
+
+    // A crash can leave a half-written last line; make sure the next record
+    // starts on a line of its own.
+    void terminate_torn_record() {
+        struct stat st{};
+        if (fstat(fd_, &st) < 0 || st.st_size == 0) return;
+        int rfd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (rfd < 0) return;
+        char last = '\n';
+        if (pread(rfd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+            if (::write(fd_, "\n", 1) < 0) perror("[WAL] write");
+        }
+        ::close(rfd);
+    }
+
+    uint64_t file_size() const {
+        struct stat st{};
+        return fstat(fd_, &st) == 0 ? (uint64_t)st.st_size : 0;
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    mutable std::mutex mu_;
+    std::condition_variable work_cv_, done_cv_;
+    std::thread writer_;
+    std::string pending_;
+    uint64_t last_seq_ = 0;
+    uint64_t durable_seq_ = 0;
+    uint64_t bytes_ = 0;
+    bool writing_ = false;
+    bool failed_ = false;
+    bool stop_ = false;
+    bool use_uring_ = false;
+    std::function<void()> durable_hook_;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "json.hpp"
+
+// Encodings a TCP connection can speak. Every connection starts with
+// newline-delimited JSON; a HELLO exchange may switch it to one of the
+// binary encodings, which are sent as a 4-byte big-endian length followed
+// by the CBOR or MessagePack payload.
+enum class WireFormat { Json, Cbor, MsgPack };
+
+inline const char* wire_name(WireFormat f) {
+    switch (f) {
+    case WireFormat::Cbor: return "cbor";
+    case WireFormat::MsgPack: return "msgpack";
+    default: return "json";
+    }
+}
+
+inline bool wire_from_name(const std::string &name, WireFormat &out) {
+    if (name == "json") out = WireFormat::Json;
+    else if (name == "cbor") out = WireFormat::Cbor;
+    else if (name == "msgpack") out = WireFormat::MsgPack;
+    else return false;
+    return true;
+}
+
+// Formats this build can speak, most preferred first.
+inline nlohmann::json wire_offer() { return {"cbor", "msgpack", "json"}; }
+
+// Picks the first entry of a peer's offer that we support; JSON otherwise.
+inline WireFormat wire_choose(const nlohmann::json &offer) {
+    WireFormat f = WireFormat::Json;
+    if (!offer.is_array()) return f;
+    for (auto &name : offer) {
+        if (name.is_string() && wire_from_name(name.get<std::string>(), f)) return f;
+    }
+    return WireFormat::Json;
+}
+
+// Encodes j without framing, for transports that keep message boundaries
+// themselves (one UDP datagram per message).
+inline std::string encode_payload(const nlohmann::json &j, WireFormat f) {
+    if (f == WireFormat::Json) return j.dump();
+    std::string out;
+    if (f == WireFormat::Cbor) nlohmann::json::to_cbor(j, out);
+    else nlohmann::json::to_msgpack(j, out);
+    return out;
+}
+
+// Encodes j as one complete frame, ready to send.
+inline std::string encode_frame(const nlohmann::json &j, WireFormat f) {
+    if (f == WireFormat::Json) {
+        std::string s = j.dump();
+        s.push_back('\n');
+        return s;
+    }
+    std::string out(4, '\0');
+    if (f == WireFormat::Cbor) nlohmann::json::to_cbor(j, out);
+    else nlohmann::json::to_msgpack(j, out);
+    uint32_t len = out.size() - 4;
+    out[0] = (char)(len >> 24);
+    out[1] = (char)(len >> 16);
+    out[2] = (char)(len >> 8);
+    out[3] = (char)len;
+    return out;
+}
+
+// Decodes one frame payload as returned by FrameReader. Throws on bad input.
+inline nlohmann::json decode_payload(const std::string &payload, WireFormat f) {
+    switch (f) {
+    case WireFormat::Cbor: return nlohmann::json::from_cbor(payload);
+    case WireFormat::MsgPack: return nlohmann::json::from_msgpack(payload);
+    default: return nlohmann::json::parse(payload);
+    }
+}